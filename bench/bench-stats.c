@@ -0,0 +1,39 @@
+#include "bench-stats.h"
+
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+
+static int compare_doubles(const void *a, const void *b)
+{
+	const double da = *(const double *)a, db = *(const double *)b;
+	return (da > db) - (da < db);
+}
+
+bench_stats_t bench_compute_stats(double *samples, int count)
+{
+	bench_stats_t stats = {0};
+	if (!count)
+		return stats;
+
+	double sum = 0., sum_sq = 0.;
+	for (int i = 0; i < count; ++i) {
+		sum += samples[i];
+		sum_sq += samples[i] * samples[i];
+	}
+
+	qsort(samples, count, sizeof(*samples), compare_doubles);
+	stats.mean = sum / count;
+	stats.stddev = sqrt(fmax(0., sum_sq / count - stats.mean * stats.mean));
+	stats.min = samples[0];
+	stats.max = samples[count - 1];
+	stats.p99 = samples[(int)((count - 1) * .99)];
+	return stats;
+}
+
+uint64_t bench_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <stdint.h>
+
+/* Summary of a set of samples, in whatever unit they were taken */
+typedef struct {
+	double mean, stddev, min, max, p99;
+} bench_stats_t;
+
+/**
+ * Summarizes count samples, sorting them in place
+ */
+bench_stats_t bench_compute_stats(double *samples, int count);
+
+/**
+ * @return CLOCK_MONOTONIC time in nanoseconds
+ */
+uint64_t bench_now_ns(void);
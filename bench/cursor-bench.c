@@ -0,0 +1,519 @@
+/* Microbenchmark and stress test of the X cursor path.
+ *
+ * Starts a private Xvfb (or uses --display), moves the pointer and changes
+ * its shape at the requested rates from a second connection, and runs what
+ * dmabuf_source_video_tick and dmabuf_source_render do for the cursor at
+ * --fps: the XFixes round trip, xcb_xcursor_update, xcb_xcursor_sample_at and
+ * xcb_xcursor_render.
+ *
+ * libobs is not used at all. Graphics and bmem calls made by the cursor
+ * code land in the counting stubs below, so that what is measured is the
+ * CPU side of the path, texture uploads and allocations, with no GPU
+ * needed. The implementation under test comes from
+ * KMSGRAB_CURSOR_BENCH_SOURCES, so a replacement for src/xcursor-xcb.c with
+ * the same interface can be compared against it.
+ *
+ * Exits with non-zero status if mean tick time exceeds --max-mean-us or
+ * there are more texture uploads per shape change than
+ * --max-uploads-per-shape. */
+
+#define _GNU_SOURCE
+
+#include "xcursor-xcb.h"
+#include "bench-stats.h"
+
+#include <xcb/xcb.h>
+#include <xcb/xfixes.h>
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+
+/* Glyphs of the core cursor font, a mix of sizes and hotspots */
+static const uint16_t cursor_glyphs[] = {
+	68,  /* left_ptr */
+	152, /* xterm */
+	60,  /* hand2 */
+	150, /* watch */
+	34,  /* crosshair */
+	52,  /* fleur */
+	108, /* sb_h_double_arrow */
+	92,  /* question_arrow */
+};
+
+#define NUM_SHAPES (sizeof(cursor_glyphs) / sizeof(*cursor_glyphs))
+
+typedef struct {
+	int width, height;
+	const char *display;
+	int ticks;
+	double fps;
+	double moves_per_sec;
+	double shapes_per_sec;
+	double max_mean_us;
+	double max_uploads_per_shape;
+} bench_options_t;
+
+/* What the cursor code asked of graphics and bmem */
+static struct {
+	long texture_creates;
+	long texture_updates;
+	long texture_destroys;
+	long long upload_bytes;
+	long draws;
+	long allocs;
+	long frees;
+} counters;
+
+/* Graphics stubs */
+
+struct gs_texture {
+	uint32_t width, height;
+};
+
+gs_texture_t *gs_texture_create(uint32_t width, uint32_t height,
+				enum gs_color_format color_format,
+				uint32_t levels, const uint8_t **data,
+				uint32_t flags)
+{
+	(void)color_format;
+	(void)levels;
+	(void)data;
+	(void)flags;
+
+	gs_texture_t *tex = malloc(sizeof(*tex));
+	tex->width = width;
+	tex->height = height;
+	counters.texture_creates++;
+	counters.upload_bytes += (long long)width * height * 4;
+	return tex;
+}
+
+void gs_texture_set_image(gs_texture_t *tex, const uint8_t *data,
+			  uint32_t linesize, bool invert)
+{
+	(void)data;
+	(void)invert;
+	counters.texture_updates++;
+	counters.upload_bytes += (long long)linesize * tex->height;
+}
+
+void gs_texture_destroy(gs_texture_t *tex)
+{
+	counters.texture_destroys++;
+	free(tex);
+}
+
+bool gs_get_linear_srgb(void)
+{
+	return false;
+}
+
+bool gs_framebuffer_srgb_enabled(void)
+{
+	return false;
+}
+
+void gs_enable_framebuffer_srgb(bool enable)
+{
+	(void)enable;
+}
+
+gs_effect_t *gs_get_effect(void)
+{
+	return NULL;
+}
+
+gs_eparam_t *gs_effect_get_param_by_name(const gs_effect_t *effect,
+					 const char *name)
+{
+	(void)effect;
+	(void)name;
+	return NULL;
+}
+
+void gs_effect_set_texture(gs_eparam_t *param, gs_texture_t *val)
+{
+	(void)param;
+	(void)val;
+}
+
+void gs_effect_set_texture_srgb(gs_eparam_t *param, gs_texture_t *val)
+{
+	(void)param;
+	(void)val;
+}
+
+void gs_blend_state_push(void) {}
+
+void gs_blend_state_pop(void) {}
+
+void gs_blend_function(enum gs_blend_type src, enum gs_blend_type dest)
+{
+	(void)src;
+	(void)dest;
+}
+
+void gs_enable_color(bool red, bool green, bool blue, bool alpha)
+{
+	(void)red;
+	(void)green;
+	(void)blue;
+	(void)alpha;
+}
+
+void gs_matrix_push(void) {}
+
+void gs_matrix_pop(void) {}
+
+void gs_matrix_translate3f(float x, float y, float z)
+{
+	(void)x;
+	(void)y;
+	(void)z;
+}
+
+void gs_draw_sprite(gs_texture_t *tex, uint32_t flip, uint32_t width,
+		    uint32_t height)
+{
+	(void)tex;
+	(void)flip;
+	(void)width;
+	(void)height;
+	counters.draws++;
+}
+
+/* bmem stubs, bzalloc is inline on top of bmalloc */
+
+void *bmalloc(size_t size)
+{
+	counters.allocs++;
+	return malloc(size ? size : 1);
+}
+
+void *brealloc(void *ptr, size_t size)
+{
+	if (!ptr)
+		counters.allocs++;
+	return realloc(ptr, size ? size : 1);
+}
+
+void bfree(void *ptr)
+{
+	if (ptr)
+		counters.frees++;
+	free(ptr);
+}
+
+/* Benchmark */
+
+static void sleep_until_ns(uint64_t ns)
+{
+	const struct timespec ts = {
+		.tv_sec = ns / 1000000000ULL,
+		.tv_nsec = ns % 1000000000ULL,
+	};
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+	       EINTR)
+		;
+}
+
+/* Starts Xvfb on a free display, which it reports through -displayfd once
+ * it accepts connections */
+static pid_t start_xvfb(const bench_options_t *opts, char *display,
+			size_t display_size)
+{
+	int fds[2];
+	if (pipe(fds) != 0) {
+		fprintf(stderr, "Cannot create pipe: %s\n", strerror(errno));
+		return -1;
+	}
+
+	char displayfd[16], screen[32];
+	snprintf(displayfd, sizeof(displayfd), "%d", fds[1]);
+	snprintf(screen, sizeof(screen), "%dx%dx24", opts->width,
+		 opts->height);
+
+	const pid_t pid = fork();
+	if (pid == -1) {
+		fprintf(stderr, "Cannot fork(): %s\n", strerror(errno));
+		close(fds[0]);
+		close(fds[1]);
+		return -1;
+	} else if (pid == 0) {
+		close(fds[0]);
+		execlp("Xvfb", "Xvfb", "-displayfd", displayfd, "-screen", "0",
+		       screen, "-nolisten", "tcp", NULL);
+		fprintf(stderr, "Cannot execlp(Xvfb): %s\n", strerror(errno));
+		_exit(-1);
+	}
+
+	close(fds[1]);
+
+	char number[16] = {0};
+	size_t len = 0;
+	while (len < sizeof(number) - 1 && !strchr(number, '\n')) {
+		struct pollfd pfd = {.fd = fds[0], .events = POLLIN};
+		if (poll(&pfd, 1, 10000) <= 0)
+			break;
+		const ssize_t got =
+			read(fds[0], number + len, sizeof(number) - 1 - len);
+		if (got <= 0)
+			break;
+		len += got;
+	}
+	close(fds[0]);
+
+	if (!strchr(number, '\n')) {
+		fprintf(stderr, "Xvfb did not come up\n");
+		kill(pid, SIGTERM);
+		waitpid(pid, NULL, 0);
+		return -1;
+	}
+
+	snprintf(display, display_size, ":%d", atoi(number));
+	return pid;
+}
+
+static void sync_connection(xcb_connection_t *c)
+{
+	free(xcb_get_input_focus_reply(c, xcb_get_input_focus(c), NULL));
+}
+
+static bool bench_cursor(const bench_options_t *opts, const char *display)
+{
+	xcb_connection_t *xcb = xcb_connect(display, NULL);
+	xcb_connection_t *driver = xcb_connect(display, NULL);
+	if (xcb_connection_has_error(xcb) || xcb_connection_has_error(driver)) {
+		fprintf(stderr, "Cannot connect to %s\n", display);
+		xcb_disconnect(xcb);
+		xcb_disconnect(driver);
+		return false;
+	}
+
+	const xcb_screen_t *screen =
+		xcb_setup_roots_iterator(xcb_get_setup(driver)).data;
+	const xcb_window_t root = screen->root;
+	const int width = screen->width_in_pixels;
+	const int height = screen->height_in_pixels;
+
+	/* Pointer is over the root window, so its cursor is what XFixes
+	 * reports */
+	const xcb_font_t font = xcb_generate_id(driver);
+	xcb_open_font(driver, font, strlen("cursor"), "cursor");
+	xcb_cursor_t shapes[NUM_SHAPES];
+	for (size_t i = 0; i < NUM_SHAPES; ++i) {
+		shapes[i] = xcb_generate_id(driver);
+		xcb_create_glyph_cursor(driver, shapes[i], font, font,
+					cursor_glyphs[i], cursor_glyphs[i] + 1,
+					0, 0, 0, 0xffff, 0xffff, 0xffff);
+	}
+	xcb_close_font(driver, font);
+	sync_connection(driver);
+
+	const long allocs_before_init = counters.allocs;
+	xcb_xcursor_t *cursor = xcb_xcursor_init(xcb);
+	if (!cursor) {
+		fprintf(stderr, "Cannot initialize cursor\n");
+		xcb_disconnect(xcb);
+		xcb_disconnect(driver);
+		return false;
+	}
+
+	double *samples = malloc(sizeof(double) * opts->ticks);
+	long moves = 0, shape_changes = 0, tick_allocs = 0;
+	const uint64_t period_ns = (uint64_t)(1e9 / opts->fps);
+	const uint64_t start_ns = bench_now_ns();
+	const long counters_start_creates = counters.texture_creates;
+	const long counters_start_updates = counters.texture_updates;
+
+	for (int tick = 0; tick < opts->ticks; ++tick) {
+		sleep_until_ns(start_ns + tick * period_ns);
+
+		/* Catch up on whatever is due by now, from the other
+		 * connection, like another client would */
+		const double elapsed = (bench_now_ns() - start_ns) / 1e9;
+		bool changed = false;
+		for (; moves < (long)(elapsed * opts->moves_per_sec); ++moves) {
+			const double a = moves * .05;
+			const int16_t x =
+				(int16_t)(width / 2 + cos(a) * width / 3);
+			const int16_t y =
+				(int16_t)(height / 2 + sin(a) * height / 3);
+			xcb_warp_pointer(driver, XCB_NONE, root, 0, 0, 0, 0, x,
+					 y);
+			changed = true;
+		}
+		for (; shape_changes < (long)(elapsed * opts->shapes_per_sec);
+		     ++shape_changes) {
+			const uint32_t value =
+				shapes[shape_changes % NUM_SHAPES];
+			xcb_change_window_attributes(driver, root,
+						     XCB_CW_CURSOR, &value);
+			changed = true;
+		}
+		if (changed)
+			sync_connection(driver);
+
+		const long allocs = counters.allocs;
+		const uint64_t request_ns = bench_now_ns();
+
+		/* Same as dmabuf_source_video_tick and _render */
+		xcb_xfixes_get_cursor_image_cookie_t cur_c =
+			xcb_xfixes_get_cursor_image_unchecked(xcb);
+		xcb_xfixes_get_cursor_image_reply_t *cur_r =
+			xcb_xfixes_get_cursor_image_reply(xcb, cur_c, NULL);
+		const uint64_t reply_ns = bench_now_ns();
+		const uint64_t sample_ns =
+			request_ns + (reply_ns - request_ns) / 2;
+		xcb_xcursor_update(cursor, cur_r, sample_ns);
+		xcb_xcursor_sample_at(cursor, sample_ns - period_ns / 2);
+		xcb_xcursor_render(cursor);
+		free(cur_r);
+
+		samples[tick] = (bench_now_ns() - request_ns) / 1e3;
+		tick_allocs += counters.allocs - allocs;
+	}
+
+	const double duration = (bench_now_ns() - start_ns) / 1e9;
+	const long uploads = counters.texture_creates - counters_start_creates +
+			     counters.texture_updates - counters_start_updates;
+
+	xcb_xcursor_destroy(cursor);
+
+	const bench_stats_t stats = bench_compute_stats(samples, opts->ticks);
+	printf("tick     mean=%8.2fus stddev=%8.2fus min=%8.2fus max=%8.2fus p99=%8.2fus\n",
+	       stats.mean, stats.stddev, stats.min, stats.max, stats.p99);
+	printf("driven   moves=%ld (%.1f/s) shapes=%ld (%.1f/s) over %.2fs\n",
+	       moves, moves / duration, shape_changes,
+	       shape_changes / duration, duration);
+	printf("uploads  creates=%ld updates=%ld (%.1f/s, %.2f per shape change) bytes=%lld (%.1f KiB/s)\n",
+	       counters.texture_creates - counters_start_creates,
+	       counters.texture_updates - counters_start_updates,
+	       uploads / duration,
+	       shape_changes ? (double)uploads / shape_changes : 0.,
+	       counters.upload_bytes, counters.upload_bytes / duration / 1024.);
+	printf("allocs   per tick=%.3f total=%ld leaked=%ld draws=%ld\n",
+	       (double)tick_allocs / opts->ticks,
+	       counters.allocs - allocs_before_init,
+	       counters.allocs - counters.frees, counters.draws);
+
+	bool ok = true;
+	if (opts->max_mean_us > 0. && stats.mean > opts->max_mean_us) {
+		fprintf(stderr, "Mean tick time %.2fus exceeds %.2fus\n",
+			stats.mean, opts->max_mean_us);
+		ok = false;
+	}
+	/* One upload for the initial shape is always there */
+	if (opts->max_uploads_per_shape > 0. &&
+	    uploads - 1 > opts->max_uploads_per_shape * shape_changes) {
+		fprintf(stderr,
+			"%ld texture uploads for %ld shape changes exceed %.2f per change\n",
+			uploads, shape_changes, opts->max_uploads_per_shape);
+		ok = false;
+	}
+	if (counters.allocs != counters.frees) {
+		fprintf(stderr, "%ld allocations leaked\n",
+			counters.allocs - counters.frees);
+		ok = false;
+	}
+
+	free(samples);
+	for (size_t i = 0; i < NUM_SHAPES; ++i)
+		xcb_free_cursor(driver, shapes[i]);
+	xcb_disconnect(driver);
+	xcb_disconnect(xcb);
+	return ok;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"usage: %s [--size WxH] [--display :N] [--ticks N] [--fps F] [--moves-per-sec R] [--shapes-per-sec R] [--max-mean-us US] [--max-uploads-per-shape N]\n",
+		name);
+}
+
+static bool parse_options(int argc, char *argv[], bench_options_t *opts)
+{
+	opts->width = 1920;
+	opts->height = 1080;
+	opts->display = NULL;
+	opts->ticks = 600;
+	opts->fps = 60.;
+	opts->moves_per_sec = 120.;
+	opts->shapes_per_sec = 4.;
+	opts->max_mean_us = 0.;
+	opts->max_uploads_per_shape = 0.;
+
+	for (int i = 1; i < argc; ++i) {
+		const char *arg = argv[i];
+		const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+		if (!value)
+			return false;
+		++i;
+
+		if (strcmp(arg, "--size") == 0) {
+			if (sscanf(value, "%dx%d", &opts->width,
+				   &opts->height) != 2)
+				return false;
+		} else if (strcmp(arg, "--display") == 0) {
+			opts->display = value;
+		} else if (strcmp(arg, "--ticks") == 0) {
+			opts->ticks = atoi(value);
+		} else if (strcmp(arg, "--fps") == 0) {
+			opts->fps = atof(value);
+		} else if (strcmp(arg, "--moves-per-sec") == 0) {
+			opts->moves_per_sec = atof(value);
+		} else if (strcmp(arg, "--shapes-per-sec") == 0) {
+			opts->shapes_per_sec = atof(value);
+		} else if (strcmp(arg, "--max-mean-us") == 0) {
+			opts->max_mean_us = atof(value);
+		} else if (strcmp(arg, "--max-uploads-per-shape") == 0) {
+			opts->max_uploads_per_shape = atof(value);
+		} else {
+			return false;
+		}
+	}
+
+	return opts->width > 0 && opts->height > 0 && opts->ticks > 0 &&
+	       opts->fps > 0. && opts->moves_per_sec >= 0. &&
+	       opts->shapes_per_sec >= 0.;
+}
+
+int main(int argc, char *argv[])
+{
+	bench_options_t opts;
+	if (!parse_options(argc, argv, &opts)) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	char display[32];
+	pid_t xvfb = -1;
+	if (opts.display) {
+		snprintf(display, sizeof(display), "%s", opts.display);
+	} else {
+		xvfb = start_xvfb(&opts, display, sizeof(display));
+		if (xvfb < 0)
+			return 1;
+	}
+
+	printf("display  %s, %d ticks at %.1f fps\n", display, opts.ticks,
+	       opts.fps);
+	const int retval = bench_cursor(&opts, display) ? 0 : 2;
+
+	if (xvfb > 0) {
+		kill(xvfb, SIGTERM);
+		waitpid(xvfb, NULL, 0);
+	}
+
+	return retval;
+}
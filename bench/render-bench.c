@@ -0,0 +1,497 @@
+/* Headless benchmark of the dmabuf source render path.
+ *
+ * Brings up libobs with the OpenGL/EGL renderer on whatever X display is
+ * available (use `xvfb-run` with Mesa llvmpipe on machines without a GPU),
+ * loads the plugin module and creates dmabuf sources that receive synthetic
+ * udmabuf framebuffers from synthetic-send through the regular helper
+ * protocol and import path. A scene with K such sources is then rendered
+ * offscreen and per-frame timings are reported. With --modes
+ * zero-copy,snapshot each scene is rendered both sampling the scanout buffer
+ * directly and from per-frame copies, and the cost of the copies is
+ * reported too. Synthetic framebuffers have no damage tracking, so every
+ * tick counts as a new frame and is copied.
+ *
+ * Exits with non-zero status if mean frame time exceeds --max-mean-ms, so it
+ * can be used as a regression gate. */
+
+#define _GNU_SOURCE
+
+#include "bench-stats.h"
+
+#include <obs.h>
+#include <obs-module.h>
+#include <obs-nix-platform.h>
+#include <util/platform.h>
+
+#include <X11/Xlib.h>
+
+#include <linux/udmabuf.h>
+
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#define MAX_SIZES 8
+#define MAX_SOURCES 64
+
+typedef struct {
+	int width, height;
+} bench_size_t;
+
+typedef struct {
+	bench_size_t sizes[MAX_SIZES];
+	int num_sizes;
+	int source_counts[MAX_SIZES];
+	int num_source_counts;
+	int frames;
+	int imports;
+	double max_mean_ms;
+	/* Render with snapshot off, on, or both in turn */
+	bool modes[2];
+} bench_options_t;
+
+static char bench_dir[] = "/tmp/kmsgrab-bench-XXXXXX";
+
+static void print_stats(const char *what, bench_size_t size, int sources,
+			const bench_stats_t *s)
+{
+	printf("%-8s %5dx%-5d sources=%-3d mean=%8.3fms stddev=%8.3fms min=%8.3fms max=%8.3fms p99=%8.3fms\n",
+	       what, size.width, size.height, sources, s->mean, s->stddev,
+	       s->min, s->max, s->p99);
+}
+
+/* There is no UI here, run UI tasks right where they are queued from */
+static void run_ui_task(obs_task_t task, void *param, bool wait)
+{
+	UNUSED_PARAMETER(wait);
+	task(param);
+}
+
+/* Lays out what the plugin expects to find next to its binary: the module
+ * itself and a linux-kmsgrab-send that is really synthetic-send. A pkexec
+ * shim is put first in PATH so that USE_PKEXEC builds work too. */
+static bool setup_bench_dir(char *module_path, size_t module_path_size)
+{
+	if (!mkdtemp(bench_dir)) {
+		fprintf(stderr, "Cannot create %s: %s\n", bench_dir,
+			strerror(errno));
+		return false;
+	}
+
+	char path[512];
+	snprintf(module_path, module_path_size, "%s/linux-kmsgrab.so",
+		 bench_dir);
+	snprintf(path, sizeof(path), "%s/linux-kmsgrab-send", bench_dir);
+	if (0 != symlink(KMSGRAB_PLUGIN_PATH, module_path) ||
+	    0 != symlink(KMSGRAB_SYNTHETIC_SEND_PATH, path)) {
+		fprintf(stderr, "Cannot symlink into %s: %s\n", bench_dir,
+			strerror(errno));
+		return false;
+	}
+
+	snprintf(path, sizeof(path), "%s/pkexec", bench_dir);
+	FILE *shim = fopen(path, "w");
+	if (!shim) {
+		fprintf(stderr, "Cannot create %s: %s\n", path,
+			strerror(errno));
+		return false;
+	}
+	fputs("#!/bin/sh\nexec \"$@\"\n", shim);
+	fclose(shim);
+	chmod(path, 0755);
+
+	char env_path[4096];
+	snprintf(env_path, sizeof(env_path), "%s:%s", bench_dir,
+		 getenv("PATH") ? getenv("PATH") : "/usr/bin:/bin");
+	setenv("PATH", env_path, 1);
+	return true;
+}
+
+static void cleanup_bench_dir(void)
+{
+	const char *names[] = {"linux-kmsgrab.so", "linux-kmsgrab-send",
+			       "pkexec"};
+	char path[512];
+	for (size_t i = 0; i < sizeof(names) / sizeof(*names); ++i) {
+		snprintf(path, sizeof(path), "%s/%s", bench_dir, names[i]);
+		unlink(path);
+	}
+	rmdir(bench_dir);
+}
+
+/* Creates a udmabuf in-process, for measuring bare import cost */
+static int create_udmabuf(size_t size)
+{
+	const int memfd = memfd_create("bench-fb", MFD_ALLOW_SEALING);
+	if (memfd < 0)
+		return -1;
+
+	int fd = -1;
+	if (0 == ftruncate(memfd, size) &&
+	    0 == fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK)) {
+		const int devfd = open("/dev/udmabuf", O_RDWR);
+		if (devfd >= 0) {
+			struct udmabuf_create create = {
+				.memfd = memfd,
+				.flags = UDMABUF_FLAGS_CLOEXEC,
+				.size = size,
+			};
+			fd = ioctl(devfd, UDMABUF_CREATE, &create);
+			close(devfd);
+		}
+	}
+
+	close(memfd);
+	return fd;
+}
+
+static bool bench_import(const bench_options_t *opts, bench_size_t size)
+{
+	const uint32_t pitch = size.width * 4;
+	const uint32_t offset = 0;
+	const size_t page = sysconf(_SC_PAGESIZE);
+	const int fd = create_udmabuf(
+		((size_t)pitch * size.height + page - 1) & ~(page - 1));
+	if (fd < 0) {
+		fprintf(stderr, "Cannot create udmabuf: %s\n", strerror(errno));
+		return false;
+	}
+
+	double *samples = malloc(sizeof(double) * opts->imports);
+	int count = 0;
+
+	obs_enter_graphics();
+	for (int i = 0; i < opts->imports; ++i) {
+		const uint64_t start = os_gettime_ns();
+		gs_texture_t *tex = gs_texture_create_from_dmabuf(
+			size.width, size.height, GS_BGRA, 1, &fd, &pitch,
+			&offset, NULL);
+		const uint64_t end = os_gettime_ns();
+
+		if (!tex) {
+			fprintf(stderr,
+				"Cannot import udmabuf, EGL_EXT_image_dma_buf_import missing?\n");
+			break;
+		}
+
+		gs_texture_destroy(tex);
+		samples[count++] = (end - start) / 1e6;
+	}
+	obs_leave_graphics();
+
+	close(fd);
+
+	const bench_stats_t stats = bench_compute_stats(samples, count);
+	print_stats("import", size, 1, &stats);
+	free(samples);
+	return count == opts->imports;
+}
+
+static bool bench_render(const bench_options_t *opts, bench_size_t size,
+			 int num_sources, bool snapshot, double *mean_ms)
+{
+	char card[32];
+	snprintf(card, sizeof(card), "bench:%dx%d", size.width, size.height);
+
+	obs_scene_t *scene = obs_scene_create("kmsgrab-bench");
+	obs_source_t *sources[MAX_SOURCES] = {0};
+	double *samples = malloc(sizeof(double) *
+				 (opts->frames > num_sources ? opts->frames
+							     : num_sources));
+	bool ok = true;
+
+	/* Full path: helper round trip, fd passing and import */
+	for (int i = 0; i < num_sources; ++i) {
+		obs_data_t *settings = obs_data_create();
+		obs_data_set_string(settings, "dri_card", card);
+		obs_data_set_int(settings, "framebuffer", 0x100);
+		obs_data_set_bool(settings, "show_cursor", true);
+		obs_data_set_bool(settings, "snapshot", snapshot);
+
+		char name[32];
+		snprintf(name, sizeof(name), "kmsgrab-%d", i);
+
+		/* Import happens on the graphics thread, so time until the
+		 * source reports its size */
+		const uint64_t start = os_gettime_ns();
+		sources[i] = obs_source_create("dmabuf-source", name, settings,
+					       NULL);
+		for (int wait = 0; sources[i] && wait < 5000 &&
+				   !obs_source_get_width(sources[i]);
+		     ++wait)
+			os_sleep_ms(1);
+		samples[i] = (os_gettime_ns() - start) / 1e6;
+		obs_data_release(settings);
+
+		if (!sources[i] || !obs_source_get_width(sources[i])) {
+			fprintf(stderr, "Source %d did not come up\n", i);
+			ok = false;
+			goto cleanup;
+		}
+
+		obs_scene_add(scene, sources[i]);
+	}
+
+	const bench_stats_t create_stats = bench_compute_stats(samples, num_sources);
+	print_stats("create", size, num_sources, &create_stats);
+
+	obs_source_t *scene_source = obs_scene_get_source(scene);
+	obs_source_inc_showing(scene_source);
+
+	obs_enter_graphics();
+	gs_texrender_t *texrender = gs_texrender_create(GS_BGRA, GS_ZS_NONE);
+	gs_stagesurf_t *stage =
+		gs_stagesurface_create(size.width, size.height, GS_BGRA);
+	obs_leave_graphics();
+
+	for (int frame = 0; frame < opts->frames; ++frame) {
+		/* Let the graphics thread tick sources so that cursor gets
+		 * updated the same way it would be live */
+		os_sleep_ms(1);
+
+		obs_enter_graphics();
+		const uint64_t start = os_gettime_ns();
+
+		gs_texrender_reset(texrender);
+		if (gs_texrender_begin(texrender, size.width, size.height)) {
+			struct vec4 clear_color;
+			vec4_set(&clear_color, 0.f, 0.f, 0.f, 1.f);
+			gs_clear(GS_CLEAR_COLOR, &clear_color, 0.f, 0);
+			gs_ortho(0.f, (float)size.width, 0.f,
+				 (float)size.height, -100.f, 100.f);
+			obs_source_video_render(scene_source);
+			gs_texrender_end(texrender);
+		}
+
+		/* Read back to wait for the rasterizer to actually finish */
+		gs_stage_texture(stage, gs_texrender_get_texture(texrender));
+		uint8_t *data;
+		uint32_t linesize;
+		if (gs_stagesurface_map(stage, &data, &linesize))
+			gs_stagesurface_unmap(stage);
+
+		samples[frame] = (os_gettime_ns() - start) / 1e6;
+		obs_leave_graphics();
+	}
+
+	const bench_stats_t render_stats = bench_compute_stats(samples, opts->frames);
+	print_stats(snapshot ? "snapshot" : "render", size, num_sources,
+		    &render_stats);
+	*mean_ms = render_stats.mean;
+
+	if (snapshot) {
+		long long copies = 0, submit_ns = 0;
+		for (int i = 0; i < num_sources; ++i) {
+			uint8_t stack[128];
+			calldata_t cd;
+			calldata_init_fixed(&cd, stack, sizeof(stack));
+			proc_handler_call(obs_source_get_proc_handler(sources[i]),
+					  "get_snapshot_stats", &cd);
+			copies += calldata_int(&cd, "copies");
+			submit_ns += calldata_int(&cd, "submit_ns");
+		}
+		/* GPU time of the copies is in the frame times above */
+		printf("%-8s %5dx%-5d sources=%-3d copies=%lld mean=%8.3fms per copy, %8.3fms per frame\n",
+		       "submit", size.width, size.height, num_sources, copies,
+		       copies ? submit_ns / 1e6 / copies : 0.,
+		       submit_ns / 1e6 / opts->frames);
+	}
+
+	obs_source_dec_showing(scene_source);
+
+	obs_enter_graphics();
+	gs_stagesurface_destroy(stage);
+	gs_texrender_destroy(texrender);
+	obs_leave_graphics();
+
+cleanup:
+	for (int i = 0; i < num_sources; ++i)
+		obs_source_release(sources[i]);
+	obs_scene_release(scene);
+	free(samples);
+	return ok;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"usage: %s [--sizes WxH,...] [--sources K,...] [--modes zero-copy,snapshot] [--frames N] [--imports N] [--max-mean-ms MS]\n",
+		name);
+}
+
+static bool parse_options(int argc, char *argv[], bench_options_t *opts)
+{
+	opts->sizes[0] = (bench_size_t){1920, 1080};
+	opts->sizes[1] = (bench_size_t){3840, 2160};
+	opts->num_sizes = 2;
+	opts->source_counts[0] = 1;
+	opts->source_counts[1] = 4;
+	opts->num_source_counts = 2;
+	opts->frames = 300;
+	opts->imports = 20;
+	opts->max_mean_ms = 0.;
+	opts->modes[0] = true;
+	opts->modes[1] = false;
+
+	for (int i = 1; i < argc; ++i) {
+		const char *arg = argv[i];
+		const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+		if (!value)
+			return false;
+		++i;
+
+		if (strcmp(arg, "--sizes") == 0) {
+			opts->num_sizes = 0;
+			for (const char *p = value;
+			     p && opts->num_sizes < MAX_SIZES;) {
+				bench_size_t *s = opts->sizes + opts->num_sizes;
+				if (sscanf(p, "%dx%d", &s->width, &s->height) !=
+				    2)
+					return false;
+				++opts->num_sizes;
+				p = strchr(p, ',');
+				if (p)
+					++p;
+			}
+		} else if (strcmp(arg, "--sources") == 0) {
+			opts->num_source_counts = 0;
+			for (const char *p = value;
+			     p && opts->num_source_counts < MAX_SIZES;) {
+				int *k = opts->source_counts +
+					 opts->num_source_counts;
+				if (sscanf(p, "%d", k) != 1 || *k < 1 ||
+				    *k > MAX_SOURCES)
+					return false;
+				++opts->num_source_counts;
+				p = strchr(p, ',');
+				if (p)
+					++p;
+			}
+		} else if (strcmp(arg, "--modes") == 0) {
+			opts->modes[0] = strstr(value, "zero-copy") != NULL;
+			opts->modes[1] = strstr(value, "snapshot") != NULL;
+			if (!opts->modes[0] && !opts->modes[1])
+				return false;
+		} else if (strcmp(arg, "--frames") == 0) {
+			opts->frames = atoi(value);
+		} else if (strcmp(arg, "--imports") == 0) {
+			opts->imports = atoi(value);
+		} else if (strcmp(arg, "--max-mean-ms") == 0) {
+			opts->max_mean_ms = atof(value);
+		} else {
+			return false;
+		}
+	}
+
+	return opts->frames > 0 && opts->imports > 0;
+}
+
+int main(int argc, char *argv[])
+{
+	bench_options_t opts;
+	if (!parse_options(argc, argv, &opts)) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	Display *display = XOpenDisplay(NULL);
+	if (!display) {
+		fprintf(stderr,
+			"Cannot open X display, run this under xvfb-run\n");
+		return 1;
+	}
+
+	char module_path[512];
+	if (!setup_bench_dir(module_path, sizeof(module_path))) {
+		cleanup_bench_dir();
+		return 1;
+	}
+
+	int retval = 1;
+
+	obs_set_nix_platform(OBS_NIX_PLATFORM_X11_EGL);
+	obs_set_nix_platform_display(display);
+	if (!obs_startup("en-US", NULL, NULL)) {
+		fprintf(stderr, "Cannot start libobs\n");
+		goto cleanup;
+	}
+	obs_set_ui_task_handler(run_ui_task);
+
+	bench_size_t max_size = opts.sizes[0];
+	for (int i = 1; i < opts.num_sizes; ++i) {
+		if (opts.sizes[i].width * opts.sizes[i].height >
+		    max_size.width * max_size.height)
+			max_size = opts.sizes[i];
+	}
+
+	struct obs_video_info ovi = {
+		.graphics_module = "libobs-opengl",
+		.fps_num = 60,
+		.fps_den = 1,
+		.base_width = max_size.width,
+		.base_height = max_size.height,
+		.output_width = max_size.width,
+		.output_height = max_size.height,
+		.output_format = VIDEO_FORMAT_NV12,
+		.gpu_conversion = true,
+		.colorspace = VIDEO_CS_709,
+		.range = VIDEO_RANGE_PARTIAL,
+		.scale_type = OBS_SCALE_BICUBIC,
+	};
+	if (obs_reset_video(&ovi) != OBS_VIDEO_SUCCESS) {
+		fprintf(stderr, "Cannot initialize libobs video\n");
+		goto shutdown;
+	}
+
+	obs_module_t *module = NULL;
+	if (obs_open_module(&module, module_path, KMSGRAB_DATA_PATH) !=
+		    MODULE_SUCCESS ||
+	    !obs_init_module(module)) {
+		fprintf(stderr, "Cannot load %s\n", module_path);
+		goto shutdown;
+	}
+
+	retval = 0;
+	for (int i = 0; i < opts.num_sizes; ++i) {
+		if (!bench_import(&opts, opts.sizes[i])) {
+			retval = 1;
+			continue;
+		}
+
+		for (int j = 0; j < opts.num_source_counts * 2; ++j) {
+			const bool snapshot = j % 2;
+			if (!opts.modes[snapshot])
+				continue;
+
+			double mean_ms = 0.;
+			if (!bench_render(&opts, opts.sizes[i],
+					  opts.source_counts[j / 2], snapshot,
+					  &mean_ms)) {
+				retval = 1;
+				continue;
+			}
+
+			if (opts.max_mean_ms > 0. &&
+			    mean_ms > opts.max_mean_ms) {
+				fprintf(stderr,
+					"Mean frame time %.3fms exceeds %.3fms\n",
+					mean_ms, opts.max_mean_ms);
+				retval = 2;
+			}
+		}
+	}
+
+shutdown:
+	obs_shutdown();
+
+cleanup:
+	cleanup_bench_dir();
+	XCloseDisplay(display);
+	return retval;
+}
@@ -0,0 +1,301 @@
+/* Latency of starting a helper process against the size of the parent.
+ *
+ * OBS is a large process, and the plugin starts linux-kmsgrab-send from it
+ * on every framebuffer refresh. This grows the resident set of the bench to
+ * each of --rss MiB, opens --fds descriptors without CLOEXEC like a careless
+ * library might, and starts itself --iterations times in --child mode, once
+ * with fork() and execv() and once with helper_spawn(). The child reports
+ * how many descriptors it got through its exit status.
+ *
+ * "call" is how long the parent is busy starting the child, "total" is
+ * until the child has exited, which includes exec and process teardown.
+ *
+ * Exits with non-zero status if helper_spawn() children inherit anything
+ * beyond stdin, stdout and stderr, or if its mean call time exceeds
+ * --max-mean-ms at any size. */
+
+#define _GNU_SOURCE
+
+#include "helper-spawn.h"
+#include "bench-stats.h"
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <dirent.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+
+#define MAX_RSS_STEPS 16
+#define CHILD_ARG "--child"
+
+typedef struct {
+	int rss_mib[MAX_RSS_STEPS];
+	int num_rss;
+	int iterations;
+	int fds;
+	double max_mean_ms;
+} bench_options_t;
+
+typedef enum {
+	METHOD_FORK_EXEC,
+	METHOD_HELPER_SPAWN,
+	METHOD_COUNT,
+} bench_method_t;
+
+static const char *const method_names[METHOD_COUNT] = {
+	"fork+exec",
+	"spawn",
+};
+
+/* Open descriptors, not counting the one used to list them */
+static int count_fds(void)
+{
+	DIR *dir = opendir("/proc/self/fd");
+	if (!dir)
+		return -1;
+
+	int count = 0;
+	const struct dirent *entry;
+	while ((entry = readdir(dir)))
+		if (entry->d_name[0] != '.')
+			++count;
+
+	closedir(dir);
+	return count - 1;
+}
+
+static double resident_mib(void)
+{
+	FILE *f = fopen("/proc/self/statm", "r");
+	if (!f)
+		return 0.;
+
+	long size = 0, resident = 0;
+	if (fscanf(f, "%ld %ld", &size, &resident) != 2)
+		resident = 0;
+	fclose(f);
+	return resident * (double)sysconf(_SC_PAGESIZE) / (1024. * 1024.);
+}
+
+static pid_t start_child(bench_method_t method, const char *const argv[])
+{
+	if (method == METHOD_HELPER_SPAWN)
+		return helper_spawn(argv);
+
+	const pid_t pid = fork();
+	if (pid == 0) {
+		execv(argv[0], (char *const *)argv);
+		_exit(127);
+	}
+	return pid;
+}
+
+static bool bench_method(const bench_options_t *opts, bench_method_t method,
+			 const char *const argv[], bench_stats_t *call)
+{
+	double *call_ms = malloc(sizeof(double) * opts->iterations);
+	double *total_ms = malloc(sizeof(double) * opts->iterations);
+	int min_fds = INT_MAX, max_fds = 0;
+	bool ok = true;
+
+	for (int i = 0; i < opts->iterations; ++i) {
+		const uint64_t start_ns = bench_now_ns();
+		const pid_t pid = start_child(method, argv);
+		const uint64_t started_ns = bench_now_ns();
+		if (pid == -1) {
+			fprintf(stderr, "Cannot start %s with %s: %s\n",
+				argv[0], method_names[method], strerror(errno));
+			ok = false;
+			break;
+		}
+
+		int wstatus = 0;
+		while (waitpid(pid, &wstatus, 0) == -1 && errno == EINTR)
+			;
+		const uint64_t exited_ns = bench_now_ns();
+
+		if (!WIFEXITED(wstatus) || WEXITSTATUS(wstatus) == 127) {
+			fprintf(stderr, "Child started with %s failed\n",
+				method_names[method]);
+			ok = false;
+			break;
+		}
+
+		const int fds = WEXITSTATUS(wstatus);
+		min_fds = fds < min_fds ? fds : min_fds;
+		max_fds = fds > max_fds ? fds : max_fds;
+		call_ms[i] = (started_ns - start_ns) / 1e6;
+		total_ms[i] = (exited_ns - start_ns) / 1e6;
+	}
+
+	if (ok) {
+		*call = bench_compute_stats(call_ms, opts->iterations);
+		const bench_stats_t total =
+			bench_compute_stats(total_ms, opts->iterations);
+		printf("  %-10s call mean=%7.3fms p99=%7.3fms max=%7.3fms  total mean=%7.3fms p99=%7.3fms  fds=%d..%d\n",
+		       method_names[method], call->mean, call->p99, call->max,
+		       total.mean, total.p99, min_fds, max_fds);
+
+		if (method == METHOD_HELPER_SPAWN && max_fds > STDERR_FILENO + 1) {
+			fprintf(stderr,
+				"Children started with %s inherited %d descriptors\n",
+				method_names[method],
+				max_fds - (STDERR_FILENO + 1));
+			ok = false;
+		}
+	}
+
+	free(call_ms);
+	free(total_ms);
+	return ok;
+}
+
+static bool bench_spawn(const bench_options_t *opts, const char *self)
+{
+	const char *const argv[] = {self, CHILD_ARG, NULL};
+
+	for (int i = 0; i < opts->fds; ++i) {
+		if (dup(STDERR_FILENO) == -1) {
+			fprintf(stderr, "Cannot dup(): %s\n", strerror(errno));
+			return false;
+		}
+	}
+
+	printf("%d iterations, %d extra descriptors open in parent\n",
+	       opts->iterations, count_fds() - (STDERR_FILENO + 1));
+
+	bool ok = true;
+	char *ballast = NULL;
+	size_t ballast_size = 0;
+	for (int step = 0; step < opts->num_rss; ++step) {
+		const size_t size = (size_t)opts->rss_mib[step] * 1024 * 1024;
+		if (size > ballast_size) {
+			char *grown = realloc(ballast, size);
+			if (!grown) {
+				fprintf(stderr, "Cannot allocate %d MiB\n",
+					opts->rss_mib[step]);
+				ok = false;
+				break;
+			}
+			ballast = grown;
+			/* Touch every page, so that it is resident and has
+			 * to be mapped into a forked child */
+			memset(ballast + ballast_size, 0x5a,
+			       size - ballast_size);
+			ballast_size = size;
+		}
+
+		printf("rss %.1f MiB\n", resident_mib());
+
+		for (int m = 0; m < METHOD_COUNT; ++m) {
+			bench_stats_t call;
+			if (!bench_method(opts, m, argv, &call)) {
+				ok = false;
+				continue;
+			}
+
+			if (m == METHOD_HELPER_SPAWN && opts->max_mean_ms > 0. &&
+			    call.mean > opts->max_mean_ms) {
+				fprintf(stderr,
+					"Mean %s call time %.3fms exceeds %.3fms\n",
+					method_names[m], call.mean,
+					opts->max_mean_ms);
+				ok = false;
+			}
+		}
+	}
+
+	free(ballast);
+	return ok;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"usage: %s [--rss MIB,MIB,...] [--iterations N] [--fds N] [--max-mean-ms MS]\n",
+		name);
+}
+
+static bool parse_rss(const char *value, bench_options_t *opts)
+{
+	opts->num_rss = 0;
+	while (*value && opts->num_rss < MAX_RSS_STEPS) {
+		char *end;
+		const long mib = strtol(value, &end, 10);
+		if (end == value || mib < 0 || mib > INT_MAX / 2)
+			return false;
+		opts->rss_mib[opts->num_rss++] = (int)mib;
+
+		if (*end != ',' && *end != '\0')
+			return false;
+		value = *end ? end + 1 : end;
+	}
+	return opts->num_rss > 0 && !*value;
+}
+
+static bool parse_options(int argc, char *argv[], bench_options_t *opts)
+{
+	opts->rss_mib[0] = 0;
+	opts->rss_mib[1] = 256;
+	opts->rss_mib[2] = 1024;
+	opts->num_rss = 3;
+	opts->iterations = 100;
+	opts->fds = 64;
+	opts->max_mean_ms = 0.;
+
+	for (int i = 1; i < argc; ++i) {
+		const char *arg = argv[i];
+		const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+		if (!value)
+			return false;
+		++i;
+
+		if (strcmp(arg, "--rss") == 0) {
+			if (!parse_rss(value, opts))
+				return false;
+		} else if (strcmp(arg, "--iterations") == 0) {
+			opts->iterations = atoi(value);
+		} else if (strcmp(arg, "--fds") == 0) {
+			opts->fds = atoi(value);
+		} else if (strcmp(arg, "--max-mean-ms") == 0) {
+			opts->max_mean_ms = atof(value);
+		} else {
+			return false;
+		}
+	}
+
+	return opts->iterations > 0 && opts->fds >= 0 &&
+	       opts->fds < 120;
+}
+
+int main(int argc, char *argv[])
+{
+	/* Exit status is at most 255, and 127 means exec failed */
+	if (argc == 2 && strcmp(argv[1], CHILD_ARG) == 0) {
+		const int fds = count_fds();
+		return fds < 0 ? 126 : fds > 126 ? 126 : fds;
+	}
+
+	bench_options_t opts;
+	if (!parse_options(argc, argv, &opts)) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	char self[PATH_MAX];
+	const ssize_t len = readlink("/proc/self/exe", self, sizeof(self) - 1);
+	if (len <= 0) {
+		fprintf(stderr, "Cannot find own executable: %s\n",
+			strerror(errno));
+		return 1;
+	}
+	self[len] = '\0';
+
+	return bench_spawn(&opts, self) ? 0 : 2;
+}
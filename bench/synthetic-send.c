@@ -0,0 +1,391 @@
+/* Drop-in replacement for linux-kmsgrab-send that does not touch DRM at all.
+ * Instead of real scanout buffers it sends udmabuf-backed framebuffers, so
+ * that the whole enumeration/import path can be exercised on machines
+ * without a GPU. Cards are given as "bench:WIDTHxHEIGHT[xCOUNT]".
+ *
+ * In follow mode it flips between COUNT (2 by default) such framebuffers
+ * at 60 Hz, drawing a moving bar into each before it is "displayed". */
+
+#define _GNU_SOURCE
+
+#include "drmsend.h"
+
+#include <linux/udmabuf.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <poll.h>
+#include <time.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#define LOG_PREFIX "synthetic-send: "
+
+#define ERR(fmt, ...) fprintf(stderr, LOG_PREFIX fmt "\n", ##__VA_ARGS__)
+#define MSG(fmt, ...) fprintf(stdout, LOG_PREFIX fmt "\n", ##__VA_ARGS__)
+
+/* DRM_FORMAT_XRGB8888 */
+#define SYNTHETIC_FOURCC 0x34325258u
+/* DRM_FORMAT_MOD_INVALID, same as real framebuffers on pre-5.7 kernels */
+#define SYNTHETIC_MODIFIER ((1ull << 56) - 1)
+#define SYNTHETIC_FB_ID_BASE 0x100u
+
+#define SYNTHETIC_FOLLOW_PERIOD_NS (1000000000ll / 60)
+
+/* If map is set, pixels stay mapped there for drawing into later. In that
+ * case, without udmabuf in the kernel, the memfd itself is returned, which
+ * is only good for consumers that mmap it. */
+static int createUdmabuf(int width, int height, int pitch, int pattern,
+			 uint32_t **map)
+{
+	const size_t page = sysconf(_SC_PAGESIZE);
+	const size_t size = ((size_t)pitch * height + page - 1) & ~(page - 1);
+
+	int memfd = memfd_create("synthetic-fb", MFD_ALLOW_SEALING);
+	if (memfd < 0) {
+		ERR("Cannot memfd_create: %s (%d)", strerror(errno), errno);
+		return -1;
+	}
+
+	int fd = -1;
+	if (0 != ftruncate(memfd, size)) {
+		ERR("Cannot ftruncate memfd to %zu: %s (%d)", size,
+		    strerror(errno), errno);
+		goto cleanup;
+	}
+
+	uint32_t *pixels =
+		mmap(NULL, size, PROT_WRITE, MAP_SHARED, memfd, 0);
+	if (pixels == MAP_FAILED) {
+		ERR("Cannot mmap memfd: %s (%d)", strerror(errno), errno);
+		goto cleanup;
+	}
+
+	/* Something recognizable, different for each framebuffer */
+	for (int y = 0; y < height; ++y) {
+		uint32_t *row = pixels + (size_t)y * (pitch / 4);
+		for (int x = 0; x < width; ++x)
+			row[x] = 0xff000000u | ((x * 255 / width) << 16) |
+				 ((y * 255 / height) << 8) |
+				 ((pattern * 64) & 0xff);
+	}
+	if (map)
+		*map = pixels;
+	else
+		munmap(pixels, size);
+
+	/* udmabuf refuses memfds that can still shrink */
+	if (0 != fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK)) {
+		ERR("Cannot seal memfd: %s (%d)", strerror(errno), errno);
+		goto cleanup;
+	}
+
+	const int devfd = open("/dev/udmabuf", O_RDWR);
+	if (devfd < 0 && errno == ENOENT && map) {
+		fd = memfd;
+		memfd = -1;
+		goto cleanup;
+	}
+	if (devfd < 0) {
+		ERR("Cannot open /dev/udmabuf: %s (%d)", strerror(errno),
+		    errno);
+		goto cleanup;
+	}
+
+	struct udmabuf_create create = {
+		.memfd = memfd,
+		.flags = UDMABUF_FLAGS_CLOEXEC,
+		.offset = 0,
+		.size = size,
+	};
+	fd = ioctl(devfd, UDMABUF_CREATE, &create);
+	if (fd < 0)
+		ERR("Cannot create udmabuf: %s (%d)", strerror(errno), errno);
+	close(devfd);
+
+cleanup:
+	if (memfd >= 0)
+		close(memfd);
+	if (fd < 0 && map && *map) {
+		munmap(*map, size);
+		*map = NULL;
+	}
+	return fd;
+}
+
+static socklen_t makeSocketAddr(struct sockaddr_un *addr, const char *name)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+
+	const size_t len = strlen(name);
+	if (len >= sizeof(addr->sun_path)) {
+		ERR("Socket filename '%s' is too long, max %d", name,
+		    (int)sizeof(addr->sun_path));
+		return 0;
+	}
+
+	memcpy(addr->sun_path, name, len);
+	if (name[0] != OBS_DRMSEND_ABSTRACT_PREFIX)
+		return sizeof(*addr);
+
+	addr->sun_path[0] = '\0';
+	return offsetof(struct sockaddr_un, sun_path) + len;
+}
+
+static int connectSocket(const char *sockname)
+{
+	struct sockaddr_un addr;
+	const socklen_t addrlen = makeSocketAddr(&addr, sockname);
+	if (!addrlen)
+		return -1;
+
+	const int sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sockfd < 0 ||
+	    -1 == connect(sockfd, (const struct sockaddr *)&addr, addrlen)) {
+		ERR("Cannot connect to unix socket: %d", errno);
+		if (sockfd >= 0)
+			close(sockfd);
+		return -1;
+	}
+
+	return sockfd;
+}
+
+static int sendFrame(int sockfd, const drmsend_frame_t *frame, int fb_fd)
+{
+	struct msghdr msg = {0};
+	struct iovec io = {
+		.iov_base = (void *)frame,
+		.iov_len = sizeof(*frame),
+	};
+	msg.msg_iov = &io;
+	msg.msg_iovlen = 1;
+
+	char cmsg_buf[CMSG_SPACE(sizeof(int))];
+	if (fb_fd >= 0) {
+		msg.msg_control = cmsg_buf;
+		msg.msg_controllen = sizeof(cmsg_buf);
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &fb_fd, sizeof(int));
+	}
+
+	return sendmsg(sockfd, &msg, MSG_NOSIGNAL) == sizeof(*frame);
+}
+
+/* Same protocol as linux-kmsgrab-send --follow */
+static int followSynthetic(const char *sockname, const char *card)
+{
+	int width = 0, height = 0, count = 2;
+	if (sscanf(card, "bench:%dx%dx%d", &width, &height, &count) < 2 ||
+	    width <= 0 || height <= 0 || count <= 0 ||
+	    count > OBS_DRMSEND_FOLLOW_SLOTS) {
+		ERR("Cannot parse synthetic card '%s'", card);
+		return 1;
+	}
+
+	int retval = 2;
+	const int pitch = width * 4;
+	int fds[OBS_DRMSEND_FOLLOW_SLOTS];
+	uint32_t *maps[OBS_DRMSEND_FOLLOW_SLOTS] = {0};
+	int num_fds = 0;
+	for (; num_fds < count; ++num_fds) {
+		fds[num_fds] = createUdmabuf(width, height, pitch, num_fds,
+					     maps + num_fds);
+		if (fds[num_fds] < 0)
+			goto cleanup;
+	}
+
+	const int sockfd = connectSocket(sockname);
+	if (sockfd < 0)
+		goto cleanup;
+
+	drmsend_frame_t frame = {0};
+	frame.tag = OBS_DRMSEND_FRAME_TAG;
+	frame.damage.changed = true;
+	frame.damage.full = true;
+	frame.fb.card_index = 0;
+	frame.fb.width = width;
+	frame.fb.height = height;
+	frame.fb.pitch = pitch;
+	frame.fb.fourcc = SYNTHETIC_FOURCC;
+	frame.fb.modifier = SYNTHETIC_MODIFIER;
+	frame.fb.crtc_id = 1;
+	frame.fb.crtc_width = width;
+	frame.fb.crtc_height = height;
+	frame.fb.primary = 1;
+	snprintf(frame.fb.connector_name, sizeof(frame.fb.connector_name),
+		 "Virtual-1");
+
+	struct timespec next;
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	for (;;) {
+		/* Nothing is ever sent back, so readable means closed */
+		struct pollfd pfd = {.fd = sockfd, .events = POLLIN};
+		if (poll(&pfd, 1, 0) != 0)
+			break;
+
+		const int slot = frame.sequence % count;
+		const int bar = (frame.sequence * 8) % width;
+		for (int y = 0; y < height; ++y) {
+			uint32_t *row = maps[slot] + (size_t)y * (pitch / 4);
+			for (int x = 0; x < width; ++x)
+				row[x] = (x >= bar && x < bar + 32)
+						 ? 0xffffffffu
+						 : 0xff000000u | (slot * 0x40 << 8);
+		}
+
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+		frame.timestamp_ns = next.tv_sec * 1000000000ll + next.tv_nsec;
+		next.tv_nsec += SYNTHETIC_FOLLOW_PERIOD_NS;
+		if (next.tv_nsec >= 1000000000) {
+			next.tv_sec++;
+			next.tv_nsec -= 1000000000;
+		}
+
+		/* fds go out with the first use of each slot only */
+		const bool first_use = frame.sequence < (uint32_t)count;
+		frame.slot = slot;
+		frame.has_fd = first_use;
+		frame.fb.fb_id = SYNTHETIC_FB_ID_BASE + slot;
+		frame.damage.flips = frame.sequence;
+		if (!sendFrame(sockfd, &frame, first_use ? fds[slot] : -1))
+			break;
+		frame.sequence++;
+	}
+
+	close(sockfd);
+	retval = 0;
+
+cleanup:
+	for (int i = 0; i < num_fds; ++i) {
+		munmap(maps[i], ((size_t)pitch * height + sysconf(_SC_PAGESIZE) -
+				 1) & ~(sysconf(_SC_PAGESIZE) - 1));
+		close(fds[i]);
+	}
+	return retval;
+}
+
+int main(int argc, const char *argv[])
+{
+	if (argc == 5 && strcmp(argv[1], OBS_DRMSEND_FOLLOW_ARG) == 0)
+		return followSynthetic(argv[3], argv[4]);
+
+	if (argc < 3) {
+		MSG("usage: %s socket_filename bench:WxH[xN] [bench:WxH[xN] ...]",
+		    argv[0]);
+		return 1;
+	}
+
+	const char *sockname = argv[1];
+	const int num_cards = argc - 2;
+	if (num_cards > OBS_DRMSEND_MAX_CARDS) {
+		ERR("Too many cards, max %d", OBS_DRMSEND_MAX_CARDS);
+		return 1;
+	}
+
+	int retval = 2;
+	int sockfd = -1;
+	drmsend_response_t response = {0};
+	int fb_fds[OBS_DRMSEND_MAX_FRAMEBUFFERS] = {-1};
+
+	for (int i = 0; i < num_cards; ++i) {
+		const char *card = argv[2 + i];
+		int width = 0, height = 0, count = 1;
+		if (sscanf(card, "bench:%dx%dx%d", &width, &height, &count) <
+			    2 ||
+		    width <= 0 || height <= 0 || count <= 0) {
+			ERR("Cannot parse synthetic card '%s'", card);
+			goto cleanup;
+		}
+
+		drmsend_card_t *c = response.cards + response.num_cards++;
+		snprintf(c->path, sizeof(c->path), "%s", card);
+
+		for (int j = 0; j < count; ++j) {
+			if (j == OBS_DRMSEND_MAX_CARD_FRAMEBUFFERS) {
+				ERR("%s: too many framebuffers, max %d per card",
+				    card, OBS_DRMSEND_MAX_CARD_FRAMEBUFFERS);
+				break;
+			}
+
+			const int pitch = width * 4;
+			const int fd =
+				createUdmabuf(width, height, pitch, j, NULL);
+			if (fd < 0)
+				goto cleanup;
+
+			const int fb_index = response.num_framebuffers++;
+			drmsend_framebuffer_t *fb =
+				response.framebuffers + fb_index;
+			fb_fds[fb_index] = fd;
+			fb->fb_id = SYNTHETIC_FB_ID_BASE + j;
+			fb->card_index = i;
+			fb->width = width;
+			fb->height = height;
+			fb->pitch = pitch;
+			fb->offset = 0;
+			fb->fourcc = SYNTHETIC_FOURCC;
+			fb->modifier = SYNTHETIC_MODIFIER;
+		}
+	}
+
+	sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+	{
+		struct sockaddr_un addr;
+		const socklen_t addrlen = makeSocketAddr(&addr, sockname);
+		if (!addrlen)
+			goto cleanup;
+
+		if (-1 == connect(sockfd, (const struct sockaddr *)&addr,
+				  addrlen)) {
+			ERR("Cannot connect to unix socket: %d", errno);
+			goto cleanup;
+		}
+	}
+
+	response.tag = OBS_DRMSEND_TAG;
+
+	struct msghdr msg = {0};
+	struct iovec io = {
+		.iov_base = &response,
+		.iov_len = sizeof(response),
+	};
+	msg.msg_iov = &io;
+	msg.msg_iovlen = 1;
+
+	const int fb_size = sizeof(int) * response.num_framebuffers;
+	char cmsg_buf[CMSG_SPACE(sizeof(fb_fds))];
+	msg.msg_control = cmsg_buf;
+	msg.msg_controllen = CMSG_SPACE(fb_size);
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(fb_size);
+	memcpy(CMSG_DATA(cmsg), fb_fds, fb_size);
+
+	if (sendmsg(sockfd, &msg, 0) < 0) {
+		perror("cannot sendmsg");
+		goto cleanup;
+	}
+
+	retval = 0;
+
+cleanup:
+	if (sockfd >= 0)
+		close(sockfd);
+	for (int i = 0; i < response.num_framebuffers; ++i)
+		close(fb_fds[i]);
+	return retval;
+}
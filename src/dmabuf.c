@@ -1,49 +1,242 @@
-#include "drmsend.h"
+#include "fblist.h"
+#include "drm-monitor.h"
+#include "fb-view.h"
+#include "flightrec.h"
+#include "topology.h"
 #include "xcursor-xcb.h"
+#include "xwindow-xcb.h"
 
 #include <graphics/graphics.h>
 #include <graphics/graphics-internal.h>
+#include <graphics/vec2.h>
+
+#include <libdrm/drm_fourcc.h>
 
 #include <obs-module.h>
 #include <obs-nix-platform.h>
 #include <util/platform.h>
+#include <util/task.h>
+#include <util/threading.h>
 
-#include <sys/wait.h>
+#include <assert.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
 
 #include "plugin-macros.generated.h"
 
-// FIXME stringify errno
+/* Everything needed to render one framebuffer. Immutable once published
+ * to the render thread. */
+typedef struct dmabuf_capture {
+	char card[32];
+	drmsend_framebuffer_t fb;
+	int fd;
+	gs_texture_t *texture;
 
-#include <sys/types.h>
-#include <sys/socket.h>
-#include <sys/un.h>
-#include <unistd.h>
-#include <errno.h>
-#include <limits.h>
+	/* Bytes of scanout memory kept alive by the fd/texture we hold */
+	uint64_t pinned_bytes;
+	/* When it was queued for import */
+	uint64_t queued_ns;
 
-typedef struct {
-	drmsend_response_t resp;
-	int fb_fds[OBS_DRMSEND_MAX_FRAMEBUFFERS];
-} dmabuf_source_fblist_t;
+	struct dmabuf_capture *next_retired;
+} dmabuf_capture_t;
 
-typedef struct {
+typedef struct dmabuf_source dmabuf_source_t;
+
+#define SNAPSHOT_RING_SIZE 3
+
+struct dmabuf_source {
 	obs_source_t *source;
 
 	xcb_connection_t *xcb;
 	xcb_xcursor_t *cursor;
-	gs_texture_t *texture;
 
-	dmabuf_source_fblist_t fbs;
-	int active_fb;
+	/* Capture used by the render thread. Replaced by swapping the pointer,
+	 * the old one goes to the retired list. */
+	dmabuf_capture_t *capture;
+	/* Replaced captures, reclaimed by video_tick() when render thread is
+	 * guaranteed to be done with them */
+	dmabuf_capture_t *retired;
+	volatile long width, height;
+
+	/* Capture waiting to be imported on the graphics thread and the next
+	 * source in the import queue, both protected by import_mutex */
+	dmabuf_capture_t *pending;
+	dmabuf_source_t *import_next;
+
+	/* Framebuffers the properties dialog is browsing. Only metadata is
+	 * kept, fds are released as soon as they are listed.
+	 * num_cards == 0 means it needs to be enumerated again. */
+	drmsend_response_t ui_resp;
+
+	/* Protects state below and selection changes. Never held by the
+	 * render path and never held across helper round trips. */
+	pthread_mutex_t mutex;
+
+	/* Dormant sources don't query cursor, and, if release_when_hidden is
+	 * set, keep only an unimported copy of their capture in dormant_cap
+	 * so that waking up needs no helper round trip. */
+	volatile bool showing;
+	volatile bool dormant;
+	bool dpms_off;
+	bool release_when_hidden;
+	dmabuf_capture_t *dormant_cap;
+
+	drm_monitor_t monitor;
+	uint64_t next_dpms_check_ns;
 
 	bool show_cursor;
-} dmabuf_source_t;
+	/* Show framebuffers rotated, reflected and scaled as their plane
+	 * scans them out, rather than as they are in memory */
+	volatile bool transform;
+
+	/* Window to crop the framebuffer to, 0 for all of it. Set by
+	 * update() under mutex, picked up by video_tick(). */
+	xcb_window_t window_id;
+	char window_class[64];
+	bool window_changed;
+	volatile bool following;
+	/* Size of the window's part of the framebuffer as shown */
+	volatile long crop_width, crop_height;
+
+	/* Graphics thread only */
+	xcb_xwindow_t window;
+	/* Framebuffer origin_x/y have been found for, and where it is in X
+	 * screen coordinates */
+	char origin_card[32];
+	uint32_t origin_fb_id;
+	int origin_x, origin_y;
+	/* Part of the framebuffer rendered when following a window, in its
+	 * pixels */
+	int crop_x0, crop_y0, crop_x1, crop_y1;
+	/* Capture damage was last read for */
+	char damage_card[32];
+	uint32_t damage_fb_id;
+
+	/* What has changed in the latest frame, in source coordinates, and
+	 * how many frames had new content or none. Protected by
+	 * damage_mutex. */
+	pthread_mutex_t damage_mutex;
+	drm_damage_t damage;
+	long changed_frames, static_frames;
+	/* Snapshot copies made and CPU time spent submitting them, also
+	 * protected by damage_mutex. The GPU does the copies later on. */
+	long snapshot_copies;
+	uint64_t snapshot_submit_ns;
+
+	/* Whether to render a copy of each new frame instead of sampling the
+	 * scanout buffer while the compositor may be drawing into it */
+	volatile bool snapshot;
+	/* Graphics thread only. New frames are copied into the ring in turn,
+	 * so that a copy is never written while the GPU may still be reading
+	 * it for a previous frame. snapshot_tex is the latest one. */
+	gs_texture_t *snapshot_ring[SNAPSHOT_RING_SIZE];
+	int snapshot_next;
+	gs_texture_t *snapshot_tex;
+
+	/* Recent capture events, dumped on request or when capture stalls */
+	flightrec_t *rec;
+	obs_hotkey_id dump_hotkey;
+	/* Graphics thread only. Dump to make on the next tick, if any, and
+	 * when automatic dumps are allowed again. */
+	bool dump_pending;
+	flightrec_reason_t dump_reason;
+	uint64_t next_auto_dump_ns;
+	uint64_t last_tick_ns;
+};
+
+#define DPMS_CHECK_INTERVAL_NS 1000000000ULL
+#define MAX_LISTED_WINDOWS 256
+/* Vblanks older than this mean nothing is being flipped, cursor is then
+ * drawn where it is now */
+#define MAX_SCANOUT_AGE_NS 50000000ULL
+/* Ticks or imports delayed by this much are dumped as stalls */
+#define STALL_NS 500000000ULL
+/* Failures tend to repeat, don't dump each of them */
+#define AUTO_DUMP_INTERVAL_NS 60000000000ULL
+#define FLIGHTREC_DIR "flightrec"
+
+/* Sum of pinned_bytes over all sources */
+static volatile long pinned_bytes_total = 0;
+
+static long pinned_bytes_total_add(long delta)
+{
+	long total;
+	do {
+		total = os_atomic_load_long(&pinned_bytes_total);
+	} while (!os_atomic_compare_swap_long(&pinned_bytes_total, total,
+					      total + delta));
+	return total + delta;
+}
+
+/* Sources with a pending import. Imports are done as a single graphics
+ * task, so that a batch of them costs one trip through the graphics thread
+ * instead of holding the graphics lock from the UI thread for each. */
+static pthread_mutex_t import_mutex = PTHREAD_MUTEX_INITIALIZER;
+static dmabuf_source_t *import_queue = NULL;
+static bool import_task_queued = false;
+
+/* Effect drawing framebuffer and cursor in one pass, shared by all
+ * sources. NULL if data/kmsgrab.effect could not be loaded. */
+static struct {
+	gs_effect_t *effect;
+	gs_eparam_t *image;
+	gs_eparam_t *image_offset;
+	gs_eparam_t *image_u;
+	gs_eparam_t *image_v;
+	gs_eparam_t *swap_rb;
+	gs_eparam_t *cursor;
+	gs_eparam_t *cursor_pos;
+	gs_eparam_t *cursor_scale;
+	gs_eparam_t *cursor_alpha;
+} composite;
+
+static void composite_effect_load(void)
+{
+	char *path = obs_module_file("kmsgrab.effect");
+	if (!path) {
+		blog(LOG_WARNING, "kmsgrab.effect not found, cursor will be drawn in a separate pass and rotated outputs will not be rotated");
+		return;
+	}
+
+	obs_enter_graphics();
+	gs_effect_t *effect = gs_effect_create_from_file(path, NULL);
+	obs_leave_graphics();
+	bfree(path);
+
+	if (!effect) {
+		blog(LOG_WARNING, "Cannot load kmsgrab.effect, cursor will be drawn in a separate pass and rotated outputs will not be rotated");
+		return;
+	}
+
+	composite.effect = effect;
+	composite.image = gs_effect_get_param_by_name(effect, "image");
+	composite.image_offset =
+		gs_effect_get_param_by_name(effect, "image_offset");
+	composite.image_u = gs_effect_get_param_by_name(effect, "image_u");
+	composite.image_v = gs_effect_get_param_by_name(effect, "image_v");
+	composite.swap_rb = gs_effect_get_param_by_name(effect, "swap_rb");
+	composite.cursor = gs_effect_get_param_by_name(effect, "cursor");
+	composite.cursor_pos = gs_effect_get_param_by_name(effect, "cursor_pos");
+	composite.cursor_scale =
+		gs_effect_get_param_by_name(effect, "cursor_scale");
+	composite.cursor_alpha =
+		gs_effect_get_param_by_name(effect, "cursor_alpha");
+}
+
+static void composite_effect_free(void)
+{
+	if (!composite.effect)
+		return;
 
-static const char send_binary_name[] = "linux-kmsgrab-send";
-static const size_t send_binary_len = sizeof(send_binary_name) - 1;
-static const char socket_filename[] = "/obs-kmsgrab-send.sock";
-static const int socket_filename_len = sizeof(socket_filename) - 1;
+	obs_enter_graphics();
+	gs_effect_destroy(composite.effect);
+	obs_leave_graphics();
+	memset(&composite, 0, sizeof(composite));
+}
 
 static void set_visible(obs_properties_t *ppts, const char *name, bool visible)
 {
@@ -51,352 +244,765 @@ static void set_visible(obs_properties_t *ppts, const char *name, bool visible)
 	obs_property_set_visible(p, visible);
 }
 
-
-static int dmabuf_source_receive_framebuffers(const char *dri_filename, dmabuf_source_fblist_t *list)
+/* Returns the amount of memory backing the dma-buf behind fd. Prefers the
+ * exporter-reported size from /proc/self/fdinfo and falls back to the
+ * framebuffer geometry if it is not available. */
+static uint64_t dmabuf_fb_pinned_size(int fd, const drmsend_framebuffer_t *fb)
 {
-	blog(LOG_DEBUG, "dmabuf_source_receive_framebuffers");
-
-	int retval = 0;
-	int sockfd = -1;
-
-	/* Get socket filename */
-	struct sockaddr_un addr = {0};
-	addr.sun_family = AF_UNIX;
-	{
-		const char *const module_path =
-			obs_get_module_data_path(obs_current_module());
-		assert(module_path);
-		if (!os_file_exists(module_path)) {
-			if (MKDIR_ERROR == os_mkdir(module_path)) {
-				blog(LOG_ERROR, "Unable to create directory %s",
-				     module_path);
-				return 0;
+	uint64_t size = 0;
+
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/self/fdinfo/%d", fd);
+	FILE *fdinfo = fopen(path, "r");
+	if (fdinfo) {
+		char line[128];
+		while (fgets(line, sizeof(line), fdinfo)) {
+			unsigned long long value;
+			if (sscanf(line, "size: %llu", &value) == 1) {
+				size = value;
+				break;
 			}
 		}
+		fclose(fdinfo);
+	}
 
-		const int module_path_len = strlen(module_path);
-		if (module_path_len + socket_filename_len + 1 >=
-		    (int)sizeof(addr.sun_path)) {
-			blog(LOG_ERROR, "Socket filename is too long, max %d",
-			     (int)sizeof(addr.sun_path));
-			return 0;
-		}
-		memcpy(addr.sun_path, module_path, module_path_len);
-		memcpy(addr.sun_path + module_path_len, socket_filename,
-		       socket_filename_len);
+	if (!size)
+		size = (uint64_t)fb->offset + (uint64_t)fb->pitch * fb->height;
+
+	return size;
+}
 
-		blog(LOG_DEBUG, "Will bind socket to %s", addr.sun_path);
+/* Only the fd of the framebuffer we actually capture from is kept, by
+ * duplicating it out of the snapshot: every open prime fd pins its buffer's
+ * memory even after the compositor has released it. */
+static dmabuf_capture_t *dmabuf_capture_create(const dmabuf_fblist_t *list,
+					       int index)
+{
+	const drmsend_framebuffer_t *fb = list->resp.framebuffers + index;
+	blog(LOG_DEBUG, "dmabuf_capture_create %s %#x", dmabuf_fblist_card(list, fb),
+	     fb->fb_id);
+
+	const int fd = fcntl(list->fb_fds[index], F_DUPFD_CLOEXEC, 0);
+	if (fd < 0) {
+		blog(LOG_ERROR, "Cannot dup fd of framebuffer id=%#x: %d",
+		     fb->fb_id, errno);
+		return NULL;
 	}
 
-	/* Find linux-kmsgrab-send */
-	char *drmsend_filename = NULL;
-	{
-		const char* plugin_path = obs_get_module_binary_path(obs_current_module());
-		const char* plugin_path_last_sep = strrchr(plugin_path, '/');
-		if (!plugin_path_last_sep)
-			plugin_path_last_sep = plugin_path;
-		else
-			plugin_path_last_sep += 1;
-
-		const ssize_t prefix_len = plugin_path_last_sep - plugin_path;
-		const ssize_t full_len = prefix_len;
-		const ssize_t drmsend_filename_len = full_len + send_binary_len + 1;
-		drmsend_filename = malloc(drmsend_filename_len);
-		memcpy(drmsend_filename, plugin_path, prefix_len);
-		memcpy(drmsend_filename + prefix_len, send_binary_name, send_binary_len + 1);
-
-		if (!os_file_exists(drmsend_filename)) {
-			blog(LOG_ERROR, "%s doesn't exist", drmsend_filename);
-			goto filename_cleanup;
-		}
+	dmabuf_capture_t *cap = bzalloc(sizeof(dmabuf_capture_t));
+	snprintf(cap->card, sizeof(cap->card), "%s",
+		 dmabuf_fblist_card(list, fb));
+	cap->fb = *fb;
+	cap->fd = fd;
 
-		blog(LOG_DEBUG, "Will execute obs-kmsgrab-send from %s",
-		     drmsend_filename);
-	}
-
-	/* 1. create and listen on unix socket */
-	sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
-
-	unlink(addr.sun_path);
-	if (-1 == bind(sockfd, (const struct sockaddr *)&addr, sizeof(addr))) {
-		blog(LOG_ERROR, "Cannot bind unix socket to %s: %d",
-		     addr.sun_path, errno);
-		goto socket_cleanup;
-	}
-
-	if (-1 == listen(sockfd, 1)) {
-		blog(LOG_ERROR, "Cannot listen on unix socket bound to %s: %d",
-		     addr.sun_path, errno);
-		goto socket_cleanup;
-	}
-
-	/* 2. run obs-kmsgrab-send utility */
-	const pid_t drmsend_pid = fork();
-	if (drmsend_pid == -1) {
-		blog(LOG_ERROR, "Cannot fork(): %d", errno);
-		goto socket_cleanup;
-	} else if (drmsend_pid == 0) {
-#ifdef USE_PKEXEC
-		const char pkexec[] = "pkexec";
-		execlp(pkexec, pkexec, drmsend_filename, dri_filename,
-		       addr.sun_path, NULL);
-		fprintf(stderr, "Cannot execlp(%s, %s): %d\n", pkexec, drmsend_filename,
-			errno);
-#else
-		execlp(drmsend_filename, drmsend_filename, dri_filename,
-		       addr.sun_path, NULL);
-		fprintf(stderr, "Cannot execlp(%s): %d\n", drmsend_filename,
-			errno);
-#endif
-		exit(-1);
-	}
-
-	blog(LOG_DEBUG, "Forked obs-kmsgrab-send to pid %d", drmsend_pid);
-
-	/* 3. select() on unix socket w/ timeout */
-	// FIXME updating timeout w/ time left is linux-specific, other unices might not do that
-	struct timeval timeout;
-	timeout.tv_sec = 5;
-	timeout.tv_usec = 0;
-	for (;;) {
-		fd_set set;
-		FD_ZERO(&set);
-		FD_SET(sockfd, &set);
-		const int maxfd = sockfd;
-		const int nfds = select(maxfd + 1, &set, NULL, NULL, &timeout);
-		if (nfds > 0) {
-			if (FD_ISSET(sockfd, &set))
-				break;
-		}
+	cap->pinned_bytes = dmabuf_fb_pinned_size(cap->fd, fb);
+	const long total = pinned_bytes_total_add((long)cap->pinned_bytes);
+	blog(LOG_INFO, "Capture of fb %#x pins %llu bytes of scanout memory (%ld total)",
+	     fb->fb_id, (unsigned long long)cap->pinned_bytes, total);
 
-		if (nfds < 0) {
-			if (errno == EINTR)
-				continue;
-			blog(LOG_ERROR, "Cannot select(): %d", errno);
-			goto child_cleanup;
-		}
+	return cap;
+}
 
-		if (nfds == 0) {
-			blog(LOG_ERROR, "Waiting for drmsend timed out");
-			goto child_cleanup;
-		}
+/* Must be called within graphics context */
+static bool dmabuf_capture_import(dmabuf_capture_t *cap)
+{
+	const drmsend_framebuffer_t *fb = &cap->fb;
+	blog(LOG_DEBUG, "%dx%d %d %d %d", fb->width, fb->height, cap->fd,
+	     fb->offset, fb->pitch);
+
+	const uint32_t stride = fb->pitch;
+	const uint32_t offset = fb->offset;
+	const uint64_t modifier = fb->modifier;
+	cap->texture = gs_texture_create_from_dmabuf(fb->width, fb->height,
+			GS_BGRA, // FIXME handle fourcc?
+			1, // FIXME handle planes
+			&cap->fd,
+			&stride,
+			&offset,
+			modifier != DRM_FORMAT_MOD_INVALID ? &modifier : NULL
+	);
+
+	if (!cap->texture) {
+		blog(LOG_ERROR, "Could not create texture from dmabuf source");
+		return false;
 	}
 
-	blog(LOG_DEBUG, "Ready to accept");
+	return true;
+}
+
+static bool dmabuf_capture_matches(const dmabuf_capture_t *cap,
+				   const char *card, uint32_t fb_id)
+{
+	return cap && cap->fb.fb_id == fb_id && strcmp(cap->card, card) == 0;
+}
 
-	/* 4. accept() and receive data */
-	int connfd = accept(sockfd, NULL, NULL);
-	if (connfd < 0) {
-		blog(LOG_ERROR, "Cannot accept unix socket: %d", errno);
-		goto child_cleanup;
+/* Unimported copy of cap sharing the same buffer */
+static dmabuf_capture_t *dmabuf_capture_clone(const dmabuf_capture_t *cap)
+{
+	const int fd = fcntl(cap->fd, F_DUPFD_CLOEXEC, 0);
+	if (fd < 0) {
+		blog(LOG_ERROR, "Cannot dup fd of framebuffer id=%#x: %d",
+		     cap->fb.fb_id, errno);
+		return NULL;
 	}
 
-	blog(LOG_DEBUG, "Receiving message from obs-kmsgrab-send");
+	dmabuf_capture_t *clone = bzalloc(sizeof(dmabuf_capture_t));
+	memcpy(clone->card, cap->card, sizeof(clone->card));
+	clone->fb = cap->fb;
+	clone->fd = fd;
+	clone->pinned_bytes = cap->pinned_bytes;
+	pinned_bytes_total_add((long)clone->pinned_bytes);
+	return clone;
+}
 
-	for (;;) {
-		struct msghdr msg = {0};
+static void dmabuf_capture_destroy(dmabuf_capture_t *cap)
+{
+	if (!cap)
+		return;
 
-		struct iovec io = {
-			.iov_base = &list->resp,
-			.iov_len = sizeof(list->resp),
-		};
-		msg.msg_iov = &io;
-		msg.msg_iovlen = 1;
+	blog(LOG_DEBUG, "dmabuf_capture_destroy %p", cap);
 
-		char cmsg_buf[CMSG_SPACE(sizeof(int) *
-					 OBS_DRMSEND_MAX_FRAMEBUFFERS)];
-		msg.msg_control = cmsg_buf;
-		msg.msg_controllen = sizeof(cmsg_buf);
-		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
-		cmsg->cmsg_level = SOL_SOCKET;
-		cmsg->cmsg_type = SCM_RIGHTS;
-		cmsg->cmsg_len =
-			CMSG_LEN(sizeof(int) * OBS_DRMSEND_MAX_FRAMEBUFFERS);
+	if (cap->texture) {
+		obs_enter_graphics();
+		gs_texture_destroy(cap->texture);
+		obs_leave_graphics();
+	}
 
-		// FIXME blocking, may hang if drmsend dies before sending anything
-		const ssize_t recvd = recvmsg(connfd, &msg, 0);
-		blog(LOG_DEBUG, "recvmsg = %d", (int)recvd);
-		if (recvd <= 0) {
-			blog(LOG_ERROR, "cannot recvmsg: %d", errno);
-			break;
-		}
+	close(cap->fd);
+	pinned_bytes_total_add(-(long)cap->pinned_bytes);
+	bfree(cap);
+}
 
-		if (io.iov_len != sizeof(list->resp)) {
-			blog(LOG_ERROR,
-			     "Received metadata size mismatch: %d received, %d expected",
-			     (int)io.iov_len, (int)sizeof(list->resp));
-			break;
-		}
+static dmabuf_capture_t *dmabuf_source_get_capture(const dmabuf_source_t *ctx)
+{
+	return __atomic_load_n(&ctx->capture, __ATOMIC_ACQUIRE);
+}
 
-		if (list->resp.tag != OBS_DRMSEND_TAG) {
-			blog(LOG_ERROR,
-			     "Received metadata tag mismatch: %#x received, %#x expected",
-			     list->resp.tag, OBS_DRMSEND_TAG);
-			break;
-		}
+static void dmabuf_source_set_size(dmabuf_source_t *ctx,
+				   const drmsend_framebuffer_t *fb)
+{
+	fb_view_t view = {0};
+	if (fb)
+		fb_view_init(&view, fb, os_atomic_load_bool(&ctx->transform));
+	os_atomic_set_long(&ctx->width, view.out_width);
+	os_atomic_set_long(&ctx->height, view.out_height);
+}
 
-		if (cmsg->cmsg_len !=
-		    CMSG_LEN(sizeof(int) * list->resp.num_framebuffers)) {
-			blog(LOG_ERROR,
-			     "Received fd size mismatch: %d received, %d expected",
-			     (int)cmsg->cmsg_len,
-			     (int)CMSG_LEN(sizeof(int) *
-					   list->resp.num_framebuffers));
-			break;
-		}
+/* Makes cap the one being rendered. The previous capture may still be in use
+ * by the render thread, so it is only queued for destruction. Publishing NULL
+ * keeps the last reported size. */
+static void dmabuf_source_publish(dmabuf_source_t *ctx, dmabuf_capture_t *cap)
+{
+	if (cap)
+		dmabuf_source_set_size(ctx, &cap->fb);
+
+	dmabuf_capture_t *old =
+		__atomic_exchange_n(&ctx->capture, cap, __ATOMIC_ACQ_REL);
+	flightrec_log(ctx->rec, FLIGHTREC_SWITCH, cap ? cap->fb.fb_id : 0,
+		      old ? old->fb.fb_id : 0, 0);
+	if (!old)
+		return;
 
-		memcpy(list->fb_fds, CMSG_DATA(cmsg),
-		       sizeof(int) * list->resp.num_framebuffers);
-		retval = 1;
-		break;
-	}
-	close(connfd);
+	dmabuf_capture_t *head = __atomic_load_n(&ctx->retired, __ATOMIC_ACQUIRE);
+	do {
+		old->next_retired = head;
+	} while (!__atomic_compare_exchange_n(&ctx->retired, &head, old, true,
+					      __ATOMIC_ACQ_REL,
+					      __ATOMIC_ACQUIRE));
+}
 
-	if (retval) {
-		blog(LOG_INFO,
-		     "Received %d framebuffers:", list->resp.num_framebuffers);
-		for (int i = 0; i < list->resp.num_framebuffers; ++i) {
-			const drmsend_framebuffer_t *fb =
-				list->resp.framebuffers + i;
-			blog(LOG_INFO,
-			     "Received width=%d height=%d pitch=%u fourcc=%#x fd=%d",
-			     fb->width, fb->height, fb->pitch, fb->fourcc,
-			     list->fb_fds[i]);
-		}
+/* Must be called from the render thread outside of video_render */
+static void dmabuf_source_reclaim(dmabuf_source_t *ctx)
+{
+	dmabuf_capture_t *cap =
+		__atomic_exchange_n(&ctx->retired, NULL, __ATOMIC_ACQ_REL);
+	while (cap) {
+		dmabuf_capture_t *next = cap->next_retired;
+		dmabuf_capture_destroy(cap);
+		cap = next;
 	}
+}
 
-	// TODO consider using separate thread for waitpid() on drmsend_pid
-	/* 5. waitpid() on obs-kmsgrab-send w/ timeout (poll) */
-	int exited = 0;
-child_cleanup:
-	for (int i = 0; i < 10; ++i) {
-		usleep(500 * 1000);
-		int wstatus = 0;
-		const pid_t p = waitpid(drmsend_pid, &wstatus, WNOHANG);
-		if (p == drmsend_pid) {
-			if (wstatus == 0 || WIFEXITED(wstatus)) {
-				exited = 1;
-				const int status = WEXITSTATUS(wstatus);
-				if (status != 0)
-					blog(LOG_ERROR, "%s returned %d",
-					     drmsend_filename, status);
-				break;
-			}
-		} else if (-1 == p) {
-			const int err = errno;
-			blog(LOG_ERROR, "Cannot waitpid() on drmsend: %d", err);
-			if (err == ECHILD) {
-				exited = 1;
-				break;
+/* Dumps from the next tick rather than from wherever trouble is found, which
+ * may be holding locks. Must be called from the graphics thread. */
+static void dmabuf_source_request_dump(dmabuf_source_t *ctx,
+				       flightrec_reason_t reason)
+{
+	if (ctx->dump_pending)
+		return;
+
+	ctx->dump_pending = true;
+	ctx->dump_reason = reason;
+}
+
+static void dmabuf_import_task(void *param)
+{
+	UNUSED_PARAMETER(param);
+
+	pthread_mutex_lock(&import_mutex);
+	import_task_queued = false;
+
+	if (import_queue) {
+		obs_enter_graphics();
+		for (dmabuf_source_t *ctx = import_queue; ctx;
+		     ctx = ctx->import_next) {
+			dmabuf_capture_t *cap = ctx->pending;
+			ctx->pending = NULL;
+
+			/* Until here the previous capture is still rendered */
+			const uint64_t start_ns = os_gettime_ns();
+			const bool imported = dmabuf_capture_import(cap);
+			const uint64_t end_ns = os_gettime_ns();
+			const uint64_t waited_ns = start_ns - cap->queued_ns;
+			flightrec_log_at(ctx->rec, end_ns,
+					 imported ? FLIGHTREC_IMPORT
+						  : FLIGHTREC_IMPORT_FAILED,
+					 cap->fb.fb_id, end_ns - start_ns,
+					 waited_ns);
+
+			if (!imported) {
+				dmabuf_capture_destroy(cap);
+				cap = NULL;
+				dmabuf_source_set_size(ctx, NULL);
+				dmabuf_source_request_dump(
+					ctx, FLIGHTREC_REASON_IMPORT_FAILED);
+			} else if (waited_ns > STALL_NS) {
+				dmabuf_source_request_dump(
+					ctx, FLIGHTREC_REASON_IMPORT_STALLED);
 			}
+
+			dmabuf_source_publish(ctx, cap);
 		}
+		obs_leave_graphics();
+		import_queue = NULL;
 	}
 
-	if (!exited)
-		blog(LOG_ERROR, "Couldn't wait for %s to exit, expect zombies",
-		     drmsend_filename);
+	pthread_mutex_unlock(&import_mutex);
+}
 
-socket_cleanup:
-	close(sockfd);
-	unlink(addr.sun_path);
+/* Must be called with import_mutex held */
+static dmabuf_capture_t *dmabuf_source_unqueue(dmabuf_source_t *ctx)
+{
+	for (dmabuf_source_t **it = &import_queue; *it;
+	     it = &(*it)->import_next) {
+		if (*it != ctx)
+			continue;
+
+		*it = ctx->import_next;
+		ctx->import_next = NULL;
+		dmabuf_capture_t *cap = ctx->pending;
+		ctx->pending = NULL;
+		return cap;
+	}
 
-filename_cleanup:
-	free(drmsend_filename);
-	return retval;
+	return NULL;
 }
 
-static void dmabuf_source_close(dmabuf_source_t *ctx)
+/* Removes capture queued for import from the queue and returns it */
+static dmabuf_capture_t *dmabuf_source_take_pending(dmabuf_source_t *ctx)
 {
-	blog(LOG_DEBUG, "dmabuf_source_close %p", ctx);
-	ctx->active_fb = -1;
+	pthread_mutex_lock(&import_mutex);
+	dmabuf_capture_t *cap = dmabuf_source_unqueue(ctx);
+	pthread_mutex_unlock(&import_mutex);
+	return cap;
 }
 
-static void dmabuf_source_close_fds(dmabuf_source_t *ctx)
+/* Unpublishes the capture, returning an unimported copy of the most recent
+ * selection: the one queued for import if any, the rendered one otherwise.
+ * Done under import_mutex, so that an import in flight is either published
+ * before and copied here, or dropped from the queue. */
+static dmabuf_capture_t *dmabuf_source_release_texture(dmabuf_source_t *ctx)
 {
-	for (int i = 0; i < ctx->fbs.resp.num_framebuffers; ++i) {
-		const int fd = ctx->fbs.fb_fds[i];
-		if (fd > 0)
-			close(fd);
-	}
+	pthread_mutex_lock(&import_mutex);
+
+	dmabuf_capture_t *cap = dmabuf_source_unqueue(ctx);
+	const dmabuf_capture_t *current = dmabuf_source_get_capture(ctx);
+	if (!cap && current)
+		cap = dmabuf_capture_clone(current);
+	if (cap)
+		dmabuf_source_publish(ctx, NULL);
+
+	/* Nothing is left to import or render, get_pinned_bytes reports 0 */
+	assert(!cap || (!ctx->pending && !dmabuf_source_get_capture(ctx)));
+
+	pthread_mutex_unlock(&import_mutex);
+	return cap;
+}
+
+/* Drops capture queued for import, if any */
+static void dmabuf_source_cancel_import(dmabuf_source_t *ctx)
+{
+	dmabuf_capture_destroy(dmabuf_source_take_pending(ctx));
 }
 
-static void dmabuf_source_open(dmabuf_source_t *ctx, uint32_t fb_id)
+static bool dmabuf_source_pending_matches(dmabuf_source_t *ctx,
+					  const char *card, uint32_t fb_id)
 {
-	blog(LOG_DEBUG, "dmabuf_source_open %p %#x", ctx, fb_id);
-	assert(ctx->active_fb == -1);
+	pthread_mutex_lock(&import_mutex);
+	const bool matches = dmabuf_capture_matches(ctx->pending, card, fb_id);
+	pthread_mutex_unlock(&import_mutex);
+	return matches;
+}
+
+static void dmabuf_source_queue_import(dmabuf_source_t *ctx,
+				       dmabuf_capture_t *cap)
+{
+	dmabuf_source_cancel_import(ctx);
+
+	cap->queued_ns = os_gettime_ns();
+	flightrec_log_at(ctx->rec, cap->queued_ns, FLIGHTREC_IMPORT_QUEUED,
+			 cap->fb.fb_id, 0, 0);
+
+	pthread_mutex_lock(&import_mutex);
+
+	ctx->pending = cap;
+	ctx->import_next = import_queue;
+	import_queue = ctx;
 
-	int index;
-	for (index = 0; index < ctx->fbs.resp.num_framebuffers; ++index)
-		if (fb_id == ctx->fbs.resp.framebuffers[index].fb_id)
-			break;
+	const bool need_task = !import_task_queued;
+	import_task_queued = true;
 
-	if (index == ctx->fbs.resp.num_framebuffers) {
-		blog(LOG_ERROR, "Framebuffer id=%#x not found", fb_id);
+	pthread_mutex_unlock(&import_mutex);
+
+	if (need_task)
+		obs_queue_task(OBS_TASK_GRAPHICS, dmabuf_import_task, NULL,
+			       false);
+}
+
+/* Must be called with ctx->mutex held */
+static void dmabuf_source_set_dormant(dmabuf_source_t *ctx, bool dormant)
+{
+	if (ctx->dormant == dormant)
 		return;
+
+	blog(LOG_DEBUG, "dmabuf_source_set_dormant %p %d", ctx, dormant);
+	os_atomic_set_bool(&ctx->dormant, dormant);
+	flightrec_log(ctx->rec, FLIGHTREC_DORMANT, dormant, 0, 0);
+
+	if (dormant) {
+		if (!ctx->release_when_hidden)
+			return;
+
+		/* Keep the buffer, drop the texture */
+		dmabuf_capture_t *cap = dmabuf_source_release_texture(ctx);
+		if (cap) {
+			dmabuf_capture_destroy(ctx->dormant_cap);
+			ctx->dormant_cap = cap;
+		}
+	} else if (ctx->dormant_cap) {
+		dmabuf_source_queue_import(ctx, ctx->dormant_cap);
+		ctx->dormant_cap = NULL;
 	}
+}
 
-	blog(LOG_DEBUG, "Using framebuffer id=%#x (index=%d)", fb_id, index);
+/* Must be called with ctx->mutex held */
+static void dmabuf_source_refresh_dormancy(dmabuf_source_t *ctx)
+{
+	dmabuf_source_set_dormant(ctx, !ctx->showing || ctx->dpms_off);
+}
 
-	const drmsend_framebuffer_t *fb = ctx->fbs.resp.framebuffers + index;
+/* Must be called with ctx->mutex held */
+static bool dmabuf_source_is_selected(dmabuf_source_t *ctx, const char *card,
+				      uint32_t fb_id)
+{
+	if (dmabuf_source_pending_matches(ctx, card, fb_id))
+		return true;
 
-	blog(LOG_DEBUG, "%dx%d %d %d %d", fb->width, fb->height,
-	     ctx->fbs.fb_fds[index], fb->offset, fb->pitch);
+	return dmabuf_capture_matches(ctx->dormant_cap, card, fb_id) ||
+	       (!ctx->dormant_cap &&
+		dmabuf_capture_matches(dmabuf_source_get_capture(ctx), card,
+				       fb_id));
+}
 
-	// FIXME why is this needed?
-	obs_enter_graphics();
+static bool dmabuf_fblist_has_card(const dmabuf_fblist_t *list,
+				   const char *card)
+{
+	for (int i = 0; i < list->resp.num_cards; ++i) {
+		if (strcmp(card, list->resp.cards[i].path) == 0)
+			return true;
+	}
+	return false;
+}
 
-	const uint32_t stride = fb->pitch;
-	const uint32_t offset = fb->offset;
-	ctx->texture = gs_texture_create_from_dmabuf(fb->width, fb->height,
-			GS_BGRA, // FIXME handle fourcc?
-			1, // FIXME handle planes
-			ctx->fbs.fb_fds + index,
-			&stride,
-			&offset,
-			NULL // FIXME what are modifiers? we just don't know
-	);
+/* Stores what fb was picked, so that the selection can be found again by
+ * connector once fb ids have changed */
+static void dmabuf_source_remember_selection(obs_data_t *settings,
+					     const drmsend_framebuffer_t *fb)
+{
+	obs_data_set_int(settings, "framebuffer", fb->fb_id);
+	if (fb->primary && fb->connector_name[0])
+		obs_data_set_string(settings, "connector", fb->connector_name);
+}
 
-	obs_leave_graphics();
+/* Makes framebuffer selected by settings the capture. It is looked for in
+ * list first; the helper is asked if list doesn't have it, unless list is
+ * a complete enumeration of the card and fallback is not set.
+ *
+ * @return true if a new capture has been made */
+static bool dmabuf_source_select(dmabuf_source_t *ctx, obs_data_t *settings,
+				 dmabuf_fblist_t *list, bool fallback)
+{
+	const char *card = obs_data_get_string(settings, "dri_card");
+	const char *connector = obs_data_get_string(settings, "connector");
+	const uint32_t fb_id = obs_data_get_int(settings, "framebuffer");
 
-	if (!ctx->texture) {
-		blog(LOG_ERROR, "Could not create texture from dmabuf source");
-		return;
+	pthread_mutex_lock(&ctx->mutex);
+	const bool selected = dmabuf_source_is_selected(ctx, card, fb_id);
+	pthread_mutex_unlock(&ctx->mutex);
+
+	if (selected)
+		return false;
+
+	int index = list ? dmabuf_topology_find(&list->resp, card, connector,
+						fb_id)
+			 : -1;
+	if (index >= 0) {
+		dmabuf_fblist_addref(list);
+	} else if (!list || fallback || !dmabuf_fblist_has_card(list, card)) {
+		const uint64_t start_ns = os_gettime_ns();
+		list = dmabuf_fblist_receive(&card, 1);
+		flightrec_log(ctx->rec, FLIGHTREC_ENUMERATE,
+			      list ? list->resp.num_framebuffers : 0,
+			      os_gettime_ns() - start_ns, 1);
+		if (!list)
+			blog(LOG_ERROR,
+			     "Unable to enumerate DRM/KMS framebuffers");
+		else
+			index = dmabuf_topology_find(&list->resp, card,
+						     connector, fb_id);
+	} else {
+		dmabuf_fblist_addref(list);
+	}
+
+	dmabuf_capture_t *cap = NULL;
+	if (list) {
+		if (index >= 0) {
+			cap = dmabuf_capture_create(list, index);
+			dmabuf_source_remember_selection(
+				settings, list->resp.framebuffers + index);
+		} else {
+			blog(LOG_ERROR, "Framebuffer id=%#x (%s) not found",
+			     fb_id, connector);
+		}
+
+		dmabuf_fblist_release(list);
+	}
+
+	flightrec_log(ctx->rec, FLIGHTREC_SELECT, cap ? cap->fb.fb_id : 0,
+		      cap ? cap->fb.crtc_id : 0, 0);
+
+	pthread_mutex_lock(&ctx->mutex);
+
+	/* Whatever was selected before is superseded */
+	dmabuf_source_cancel_import(ctx);
+	dmabuf_capture_destroy(ctx->dormant_cap);
+	ctx->dormant_cap = NULL;
+
+	drm_monitor_close(&ctx->monitor);
+	ctx->dpms_off = false;
+
+	if (!cap) {
+		dmabuf_source_publish(ctx, NULL);
+		dmabuf_source_set_size(ctx, NULL);
+	} else {
+		drm_monitor_open(&ctx->monitor, cap->card, cap->fb.crtc_id,
+				 cap->fb.connector_id);
+
+		if (ctx->dormant && ctx->release_when_hidden) {
+			/* Will be imported when shown */
+			ctx->dormant_cap = cap;
+			dmabuf_source_publish(ctx, NULL);
+			dmabuf_source_set_size(ctx, &cap->fb);
+		} else {
+			/* Texture is created on the graphics thread,
+			 * current capture stays in use until it is ready */
+			dmabuf_source_queue_import(ctx, cap);
+		}
 	}
 
-	ctx->active_fb = index;
+	dmabuf_source_refresh_dormancy(ctx);
+
+	pthread_mutex_unlock(&ctx->mutex);
+
+	return cap != NULL;
 }
 
 static void dmabuf_source_update(void *data, obs_data_t *settings)
 {
 	dmabuf_source_t *ctx = data;
-	blog(LOG_DEBUG, "dmabuf_source_udpate", ctx);
+	blog(LOG_DEBUG, "dmabuf_source_udpate %p", ctx);
 
 	ctx->show_cursor = obs_data_get_bool(settings, "show_cursor");
+	os_atomic_set_bool(&ctx->transform,
+			   obs_data_get_bool(settings, "transform"));
+	const dmabuf_capture_t *cap = dmabuf_source_get_capture(ctx);
+	if (cap)
+		dmabuf_source_set_size(ctx, &cap->fb);
+	os_atomic_set_bool(&ctx->snapshot, obs_data_get_bool(settings, "snapshot"));
+
+	const xcb_window_t window = obs_data_get_int(settings, "window");
+	const char *window_class = obs_data_get_string(settings, "window_class");
+
+	pthread_mutex_lock(&ctx->mutex);
+	ctx->release_when_hidden =
+		obs_data_get_bool(settings, "release_when_hidden");
+	if (window != ctx->window_id ||
+	    strcmp(window_class, ctx->window_class) != 0) {
+		ctx->window_id = window;
+		snprintf(ctx->window_class, sizeof(ctx->window_class), "%s",
+			 window_class);
+		ctx->window_changed = true;
+		os_atomic_set_bool(&ctx->following, window != 0);
+	}
+	pthread_mutex_unlock(&ctx->mutex);
+
+	/* Startup enumeration will call back, report last known size until
+	 * then instead of running the helper for every source */
+	if (dmabuf_topology_refreshing()) {
+		drmsend_framebuffer_t fb;
+		if (!cap && dmabuf_topology_lookup(
+				    obs_data_get_string(settings, "dri_card"),
+				    obs_data_get_string(settings, "connector"),
+				    obs_data_get_int(settings, "framebuffer"),
+				    &fb))
+			dmabuf_source_set_size(ctx, &fb);
+		return;
+	}
 
-	dmabuf_source_close_fds(ctx);
-	dmabuf_source_close(ctx);
-	dmabuf_source_open(ctx, obs_data_get_int(settings, "framebuffer"));
+	dmabuf_source_select(ctx, settings, NULL, true);
 }
 
-static void *dmabuf_source_create(obs_data_t *settings, obs_source_t *source)
+static void dmabuf_source_topology_refreshed(void *data,
+					     dmabuf_fblist_t *list)
 {
-	blog(LOG_DEBUG, "dmabuf_source_create");
-	(void)settings;
+	dmabuf_source_t *ctx = data;
 
-	dmabuf_source_t *ctx = bzalloc(sizeof(dmabuf_source_t));
-	ctx->source = source;
-	ctx->active_fb = -1;
+	flightrec_log(ctx->rec, FLIGHTREC_ENUMERATE,
+		      list ? list->resp.num_framebuffers : 0, 0, 0);
+
+	obs_data_t *settings = obs_source_get_settings(ctx->source);
+	dmabuf_source_select(ctx, settings, list, false);
+	obs_data_release(settings);
+}
 
-#define COUNTOF(a) (sizeof(a) / sizeof(*a))
-	for (int i = 0; i < (int)COUNTOF(ctx->fbs.fb_fds); ++i) {
-		ctx->fbs.fb_fds[i] = -1;
+static void dmabuf_source_show(void *data)
+{
+	dmabuf_source_t *ctx = data;
+
+	pthread_mutex_lock(&ctx->mutex);
+	os_atomic_set_bool(&ctx->showing, true);
+	/* Check DPMS on the next tick */
+	ctx->next_dpms_check_ns = 0;
+	dmabuf_source_refresh_dormancy(ctx);
+	pthread_mutex_unlock(&ctx->mutex);
+}
+
+static void dmabuf_source_hide(void *data)
+{
+	dmabuf_source_t *ctx = data;
+
+	pthread_mutex_lock(&ctx->mutex);
+	os_atomic_set_bool(&ctx->showing, false);
+	dmabuf_source_refresh_dormancy(ctx);
+	pthread_mutex_unlock(&ctx->mutex);
+}
+
+/* Capture is paused while the output it comes from is powered down */
+static void dmabuf_source_check_dpms(dmabuf_source_t *ctx, uint64_t now)
+{
+	if (now < ctx->next_dpms_check_ns)
+		return;
+
+	/* Don't stall the graphics thread, try again on the next tick */
+	if (pthread_mutex_trylock(&ctx->mutex) != 0)
+		return;
+
+	ctx->next_dpms_check_ns = now + DPMS_CHECK_INTERVAL_NS;
+
+	const bool dpms_off = drm_monitor_dpms_off(&ctx->monitor);
+	if (dpms_off != ctx->dpms_off) {
+		blog(LOG_INFO, "Output of source %p is %s", ctx,
+		     dpms_off ? "off, pausing capture" : "on, resuming capture");
+		ctx->dpms_off = dpms_off;
+		flightrec_log_at(ctx->rec, now, FLIGHTREC_DPMS, dpms_off, 0, 0);
+		dmabuf_source_refresh_dormancy(ctx);
 	}
 
-	if (!dmabuf_source_receive_framebuffers(obs_data_get_string(settings, "dri_card"), &ctx->fbs)) {
-		blog(LOG_ERROR, "Unable to enumerate DRM/KMS framebuffers");
-		bfree(ctx);
+	pthread_mutex_unlock(&ctx->mutex);
+}
+
+static void dmabuf_source_get_pinned_bytes(void *data, calldata_t *cd)
+{
+	const dmabuf_source_t *ctx = data;
+	const dmabuf_capture_t *cap = dmabuf_source_get_capture(ctx);
+	calldata_set_int(cd, "bytes", cap ? (long long)cap->pinned_bytes : 0);
+	calldata_set_int(cd, "total_bytes",
+			 os_atomic_load_long(&pinned_bytes_total));
+}
+
+/* Damage of the latest frame as "x,y,width,height;...", empty if full or
+ * nothing has changed */
+static void dmabuf_source_get_damage(void *data, calldata_t *cd)
+{
+	dmabuf_source_t *ctx = data;
+
+	char rects[DRM_DAMAGE_MAX_RECTS * 48] = "";
+	size_t len = 0;
+
+	pthread_mutex_lock(&ctx->damage_mutex);
+	const drm_damage_t *damage = &ctx->damage;
+	for (int i = 0; !damage->full && i < damage->num_rects; ++i) {
+		const drm_damage_rect_t *r = damage->rects + i;
+		len += snprintf(rects + len, sizeof(rects) - len,
+				"%s%d,%d,%d,%d", i ? ";" : "", r->x1, r->y1,
+				r->x2 - r->x1, r->y2 - r->y1);
+	}
+	calldata_set_bool(cd, "changed", damage->changed);
+	calldata_set_bool(cd, "full", damage->full);
+	calldata_set_int(cd, "flips", damage->flips);
+	calldata_set_int(cd, "changed_frames", ctx->changed_frames);
+	calldata_set_int(cd, "static_frames", ctx->static_frames);
+	pthread_mutex_unlock(&ctx->damage_mutex);
+
+	calldata_set_string(cd, "rects", rects);
+}
+
+/* Copies made in snapshot mode and the total CPU time spent submitting
+ * them, in ns. That is not how long the GPU takes to copy. */
+static void dmabuf_source_get_snapshot_stats(void *data, calldata_t *cd)
+{
+	dmabuf_source_t *ctx = data;
+
+	calldata_set_bool(cd, "enabled", os_atomic_load_bool(&ctx->snapshot));
+	pthread_mutex_lock(&ctx->damage_mutex);
+	calldata_set_int(cd, "copies", ctx->snapshot_copies);
+	calldata_set_int(cd, "submit_ns", (long long)ctx->snapshot_submit_ns);
+	pthread_mutex_unlock(&ctx->damage_mutex);
+}
+
+/* Writes snapshot to the plugin config directory, named after its source
+ * and the time it was taken.
+ *
+ * @return path of the dump, to be freed with bfree(), NULL on failure */
+static char *dmabuf_flightrec_write(const flightrec_snapshot_t *snapshot)
+{
+	const char *name = snapshot->header.name;
+	const char *reason = flightrec_reason_name(snapshot->header.reason);
+	char file[128], stamp[32];
+	const time_t taken = snapshot->header.realtime_ns / 1000000000ULL;
+	struct tm tm;
+	strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S",
+		 localtime_r(&taken, &tm));
+	int len = snprintf(file, sizeof(file), FLIGHTREC_DIR "/%.64s", name);
+	/* Source names are free-form */
+	for (int i = sizeof(FLIGHTREC_DIR); i < len; ++i) {
+		const char c = file[i];
+		if (!(c >= 'a' && c <= 'z') && !(c >= 'A' && c <= 'Z') &&
+		    !(c >= '0' && c <= '9') && c != '-')
+			file[i] = '_';
+	}
+	snprintf(file + len, sizeof(file) - len, "-%s.kmsfr", stamp);
+
+	char *dir = obs_module_config_path(FLIGHTREC_DIR);
+	char *path = obs_module_config_path(file);
+	if (!dir || !path) {
+		bfree(dir);
+		bfree(path);
+		return NULL;
+	}
+
+	os_mkdirs(dir);
+	bfree(dir);
+
+	if (!flightrec_write(snapshot, path)) {
+		blog(LOG_ERROR, "Cannot write flight recorder to %s: %d", path,
+		     errno);
+		bfree(path);
+		return NULL;
+	}
+
+	blog(LOG_INFO, "Flight recorder of %s dumped to %s (%s)", name, path,
+	     reason);
+	return path;
+}
+
+/* Dumps the flight recorder of ctx right away.
+ *
+ * @return path of the dump, to be freed with bfree(), NULL on failure */
+static char *dmabuf_source_dump(dmabuf_source_t *ctx, flightrec_reason_t reason)
+{
+	flightrec_log(ctx->rec, FLIGHTREC_DUMP, reason, 0, 0);
+
+	flightrec_snapshot_t *snapshot = flightrec_snapshot(
+		ctx->rec, obs_source_get_name(ctx->source), reason);
+	if (!snapshot)
 		return NULL;
+
+	char *path = dmabuf_flightrec_write(snapshot);
+	free(snapshot);
+	return path;
+}
+
+/* Writes automatic dumps. Not a UI task, which libobs drops when there is
+ * no UI to run it. */
+static os_task_queue_t *dump_queue = NULL;
+
+static void dmabuf_flightrec_write_task(void *param)
+{
+	flightrec_snapshot_t *snapshot = param;
+	bfree(dmabuf_flightrec_write(snapshot));
+	free(snapshot);
+}
+
+/* Automatic dumps are made from the graphics thread while capture is in
+ * trouble, so only the ring is copied there and the file is written from
+ * dump_queue */
+static void dmabuf_source_queue_dump(dmabuf_source_t *ctx,
+				     flightrec_reason_t reason, uint64_t now_ns)
+{
+	flightrec_log_at(ctx->rec, now_ns, FLIGHTREC_DUMP, reason, 0, 0);
+
+	flightrec_snapshot_t *snapshot = flightrec_snapshot(
+		ctx->rec, obs_source_get_name(ctx->source), reason);
+	if (snapshot && (!dump_queue ||
+			 !os_task_queue_queue_task(dump_queue,
+						   dmabuf_flightrec_write_task,
+						   snapshot))) {
+		blog(LOG_WARNING, "Cannot queue flight recorder dump of %s",
+		     snapshot->header.name);
+		free(snapshot);
 	}
+}
+
+static void dmabuf_source_dump_flightrec(void *data, calldata_t *cd)
+{
+	char *path = dmabuf_source_dump(data, FLIGHTREC_REASON_REQUESTED);
+	calldata_set_string(cd, "path", path ? path : "");
+	bfree(path);
+}
+
+static void dmabuf_source_dump_hotkey(void *data, obs_hotkey_id id,
+				      obs_hotkey_t *hotkey, bool pressed)
+{
+	UNUSED_PARAMETER(id);
+	UNUSED_PARAMETER(hotkey);
+
+	if (pressed)
+		bfree(dmabuf_source_dump(data, FLIGHTREC_REASON_REQUESTED));
+}
+
+static void *dmabuf_source_create(obs_data_t *settings, obs_source_t *source)
+{
+	blog(LOG_DEBUG, "dmabuf_source_create");
+
+	dmabuf_source_t *ctx = bzalloc(sizeof(dmabuf_source_t));
+	ctx->source = source;
+	pthread_mutex_init(&ctx->mutex, NULL);
+	pthread_mutex_init(&ctx->damage_mutex, NULL);
+	ctx->rec = bzalloc(sizeof(flightrec_t));
+	ctx->monitor.fd = -1;
+	/* Sources are created hidden */
+	ctx->dormant = true;
 
 	ctx->xcb = xcb_connect(NULL, NULL);
 	if (!ctx->xcb || xcb_connection_has_error(ctx->xcb)) {
@@ -405,86 +1011,555 @@ static void *dmabuf_source_create(obs_data_t *settings, obs_source_t *source)
 
 	ctx->cursor = xcb_xcursor_init(ctx->xcb);
 
+	proc_handler_t *ph = obs_source_get_proc_handler(source);
+	proc_handler_add(ph,
+			 "void get_pinned_bytes(out int bytes, out int total_bytes)",
+			 dmabuf_source_get_pinned_bytes, ctx);
+	proc_handler_add(ph,
+			 "void get_damage(out bool changed, out bool full, out int flips, "
+			 "out int changed_frames, out int static_frames, out string rects)",
+			 dmabuf_source_get_damage, ctx);
+	proc_handler_add(ph,
+			 "void get_snapshot_stats(out bool enabled, out int copies, out int submit_ns)",
+			 dmabuf_source_get_snapshot_stats, ctx);
+	proc_handler_add(ph, "void dump_flight_recorder(out string path)",
+			 dmabuf_source_dump_flightrec, ctx);
+
+	ctx->dump_hotkey = obs_hotkey_register_source(
+		source, "kmsgrab.dump_flight_recorder",
+		"Dump capture flight recorder", dmabuf_source_dump_hotkey, ctx);
+
+	signal_handler_add(obs_source_get_signal_handler(source),
+			   "void content_changed(ptr source, bool full, int num_rects)");
+
+	dmabuf_topology_watch(source, dmabuf_source_topology_refreshed);
 	dmabuf_source_update(ctx, settings);
 	return ctx;
 }
 
+static void dmabuf_source_free_snapshots(dmabuf_source_t *ctx)
+{
+	if (!ctx->snapshot_tex)
+		return;
+
+	obs_enter_graphics();
+	for (int i = 0; i < SNAPSHOT_RING_SIZE; ++i) {
+		gs_texture_destroy(ctx->snapshot_ring[i]);
+		ctx->snapshot_ring[i] = NULL;
+	}
+	obs_leave_graphics();
+
+	ctx->snapshot_tex = NULL;
+	ctx->snapshot_next = 0;
+}
+
 static void dmabuf_source_destroy(void *data)
 {
 	dmabuf_source_t *ctx = data;
 	blog(LOG_DEBUG, "dmabuf_source_destroy %p", ctx);
 
-	if (ctx->texture)
-		gs_texture_destroy(ctx->texture);
+	obs_hotkey_unregister(ctx->dump_hotkey);
+	dmabuf_topology_unwatch(ctx->source);
 
-	dmabuf_source_close(ctx);
-	dmabuf_source_close_fds(ctx);
+	dmabuf_source_cancel_import(ctx);
+	dmabuf_source_publish(ctx, NULL);
+	dmabuf_source_reclaim(ctx);
+	dmabuf_source_free_snapshots(ctx);
+	dmabuf_capture_destroy(ctx->dormant_cap);
+	drm_monitor_close(&ctx->monitor);
+	pthread_mutex_destroy(&ctx->mutex);
+	pthread_mutex_destroy(&ctx->damage_mutex);
+	bfree(ctx->rec);
 
 	if (ctx->cursor)
 		xcb_xcursor_destroy(ctx->cursor);
 
+	xcb_xwindow_unfollow(&ctx->window);
 	if (ctx->xcb)
 		xcb_disconnect(ctx->xcb);
 
 	bfree(data);
 }
 
+static bool dmabuf_source_scanout_time(dmabuf_source_t *ctx,
+				       uint64_t *timestamp_ns)
+{
+	/* Don't stall the graphics thread, cursor can do without for a frame */
+	if (pthread_mutex_trylock(&ctx->mutex) != 0)
+		return false;
+
+	const bool known = drm_monitor_last_vblank(&ctx->monitor, timestamp_ns);
+	pthread_mutex_unlock(&ctx->mutex);
+	return known;
+}
+
+/* Finds where the framebuffer is in X screen coordinates. One as large as
+ * the screen is the screen itself; one per output, which is what page
+ * flipping compositors scan out, is looked up through RandR by the CRTC
+ * that scans it out. */
+static void dmabuf_source_find_origin(dmabuf_source_t *ctx,
+				      const dmabuf_capture_t *cap)
+{
+	snprintf(ctx->origin_card, sizeof(ctx->origin_card), "%s", cap->card);
+	ctx->origin_fb_id = cap->fb.fb_id;
+	ctx->origin_x = ctx->origin_y = 0;
+
+	const xcb_screen_t *screen =
+		xcb_setup_roots_iterator(xcb_get_setup(ctx->xcb)).data;
+	if (cap->fb.width >= screen->width_in_pixels &&
+	    cap->fb.height >= screen->height_in_pixels)
+		return;
+
+	if (!xcb_xwindow_crtc_origin(ctx->xcb, cap->fb.connector_id,
+				     cap->fb.crtc_width, cap->fb.crtc_height,
+				     &ctx->origin_x, &ctx->origin_y))
+		blog(LOG_WARNING,
+		     "Cannot find output %s on X screen, assuming it is at 0,0",
+		     cap->fb.connector_name);
+}
+
+/* Keeps crop rectangle and cursor offset in sync with the followed window
+ * and the framebuffer it is on. Must be called from the graphics thread.
+ *
+ * @return true if the part of the framebuffer being shown has changed */
+static bool dmabuf_source_track_window(dmabuf_source_t *ctx,
+				       const dmabuf_capture_t *cap)
+{
+	if (!ctx->xcb || xcb_connection_has_error(ctx->xcb))
+		return false;
+
+	bool changed = false;
+
+	/* Don't stall the graphics thread, selection can wait for a frame */
+	if (pthread_mutex_trylock(&ctx->mutex) == 0) {
+		const bool window_changed = ctx->window_changed;
+		const xcb_window_t window_id = ctx->window_id;
+		char window_class[sizeof(ctx->window_class)];
+		memcpy(window_class, ctx->window_class, sizeof(window_class));
+		ctx->window_changed = false;
+		pthread_mutex_unlock(&ctx->mutex);
+
+		if (window_changed) {
+			xcb_xwindow_unfollow(&ctx->window);
+			const xcb_window_t id = xcb_xwindow_find(
+				ctx->xcb, window_id, window_class);
+			if (window_id &&
+			    !xcb_xwindow_follow(&ctx->window, ctx->xcb, id,
+						window_class))
+				blog(LOG_WARNING,
+				     "Window %#x (%s) not found, nothing will be captured%s",
+				     window_id, window_class,
+				     window_class[0] ? " until it is reopened"
+						     : "");
+			changed = true;
+		}
+	}
+
+	if (!dmabuf_capture_matches(cap, ctx->origin_card, ctx->origin_fb_id)) {
+		dmabuf_source_find_origin(ctx, cap);
+		changed = true;
+	}
+
+	const bool obscured = ctx->window.obscured;
+	if (xcb_xwindow_poll(&ctx->window))
+		changed = true;
+
+	if (!changed)
+		return false;
+
+	if (ctx->window.obscured != obscured)
+		blog(LOG_INFO,
+		     "Window %#x is %s", ctx->window.window,
+		     ctx->window.obscured
+			     ? "obscured, windows on top of it will be captured too"
+			     : "no longer obscured");
+
+	/* Only the part of the window that is on this framebuffer */
+	int x0 = 0, y0 = 0, x1 = 0, y1 = 0;
+	if (ctx->window.window && ctx->window.mapped) {
+		x0 = ctx->window.x - ctx->origin_x;
+		y0 = ctx->window.y - ctx->origin_y;
+		x1 = x0 + ctx->window.width;
+		y1 = y0 + ctx->window.height;
+		x0 = x0 < 0 ? 0 : x0;
+		y0 = y0 < 0 ? 0 : y0;
+		x1 = x1 > (int)cap->fb.width ? (int)cap->fb.width : x1;
+		y1 = y1 > (int)cap->fb.height ? (int)cap->fb.height : y1;
+		if (x1 < x0 || y1 < y0)
+			x0 = x1 = y0 = y1 = 0;
+	}
+
+	ctx->crop_x0 = x0;
+	ctx->crop_y0 = y0;
+	ctx->crop_x1 = x1;
+	ctx->crop_y1 = y1;
+
+	/* In framebuffer pixels, like the crop */
+	if (ctx->cursor)
+		xcb_xcursor_offset(ctx->cursor, ctx->origin_x, ctx->origin_y);
+
+	return true;
+}
+
+/* What part of cap is shown and how. Must be called from the graphics
+ * thread. */
+static void dmabuf_source_get_view(const dmabuf_source_t *ctx,
+				   const dmabuf_capture_t *cap,
+				   fb_view_t *view)
+{
+	fb_view_init(view, &cap->fb, os_atomic_load_bool(&ctx->transform));
+	if (os_atomic_load_bool(&ctx->following))
+		fb_view_crop(view, ctx->crop_x0, ctx->crop_y0, ctx->crop_x1,
+			     ctx->crop_y1);
+}
+
+/* Finds out what has changed in this frame, for get_damage() and the
+ * content_changed signal. Must be called from the graphics thread with the
+ * time of the tick.
+ *
+ * @return true if there is new content */
+static bool dmabuf_source_read_damage(dmabuf_source_t *ctx,
+				      const dmabuf_capture_t *cap,
+				      const fb_view_t *view, bool moved,
+				      uint64_t tick_ns)
+{
+	drm_damage_t damage;
+
+	/* Don't stall the graphics thread, report everything as changed if
+	 * monitor is busy */
+	if (pthread_mutex_trylock(&ctx->mutex) == 0) {
+		drm_monitor_read_damage(&ctx->monitor, &damage);
+		pthread_mutex_unlock(&ctx->mutex);
+	} else {
+		memset(&damage, 0, sizeof(damage));
+		damage.flips = ctx->damage.flips;
+		damage.changed = damage.full = true;
+	}
+
+	if (moved ||
+	    !dmabuf_capture_matches(cap, ctx->damage_card, ctx->damage_fb_id)) {
+		snprintf(ctx->damage_card, sizeof(ctx->damage_card), "%s",
+			 cap->card);
+		ctx->damage_fb_id = cap->fb.fb_id;
+		damage.changed = damage.full = true;
+		damage.num_rects = 0;
+	}
+
+	fb_view_map_damage(view, &damage);
+	flightrec_log_at(ctx->rec, tick_ns, FLIGHTREC_TICK,
+			 (damage.changed ? FLIGHTREC_TICK_CHANGED : 0) |
+				 (damage.full ? FLIGHTREC_TICK_FULL : 0) |
+				 (moved ? FLIGHTREC_TICK_MOVED : 0),
+			 damage.flips, damage.num_rects);
+
+	pthread_mutex_lock(&ctx->damage_mutex);
+	ctx->damage = damage;
+	if (damage.changed)
+		ctx->changed_frames++;
+	else
+		ctx->static_frames++;
+	pthread_mutex_unlock(&ctx->damage_mutex);
+
+	if (!damage.changed)
+		return false;
+
+	uint8_t stack[128];
+	calldata_t cd;
+	calldata_init_fixed(&cd, stack, sizeof(stack));
+	calldata_set_ptr(&cd, "source", ctx->source);
+	calldata_set_bool(&cd, "full", damage.full);
+	calldata_set_int(&cd, "num_rects", damage.full ? 0 : damage.num_rects);
+	signal_handler_signal(obs_source_get_signal_handler(ctx->source),
+			      "content_changed", &cd);
+	return true;
+}
+
+static bool dmabuf_snapshot_matches(const gs_texture_t *tex,
+				    const dmabuf_capture_t *cap)
+{
+	return tex && gs_texture_get_width(tex) == (uint32_t)cap->fb.width &&
+	       gs_texture_get_height(tex) == (uint32_t)cap->fb.height;
+}
+
+/* Copies new content of cap into the next texture of the snapshot ring.
+ * Must be called from the graphics thread. */
+static void dmabuf_source_snapshot(dmabuf_source_t *ctx,
+				   const dmabuf_capture_t *cap, bool changed)
+{
+	if (!os_atomic_load_bool(&ctx->snapshot)) {
+		dmabuf_source_free_snapshots(ctx);
+		return;
+	}
+
+	if (!changed && dmabuf_snapshot_matches(ctx->snapshot_tex, cap))
+		return;
+
+	obs_enter_graphics();
+
+	gs_texture_t **tex = ctx->snapshot_ring + ctx->snapshot_next;
+	if (*tex && !dmabuf_snapshot_matches(*tex, cap)) {
+		gs_texture_destroy(*tex);
+		*tex = NULL;
+	}
+	if (!*tex)
+		*tex = gs_texture_create(cap->fb.width, cap->fb.height,
+					 GS_BGRA, 1, NULL, 0);
+
+	if (*tex) {
+		const uint64_t start_ns = os_gettime_ns();
+		gs_copy_texture(*tex, cap->texture);
+		const uint64_t submit_ns = os_gettime_ns() - start_ns;
+		flightrec_log_at(ctx->rec, start_ns + submit_ns,
+				 FLIGHTREC_SNAPSHOT, submit_ns, 0, 0);
+
+		ctx->snapshot_tex = *tex;
+		ctx->snapshot_next = (ctx->snapshot_next + 1) % SNAPSHOT_RING_SIZE;
+
+		pthread_mutex_lock(&ctx->damage_mutex);
+		ctx->snapshot_copies++;
+		ctx->snapshot_submit_ns += submit_ns;
+		pthread_mutex_unlock(&ctx->damage_mutex);
+	} else {
+		blog(LOG_ERROR, "Cannot create %dx%d snapshot texture",
+		     cap->fb.width, cap->fb.height);
+	}
+
+	obs_leave_graphics();
+}
+
 static void dmabuf_source_video_tick(void *data, float seconds)
 {
 	UNUSED_PARAMETER(seconds);
 	dmabuf_source_t *ctx = data;
 
-	if (!ctx->texture)
+	dmabuf_source_reclaim(ctx);
+
+	/* Ticks come every frame, shown or not, so a long gap means the
+	 * graphics thread has been stuck */
+	const uint64_t tick_ns = os_gettime_ns();
+	const uint64_t since_tick_ns =
+		ctx->last_tick_ns ? tick_ns - ctx->last_tick_ns : 0;
+	ctx->last_tick_ns = tick_ns;
+	if (since_tick_ns > STALL_NS && os_atomic_load_bool(&ctx->showing) &&
+	    !os_atomic_load_bool(&ctx->dormant)) {
+		flightrec_log_at(ctx->rec, tick_ns, FLIGHTREC_STALL, 0,
+				 since_tick_ns, 0);
+		dmabuf_source_request_dump(ctx, FLIGHTREC_REASON_TICK_STALLED);
+	}
+
+	if (ctx->dump_pending && tick_ns >= ctx->next_auto_dump_ns) {
+		ctx->next_auto_dump_ns = tick_ns + AUTO_DUMP_INTERVAL_NS;
+		dmabuf_source_queue_dump(ctx, ctx->dump_reason, tick_ns);
+	}
+	ctx->dump_pending = false;
+
+	if (!os_atomic_load_bool(&ctx->showing))
+		return;
+
+	dmabuf_source_check_dpms(ctx, tick_ns);
+
+	if (os_atomic_load_bool(&ctx->dormant))
 		return;
-	if (!obs_source_showing(ctx->source))
+	const dmabuf_capture_t *cap = dmabuf_source_get_capture(ctx);
+	if (!cap)
 		return;
+
+	const bool moved = dmabuf_source_track_window(ctx, cap);
+	fb_view_t view;
+	dmabuf_source_get_view(ctx, cap, &view);
+	os_atomic_set_long(&ctx->crop_width, view.out_width);
+	os_atomic_set_long(&ctx->crop_height, view.out_height);
+
+	const bool changed =
+		dmabuf_source_read_damage(ctx, cap, &view, moved, tick_ns);
+	dmabuf_source_snapshot(ctx, cap, changed);
+
 	if (!ctx->cursor)
 		return;
 
+	const uint64_t request_ns = os_gettime_ns();
 	xcb_xfixes_get_cursor_image_cookie_t cur_c =
 		xcb_xfixes_get_cursor_image_unchecked(ctx->xcb);
 	xcb_xfixes_get_cursor_image_reply_t *cur_r =
 		xcb_xfixes_get_cursor_image_reply(ctx->xcb, cur_c, NULL);
+	const uint64_t reply_ns = os_gettime_ns();
+
+	uint64_t scanout_ns = 0;
+	const bool scanout_known = dmabuf_source_scanout_time(ctx, &scanout_ns);
 
 	obs_enter_graphics();
-	xcb_xcursor_update(ctx->cursor, cur_r);
+	xcb_xcursor_update(ctx->cursor, cur_r,
+			   request_ns + (reply_ns - request_ns) / 2);
+	/* Framebuffer shows the desktop as of its last flip, put cursor where
+	 * it was back then instead of where it is now */
+	if (scanout_known && scanout_ns + MAX_SCANOUT_AGE_NS > reply_ns)
+		xcb_xcursor_sample_at(ctx->cursor, scanout_ns);
 	obs_leave_graphics();
 
+	flightrec_log_at(ctx->rec, reply_ns, FLIGHTREC_CURSOR,
+			 ctx->cursor->last_serial,
+			 (uint64_t)(uint32_t)(int32_t)ctx->cursor->x_render
+					 << 32 |
+				 (uint32_t)(int32_t)ctx->cursor->y_render,
+			 reply_ns - request_ns);
+
 	free(cur_r);
 }
 
-static void dmabuf_source_render(void *data, gs_effect_t *effect)
+/* Two passes with the default effect, for when kmsgrab.effect is missing.
+ * Shows the view as it is in memory, without rotation or scaling. */
+static void dmabuf_source_render_passes(const dmabuf_source_t *ctx,
+					gs_texture_t *tex,
+					const fb_view_t *view)
 {
-	const dmabuf_source_t *ctx = data;
-
-	if (!ctx->texture)
-		return;
-
-	effect = obs_get_base_effect(OBS_EFFECT_DEFAULT);
+	gs_effect_t *effect = obs_get_base_effect(OBS_EFFECT_DEFAULT);
 
 	gs_eparam_t *image = gs_effect_get_param_by_name(effect, "image");
-	gs_effect_set_texture(image, ctx->texture);
+	gs_effect_set_texture(image, tex);
 
 	while (gs_effect_loop(effect, "Draw")) {
-		gs_draw_sprite(ctx->texture, 0, 0, 0);
+		gs_draw_sprite_subregion(tex, 0, view->x, view->y, view->width,
+					 view->height);
 	}
 
 	if (ctx->show_cursor && ctx->cursor) {
+		gs_matrix_push();
+		gs_matrix_translate3f(-(float)view->x, -(float)view->y, 0.f);
 		while (gs_effect_loop(effect, "Draw")) {
 			xcb_xcursor_render(ctx->cursor);
 		}
+		gs_matrix_pop();
 	}
 }
 
+/* Samples the shown part of the framebuffer and blends the cursor over it
+ * in a single draw, with no state changes */
+static void dmabuf_source_render_composite(const dmabuf_source_t *ctx,
+					   const dmabuf_capture_t *cap,
+					   gs_texture_t *tex,
+					   const fb_view_t *view)
+{
+	struct vec2 v;
+	float offset[2], u[2], v_step[2];
+
+	gs_effect_set_texture(composite.image, tex);
+	fb_view_uv(view, &cap->fb, offset, u, v_step);
+	vec2_set(&v, offset[0], offset[1]);
+	gs_effect_set_vec2(composite.image_offset, &v);
+	vec2_set(&v, u[0], u[1]);
+	gs_effect_set_vec2(composite.image_u, &v);
+	vec2_set(&v, v_step[0], v_step[1]);
+	gs_effect_set_vec2(composite.image_v, &v);
+	/* Imported as BGRA whatever the fourcc */
+	const bool swap_rb = cap->fb.fourcc == DRM_FORMAT_XBGR8888 ||
+			     cap->fb.fourcc == DRM_FORMAT_ABGR8888;
+	gs_effect_set_float(composite.swap_rb, swap_rb ? 1.f : 0.f);
+
+	const xcb_xcursor_t *cursor = ctx->show_cursor ? ctx->cursor : NULL;
+	if (cursor && cursor->tex) {
+		/* Placed in the framebuffer, so it turns along with it */
+		gs_effect_set_texture(composite.cursor, cursor->tex);
+		vec2_set(&v, cursor->x_render / cap->fb.width,
+			 cursor->y_render / cap->fb.height);
+		gs_effect_set_vec2(composite.cursor_pos, &v);
+		vec2_set(&v,
+			 (float)cap->fb.width / gs_texture_get_width(cursor->tex),
+			 (float)cap->fb.height /
+				 gs_texture_get_height(cursor->tex));
+		gs_effect_set_vec2(composite.cursor_scale, &v);
+		gs_effect_set_float(composite.cursor_alpha, 1.f);
+	} else {
+		/* Something has to be bound */
+		gs_effect_set_texture(composite.cursor, tex);
+		gs_effect_set_float(composite.cursor_alpha, 0.f);
+	}
+
+	while (gs_effect_loop(composite.effect, "Draw")) {
+		gs_draw_sprite(NULL, 0, view->out_width, view->out_height);
+	}
+}
+
+static void dmabuf_source_render(void *data, gs_effect_t *effect)
+{
+	const dmabuf_source_t *ctx = data;
+	UNUSED_PARAMETER(effect);
+
+	const dmabuf_capture_t *cap = dmabuf_source_get_capture(ctx);
+	if (!cap)
+		return;
+
+	/* Part of the framebuffer that is shown, only the window's one if
+	 * following it */
+	fb_view_t view;
+	dmabuf_source_get_view(ctx, cap, &view);
+	if (!view.out_width || !view.out_height)
+		return;
+
+	const uint64_t start_ns = os_gettime_ns();
+
+	/* Last copy, unless it is of another capture that has not been
+	 * ticked yet */
+	gs_texture_t *tex = cap->texture;
+	if (os_atomic_load_bool(&ctx->snapshot) &&
+	    dmabuf_snapshot_matches(ctx->snapshot_tex, cap))
+		tex = ctx->snapshot_tex;
+
+	if (composite.effect)
+		dmabuf_source_render_composite(ctx, cap, tex, &view);
+	else
+		dmabuf_source_render_passes(ctx, tex, &view);
+
+	const uint64_t end_ns = os_gettime_ns();
+	flightrec_log_at(ctx->rec, end_ns, FLIGHTREC_RENDER, cap->fb.fb_id,
+			 (tex != cap->texture ? FLIGHTREC_RENDER_SNAPSHOT : 0) |
+				 (composite.effect ? FLIGHTREC_RENDER_COMPOSITE
+						   : 0),
+			 end_ns - start_ns);
+}
+
+static void dmabuf_fb_label(char *buf, size_t size,
+			    const drmsend_framebuffer_t *fb)
+{
+	if (fb->primary && fb->connector_name[0])
+		snprintf(buf, size, "%s: %dx%d (%#x)", fb->connector_name,
+			 fb->width, fb->height, fb->fb_id);
+	else
+		snprintf(buf, size, "%dx%d (%#x)", fb->width, fb->height,
+			 fb->fb_id);
+}
+
 static bool dri_device_selected(void *data, obs_properties_t *props, obs_property_t *p, obs_data_t *settings)
 {
 	blog(LOG_DEBUG, "dri_device_selected");
 	dmabuf_source_t *ctx = data;
+	UNUSED_PARAMETER(p);
 
 	obs_property_t *fb_list = obs_properties_get(props, "framebuffer");
 	obs_property_list_clear(fb_list);
 
-	if (!dmabuf_source_receive_framebuffers(obs_data_get_string(settings, "dri_card"), &ctx->fbs))
+	/* All cards are enumerated in one helper invocation when the dialog
+	 * opens, switching between them afterwards needs no round trip.
+	 * The snapshot is private to the dialog: the live capture keeps
+	 * rendering from its own until update() commits the selection.
+	 * Only listing needs it, so fds of framebuffers the dialog may never
+	 * commit to are not kept open. */
+	if (!ctx->ui_resp.num_cards) {
+		char cards[OBS_DRMSEND_MAX_CARDS][32];
+		const char *card_ptrs[OBS_DRMSEND_MAX_CARDS];
+		const int num_cards =
+			dmabuf_fblist_list_cards(cards, OBS_DRMSEND_MAX_CARDS);
+		for (int i = 0; i < num_cards; ++i)
+			card_ptrs[i] = cards[i];
+
+		dmabuf_fblist_t *list =
+			dmabuf_fblist_receive(card_ptrs, num_cards);
+		if (list) {
+			ctx->ui_resp = list->resp;
+			dmabuf_fblist_release(list);
+		}
+	}
+
+	if (!ctx->ui_resp.num_cards)
 	{
 		blog(LOG_ERROR, "Unable to enumerate DRM/KMS framebuffers");
 		set_visible(props, "framebuffer", false);
@@ -495,20 +1570,79 @@ static bool dri_device_selected(void *data, obs_properties_t *props, obs_propert
 	set_visible(props, "framebuffer", true);
 	set_visible(props, "show_cursor", true);
 
-	for (int i = 0; i < ctx->fbs.resp.num_framebuffers; ++i) {
-		const drmsend_framebuffer_t *fb = ctx->fbs.resp.framebuffers + i;
+	const char *card = obs_data_get_string(settings, "dri_card");
+	for (int i = 0; i < ctx->ui_resp.num_framebuffers; ++i) {
+		const drmsend_framebuffer_t *fb = ctx->ui_resp.framebuffers + i;
+		if (strcmp(card, ctx->ui_resp.cards[fb->card_index].path) != 0)
+			continue;
+
 		char buf[128];
-		sprintf(buf, "%dx%d (%#x)", fb->width, fb->height, fb->fb_id);
+		dmabuf_fb_label(buf, sizeof(buf), fb);
 		obs_property_list_add_int(fb_list, buf, fb->fb_id);
 	}
 
 	return true;
 }
 
+/* Picking another framebuffer by hand overrides the remembered connector */
+static bool framebuffer_selected(void *data, obs_properties_t *props,
+				 obs_property_t *p, obs_data_t *settings)
+{
+	dmabuf_source_t *ctx = data;
+	UNUSED_PARAMETER(props);
+	UNUSED_PARAMETER(p);
+
+	const char *card = obs_data_get_string(settings, "dri_card");
+	const uint32_t fb_id = obs_data_get_int(settings, "framebuffer");
+	const int index = dmabuf_topology_find(&ctx->ui_resp, card, NULL, fb_id);
+	if (index >= 0) {
+		const drmsend_framebuffer_t *fb =
+			ctx->ui_resp.framebuffers + index;
+		obs_data_set_string(settings, "connector",
+				    fb->primary ? fb->connector_name : "");
+	}
+
+	return false;
+}
+
+/* Class is remembered too, so that the window can be found again once it
+ * has been reopened */
+static bool window_selected(void *data, obs_properties_t *props,
+			    obs_property_t *p, obs_data_t *settings)
+{
+	dmabuf_source_t *ctx = data;
+	UNUSED_PARAMETER(props);
+	UNUSED_PARAMETER(p);
+
+	const xcb_window_t window = obs_data_get_int(settings, "window");
+	if (!window) {
+		obs_data_set_string(settings, "window_class", "");
+		return false;
+	}
+
+	xcb_xwindow_info_t *windows =
+		bmalloc(sizeof(*windows) * MAX_LISTED_WINDOWS);
+	const int num_windows =
+		xcb_xwindow_list(ctx->xcb, windows, MAX_LISTED_WINDOWS);
+	for (int i = 0; i < num_windows; ++i) {
+		if (windows[i].id == window)
+			obs_data_set_string(settings, "window_class",
+					    windows[i].wm_class);
+	}
+	bfree(windows);
+
+	return false;
+}
 
 static void dmabuf_source_get_defaults(obs_data_t *defaults)
 {
 	obs_data_set_default_bool(defaults, "show_cursor", true);
+	obs_data_set_default_bool(defaults, "release_when_hidden", false);
+	obs_data_set_default_bool(defaults, "snapshot", false);
+	obs_data_set_default_bool(defaults, "transform", true);
+	obs_data_set_default_string(defaults, "connector", "");
+	obs_data_set_default_int(defaults, "window", 0);
+	obs_data_set_default_string(defaults, "window_class", "");
 	obs_data_set_default_string(defaults, "dri_card", "/dev/dri/card0");
 }
 
@@ -517,8 +1651,6 @@ static obs_properties_t *dmabuf_source_get_properties(void *data)
 	dmabuf_source_t *ctx = data;
 	blog(LOG_DEBUG, "dmabuf_source_get_properties %p", ctx);
 
-	dmabuf_source_fblist_t stack_list = {0};
-
 	obs_properties_t *props = obs_properties_create();
 	obs_property_t *dri_device_list;
 
@@ -531,31 +1663,71 @@ static obs_properties_t *dmabuf_source_get_properties(void *data)
 	obs_property_t *fb_list = obs_properties_add_list(
 		props, "framebuffer", "Framebuffer to capture",
 		OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_INT);
+	obs_property_set_modified_callback2(fb_list, framebuffer_selected,
+					    data);
+
+	obs_property_t *window_list = obs_properties_add_list(
+		props, "window", "Crop to window", OBS_COMBO_TYPE_LIST,
+		OBS_COMBO_FORMAT_INT);
+	obs_property_list_add_int(window_list, "Whole framebuffer", 0);
+	xcb_xwindow_info_t *windows =
+		bmalloc(sizeof(*windows) * MAX_LISTED_WINDOWS);
+	const int num_windows =
+		xcb_xwindow_list(ctx->xcb, windows, MAX_LISTED_WINDOWS);
+	for (int i = 0; i < num_windows; ++i) {
+		char buf[256];
+		snprintf(buf, sizeof(buf), "[%s] %s", windows[i].wm_class,
+			 windows[i].name);
+		obs_property_list_add_int(window_list, buf, windows[i].id);
+	}
+	bfree(windows);
+	obs_property_set_modified_callback2(window_list, window_selected,
+					    data);
 
 	obs_properties_add_bool(props, "show_cursor",
 		obs_module_text("CaptureCursor"));
 
-	char path[32];
-	for (int i = 0;; i++) {
-		sprintf(path, "/dev/dri/card%d", i);
-		if (access(path, F_OK) == 0)
-			obs_property_list_add_string(dri_device_list, path, path);
-		else
-			break;
-	}
-
-	if (!ctx->fbs.resp.num_framebuffers) {
-		set_visible(props, "framebuffer", false);
-		set_visible(props, "show_cursor", false);
-		return props;
+	obs_properties_add_bool(props, "release_when_hidden",
+		"Release GPU import while hidden");
+
+	obs_properties_add_bool(props, "transform",
+		"Rotate and scale as the output does");
+
+	obs_properties_add_bool(props, "snapshot",
+		"Copy each new frame (stable, costs a GPU copy per frame)");
+
+	char cards[OBS_DRMSEND_MAX_CARDS][32];
+	const int num_cards = dmabuf_fblist_list_cards(cards, OBS_DRMSEND_MAX_CARDS);
+	for (int i = 0; i < num_cards; i++)
+		obs_property_list_add_string(dri_device_list, cards[i], cards[i]);
+
+	/* Refresh the list of all cards' framebuffers each time the dialog
+	 * is opened */
+	ctx->ui_resp.num_cards = 0;
+
+	/* Until the startup enumeration is done, show what was there last */
+	drmsend_framebuffer_t fb;
+	const dmabuf_capture_t *cap = dmabuf_source_get_capture(ctx);
+	if (cap) {
+		fb = cap->fb;
+	} else {
+		obs_data_t *settings = obs_source_get_settings(ctx->source);
+		const bool known = dmabuf_topology_lookup(
+			obs_data_get_string(settings, "dri_card"),
+			obs_data_get_string(settings, "connector"),
+			obs_data_get_int(settings, "framebuffer"), &fb);
+		obs_data_release(settings);
+
+		if (!known) {
+			set_visible(props, "framebuffer", false);
+			set_visible(props, "show_cursor", false);
+			return props;
+		}
 	}
 
-	for (int i = 0; i < ctx->fbs.resp.num_framebuffers; ++i) {
-		const drmsend_framebuffer_t *fb = ctx->fbs.resp.framebuffers + i;
-		char buf[128];
-		sprintf(buf, "%dx%d (%#x)", fb->width, fb->height, fb->fb_id);
-		obs_property_list_add_int(fb_list, buf, fb->fb_id);
-	}
+	char buf[128];
+	dmabuf_fb_label(buf, sizeof(buf), &fb);
+	obs_property_list_add_int(fb_list, buf, fb.fb_id);
 
 	return props;
 }
@@ -569,17 +1741,17 @@ static const char *dmabuf_source_get_name(void *data)
 static uint32_t dmabuf_source_get_width(void *data)
 {
 	const dmabuf_source_t *ctx = data;
-	if (ctx->active_fb < 0)
-		return 0;
-	return ctx->fbs.resp.framebuffers[ctx->active_fb].width;
+	if (os_atomic_load_bool(&ctx->following))
+		return os_atomic_load_long(&ctx->crop_width);
+	return os_atomic_load_long(&ctx->width);
 }
 
 static uint32_t dmabuf_source_get_height(void *data)
 {
 	const dmabuf_source_t *ctx = data;
-	if (ctx->active_fb < 0)
-		return 0;
-	return ctx->fbs.resp.framebuffers[ctx->active_fb].height;
+	if (os_atomic_load_bool(&ctx->following))
+		return os_atomic_load_long(&ctx->crop_height);
+	return os_atomic_load_long(&ctx->height);
 }
 
 struct obs_source_info dmabuf_input = {
@@ -590,6 +1762,8 @@ struct obs_source_info dmabuf_input = {
 			OBS_SOURCE_DO_NOT_DUPLICATE,
 	.create = dmabuf_source_create,
 	.destroy = dmabuf_source_destroy,
+	.show = dmabuf_source_show,
+	.hide = dmabuf_source_hide,
 	.video_tick = dmabuf_source_video_tick,
 	.video_render = dmabuf_source_render,
 	.get_width = dmabuf_source_get_width,
@@ -614,6 +1788,9 @@ bool obs_module_load(void)
 		return false;
 	}
 
+	dmabuf_topology_init();
+	dump_queue = os_task_queue_create();
+	composite_effect_load();
 	obs_register_source(&dmabuf_input);
 	blog(LOG_INFO, "plugin loaded successfully (version %s)", PLUGIN_VERSION);
 	return true;
@@ -622,5 +1799,10 @@ bool obs_module_load(void)
 void obs_module_unload(void)
 {
 	// TODO deinit things
+	dmabuf_topology_free();
+	if (dump_queue)
+		os_task_queue_destroy(dump_queue);
+	dump_queue = NULL;
+	composite_effect_free();
 	blog(LOG_INFO, "plugin unloaded");
 }
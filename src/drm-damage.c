@@ -0,0 +1,172 @@
+#include "drm-damage.h"
+
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+
+#include <string.h>
+
+static uint32_t drm_damage_find_prop(int fd, drmModeObjectPropertiesPtr props,
+				     const char *name, uint64_t *value)
+{
+	for (uint32_t i = 0; i < props->count_props; ++i) {
+		drmModePropertyPtr prop = drmModeGetProperty(fd, props->props[i]);
+		if (!prop)
+			continue;
+
+		const bool found = strcmp(prop->name, name) == 0;
+		drmModeFreeProperty(prop);
+		if (found) {
+			if (value)
+				*value = props->prop_values[i];
+			return props->props[i];
+		}
+	}
+
+	return 0;
+}
+
+static uint64_t drm_damage_prop_value(drmModeObjectPropertiesPtr props,
+				      uint32_t prop_id)
+{
+	for (uint32_t i = 0; prop_id && i < props->count_props; ++i) {
+		if (props->props[i] == prop_id)
+			return props->prop_values[i];
+	}
+	return 0;
+}
+
+bool drm_damage_init(drm_damage_tracker_t *tracker, int fd, uint32_t crtc_id)
+{
+	memset(tracker, 0, sizeof(*tracker));
+	tracker->crtc_id = crtc_id;
+
+	/* Implies DRM_CLIENT_CAP_UNIVERSAL_PLANES */
+	drmSetClientCap(fd, DRM_CLIENT_CAP_ATOMIC, 1);
+
+	drmModePlaneResPtr planes = drmModeGetPlaneResources(fd);
+	if (!planes)
+		return false;
+
+	for (uint32_t i = 0; !tracker->plane_id && i < planes->count_planes;
+	     ++i) {
+		drmModePlanePtr plane = drmModeGetPlane(fd, planes->planes[i]);
+		if (!plane)
+			continue;
+
+		if (plane->crtc_id == crtc_id) {
+			drmModeObjectPropertiesPtr props =
+				drmModeObjectGetProperties(
+					fd, plane->plane_id,
+					DRM_MODE_OBJECT_PLANE);
+			uint64_t type = 0;
+			if (props && drm_damage_find_prop(fd, props, "type",
+							  &type) &&
+			    type == DRM_PLANE_TYPE_PRIMARY) {
+				tracker->plane_id = plane->plane_id;
+				tracker->fb_id_prop_id = drm_damage_find_prop(
+					fd, props, "FB_ID", NULL);
+				tracker->damage_prop_id = drm_damage_find_prop(
+					fd, props, "FB_DAMAGE_CLIPS", NULL);
+			}
+			drmModeFreeObjectProperties(props);
+		}
+
+		drmModeFreePlane(plane);
+	}
+
+	drmModeFreePlaneResources(planes);
+	return tracker->plane_id != 0;
+}
+
+/* Copies damage clips of blob_id, clipped to DRM_DAMAGE_MAX_RECTS by
+ * merging what doesn't fit into the last one */
+static bool drm_damage_read_blob(int fd, uint32_t blob_id,
+				 drm_damage_t *damage)
+{
+	drmModePropertyBlobPtr blob = drmModeGetPropertyBlob(fd, blob_id);
+	if (!blob)
+		return false;
+
+	const struct drm_mode_rect *clips = blob->data;
+	const int num_clips = blob->length / sizeof(*clips);
+	for (int i = 0; i < num_clips; ++i) {
+		const drm_damage_rect_t r = {clips[i].x1, clips[i].y1,
+					     clips[i].x2, clips[i].y2};
+		if (damage->num_rects < DRM_DAMAGE_MAX_RECTS) {
+			damage->rects[damage->num_rects++] = r;
+			continue;
+		}
+
+		drm_damage_rect_t *last = damage->rects + damage->num_rects - 1;
+		last->x1 = r.x1 < last->x1 ? r.x1 : last->x1;
+		last->y1 = r.y1 < last->y1 ? r.y1 : last->y1;
+		last->x2 = r.x2 > last->x2 ? r.x2 : last->x2;
+		last->y2 = r.y2 > last->y2 ? r.y2 : last->y2;
+	}
+
+	drmModeFreePropertyBlob(blob);
+	return true;
+}
+
+void drm_damage_read(drm_damage_tracker_t *tracker, int fd,
+		     drm_damage_t *damage)
+{
+	memset(damage, 0, sizeof(*damage));
+	damage->changed = true;
+	damage->full = true;
+	damage->flips = tracker->flips;
+
+	if (!tracker->plane_id)
+		return;
+
+	drmModeObjectPropertiesPtr props = drmModeObjectGetProperties(
+		fd, tracker->plane_id, DRM_MODE_OBJECT_PLANE);
+	if (!props)
+		return;
+
+	const uint32_t fb_id =
+		drm_damage_prop_value(props, tracker->fb_id_prop_id);
+	const uint32_t blob_id =
+		drm_damage_prop_value(props, tracker->damage_prop_id);
+	drmModeFreeObjectProperties(props);
+
+	/* Commits land on vblanks, without a sequence any may have been
+	 * missed */
+	uint64_t sequence = 0;
+	const bool has_sequence =
+		drmCrtcGetSequence(fd, tracker->crtc_id, &sequence, NULL) == 0;
+	const bool vblanked = !has_sequence || sequence > tracker->sequence;
+	const bool missed_vblanks =
+		!has_sequence || sequence > tracker->sequence + 1;
+
+	const bool flipped = tracker->fb_id && fb_id != tracker->fb_id;
+	/* Compositors attach a new blob to every commit with damage. A commit
+	 * without damage clips damages the whole plane, so with no blob
+	 * attached the same fb may have been redrawn on any vblank, which is
+	 * full damage. A blob that is still there means there has been no
+	 * commit since. */
+	const bool committed = flipped || blob_id != tracker->damage_blob_id ||
+			       (!blob_id && vblanked);
+	if (flipped)
+		tracker->flips++;
+	if (blob_id)
+		tracker->damage_seen = true;
+
+	/* Compositors that neither flip nor attach damage, e.g. X drawing
+	 * straight into the scanout buffer, can change it at any time */
+	const bool known = tracker->damage_prop_id &&
+			   (tracker->flips || tracker->damage_seen);
+
+	if (known && !committed) {
+		damage->changed = false;
+		damage->full = false;
+	} else if (known && blob_id && !missed_vblanks && tracker->fb_id) {
+		damage->full = !drm_damage_read_blob(fd, blob_id, damage);
+	}
+
+	tracker->fb_id = fb_id;
+	tracker->damage_blob_id = blob_id;
+	if (has_sequence)
+		tracker->sequence = sequence;
+	damage->flips = tracker->flips;
+}
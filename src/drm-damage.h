@@ -0,0 +1,60 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Damage of a plane as reported by the compositor through FB_DAMAGE_CLIPS.
+ * Shared by linux-kmsgrab-send and the plugin, neither of which needs DRM
+ * master to read it. */
+
+#define DRM_DAMAGE_MAX_RECTS 16
+
+typedef struct {
+	int32_t x1, y1, x2, y2;
+} drm_damage_rect_t;
+
+/* What has changed on a plane since the previous read */
+typedef struct {
+	/* Number of times the plane has been seen flipped to another fb */
+	uint32_t flips;
+	/* Content may have changed */
+	bool changed;
+	/* Where is not known, so all of it may have */
+	bool full;
+	int num_rects;
+	drm_damage_rect_t rects[DRM_DAMAGE_MAX_RECTS];
+} drm_damage_t;
+
+/* Plane state kept between reads */
+typedef struct {
+	uint32_t plane_id;
+	uint32_t crtc_id;
+	uint32_t fb_id_prop_id;
+	uint32_t damage_prop_id;
+
+	uint32_t fb_id;
+	uint32_t damage_blob_id;
+	uint64_t sequence;
+	uint32_t flips;
+	/* Compositor has been seen attaching damage */
+	bool damage_seen;
+} drm_damage_tracker_t;
+
+/**
+ * Starts tracking the primary plane of crtc_id. Sets DRM_CLIENT_CAP_ATOMIC
+ * on fd, without which FB_DAMAGE_CLIPS is not visible.
+ *
+ * @return false if there is no such plane; tracker then reports everything
+ * as changed
+ */
+bool drm_damage_init(drm_damage_tracker_t *tracker, int fd, uint32_t crtc_id);
+
+/**
+ * Reads plane state and reports what has changed since the previous call.
+ * Anything that cannot be told for sure, such as a compositor that doesn't
+ * attach damage, a vblank since a commit that kept the fb without damage
+ * clips, or commits that may have been missed in between, is reported as
+ * full damage.
+ */
+void drm_damage_read(drm_damage_tracker_t *tracker, int fd,
+		     drm_damage_t *damage);
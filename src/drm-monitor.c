@@ -0,0 +1,106 @@
+#include "drm-monitor.h"
+
+#include <obs-module.h>
+
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+#include "plugin-macros.generated.h"
+
+bool drm_monitor_open(drm_monitor_t *mon, const char *card, uint32_t crtc_id,
+		      uint32_t connector_id)
+{
+	memset(mon, 0, sizeof(*mon));
+	mon->fd = -1;
+
+	if (!card || !crtc_id)
+		return false;
+
+	mon->fd = open(card, O_RDONLY | O_CLOEXEC);
+	if (mon->fd < 0) {
+		blog(LOG_WARNING, "Cannot open %s for monitoring: %d", card,
+		     errno);
+		return false;
+	}
+
+	mon->crtc_id = crtc_id;
+	mon->connector_id = connector_id;
+	if (!drm_damage_init(&mon->damage, mon->fd, crtc_id))
+		blog(LOG_INFO, "No primary plane for crtc %#x, damage will not be known",
+		     crtc_id);
+	return true;
+}
+
+void drm_monitor_close(drm_monitor_t *mon)
+{
+	if (mon->fd >= 0)
+		close(mon->fd);
+	mon->fd = -1;
+}
+
+static uint32_t find_property(int fd, drmModeObjectPropertiesPtr props,
+			      const char *name)
+{
+	uint32_t prop_id = 0;
+	for (uint32_t i = 0; !prop_id && i < props->count_props; ++i) {
+		drmModePropertyPtr prop = drmModeGetProperty(fd, props->props[i]);
+		if (!prop)
+			continue;
+		if (strcmp(prop->name, name) == 0)
+			prop_id = prop->prop_id;
+		drmModeFreeProperty(prop);
+	}
+	return prop_id;
+}
+
+bool drm_monitor_dpms_off(drm_monitor_t *mon)
+{
+	if (mon->fd < 0 || !mon->connector_id)
+		return false;
+
+	drmModeObjectPropertiesPtr props = drmModeObjectGetProperties(
+		mon->fd, mon->connector_id, DRM_MODE_OBJECT_CONNECTOR);
+	if (!props)
+		return false;
+
+	if (!mon->dpms_prop_id)
+		mon->dpms_prop_id = find_property(mon->fd, props, "DPMS");
+
+	bool off = false;
+	for (uint32_t i = 0; i < props->count_props; ++i) {
+		if (props->props[i] == mon->dpms_prop_id) {
+			off = props->prop_values[i] != DRM_MODE_DPMS_ON;
+			break;
+		}
+	}
+
+	drmModeFreeObjectProperties(props);
+	return off;
+}
+
+bool drm_monitor_last_vblank(drm_monitor_t *mon, uint64_t *timestamp_ns)
+{
+	if (mon->fd < 0 || !mon->crtc_id)
+		return false;
+
+	uint64_t sequence = 0;
+	return 0 == drmCrtcGetSequence(mon->fd, mon->crtc_id, &sequence,
+				       timestamp_ns);
+}
+
+void drm_monitor_read_damage(drm_monitor_t *mon, drm_damage_t *damage)
+{
+	if (mon->fd < 0) {
+		memset(damage, 0, sizeof(*damage));
+		damage->changed = true;
+		damage->full = true;
+		return;
+	}
+
+	drm_damage_read(&mon->damage, mon->fd, damage);
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include "drm-damage.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Unprivileged view of the CRTC/connector a framebuffer is displayed on.
+ * Only queries state, which does not need DRM master or CAP_SYS_ADMIN. */
+typedef struct {
+	int fd;
+	uint32_t crtc_id;
+	uint32_t connector_id;
+	uint32_t dpms_prop_id;
+	drm_damage_tracker_t damage;
+} drm_monitor_t;
+
+/**
+ * Opens card for querying state of crtc_id and connector_id
+ *
+ * @return false if card cannot be opened; monitor is then inert
+ */
+bool drm_monitor_open(drm_monitor_t *mon, const char *card, uint32_t crtc_id,
+		      uint32_t connector_id);
+
+void drm_monitor_close(drm_monitor_t *mon);
+
+/**
+ * @return true only if connector is known to be in DPMS standby/suspend/off
+ */
+bool drm_monitor_dpms_off(drm_monitor_t *mon);
+
+/**
+ * Gets CLOCK_MONOTONIC time of the latest vblank of crtc, i.e. when what is
+ * currently in its framebuffer started being scanned out
+ *
+ * @return false if not known
+ */
+bool drm_monitor_last_vblank(drm_monitor_t *mon, uint64_t *timestamp_ns);
+
+/**
+ * Reads what has changed on crtc's primary plane since the previous call.
+ * Everything is reported as changed if that cannot be told.
+ */
+void drm_monitor_read_damage(drm_monitor_t *mon, drm_damage_t *damage);
@@ -0,0 +1,178 @@
+#define _GNU_SOURCE /* struct ucred, accept4 */
+
+#include "drmsend-client.h"
+#include "helper-spawn.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#define LOG_PREFIX "drmsend-client: "
+
+#define ERR(fmt, ...) fprintf(stderr, LOG_PREFIX fmt "\n", ##__VA_ARGS__)
+
+/* Authentication dialog may be up for a while */
+#define CONNECT_TIMEOUT_MS 60000
+
+bool drmsend_client_follow(drmsend_client_t *client, const char *helper,
+			   bool use_pkexec, const char *card, uint32_t crtc_id)
+{
+	client->pid = -1;
+	client->fd = -1;
+
+	char socket_name[64];
+	snprintf(socket_name, sizeof(socket_name), "%ckmsgrab-client-%d",
+		 OBS_DRMSEND_ABSTRACT_PREFIX, (int)getpid());
+
+	struct sockaddr_un addr = {0};
+	addr.sun_family = AF_UNIX;
+	const size_t socket_name_len = strlen(socket_name);
+	memcpy(addr.sun_path, socket_name, socket_name_len);
+	addr.sun_path[0] = '\0';
+	const socklen_t addrlen =
+		offsetof(struct sockaddr_un, sun_path) + socket_name_len;
+
+	const int sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sockfd < 0 ||
+	    -1 == bind(sockfd, (const struct sockaddr *)&addr, addrlen) ||
+	    -1 == listen(sockfd, 1)) {
+		ERR("Cannot listen on unix socket %s: %s (%d)", socket_name,
+		    strerror(errno), errno);
+		goto cleanup;
+	}
+
+	char crtc_arg[16];
+	snprintf(crtc_arg, sizeof(crtc_arg), "%u", crtc_id);
+
+	const char *argv[7] = {0};
+	{
+		int argc = 0;
+		if (use_pkexec)
+			argv[argc++] = "pkexec";
+		argv[argc++] = helper;
+		argv[argc++] = OBS_DRMSEND_FOLLOW_ARG;
+		argv[argc++] = crtc_arg;
+		argv[argc++] = socket_name;
+		argv[argc++] = card;
+	}
+
+	client->pid = helper_spawn(argv);
+	if (client->pid == -1) {
+		ERR("Cannot spawn %s: %s (%d)", argv[0], strerror(errno),
+		    errno);
+		goto cleanup;
+	}
+
+	while (client->fd < 0) {
+		struct pollfd pfd = {.fd = sockfd, .events = POLLIN};
+		const int ready = poll(&pfd, 1, CONNECT_TIMEOUT_MS);
+		if (ready < 0 && errno == EINTR)
+			continue;
+		if (ready <= 0) {
+			ERR("Waiting for %s timed out", helper);
+			goto cleanup;
+		}
+
+		const int connfd = accept4(sockfd, NULL, NULL, SOCK_CLOEXEC);
+		if (connfd < 0) {
+			ERR("Cannot accept unix socket: %s (%d)",
+			    strerror(errno), errno);
+			goto cleanup;
+		}
+
+		/* Abstract sockets can be connected to by anyone */
+		struct ucred cred;
+		socklen_t cred_len = sizeof(cred);
+		if (-1 == getsockopt(connfd, SOL_SOCKET, SO_PEERCRED, &cred,
+				     &cred_len) ||
+		    cred.pid != client->pid) {
+			ERR("Rejecting connection from unexpected peer");
+			close(connfd);
+			continue;
+		}
+
+		client->fd = connfd;
+	}
+
+cleanup:
+	if (sockfd >= 0)
+		close(sockfd);
+	if (client->fd < 0)
+		drmsend_client_close(client);
+	return client->fd >= 0;
+}
+
+bool drmsend_client_recv_frame(drmsend_client_t *client,
+			       drmsend_frame_t *frame, int *fd)
+{
+	*fd = -1;
+
+	struct msghdr msg = {0};
+	struct iovec io = {
+		.iov_base = frame,
+		.iov_len = sizeof(*frame),
+	};
+	msg.msg_iov = &io;
+	msg.msg_iovlen = 1;
+
+	char cmsg_buf[CMSG_SPACE(sizeof(int))];
+	memset(cmsg_buf, 0, sizeof(cmsg_buf));
+	msg.msg_control = cmsg_buf;
+	msg.msg_controllen = sizeof(cmsg_buf);
+
+	ssize_t recvd;
+	do
+		recvd = recvmsg(client->fd, &msg, MSG_CMSG_CLOEXEC);
+	while (recvd < 0 && errno == EINTR);
+
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg && cmsg->cmsg_level == SOL_SOCKET &&
+	    cmsg->cmsg_type == SCM_RIGHTS &&
+	    cmsg->cmsg_len == CMSG_LEN(sizeof(int)))
+		memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+
+	if (recvd == 0)
+		goto error;
+
+	if (recvd != sizeof(*frame)) {
+		ERR("Cannot receive frame: %d bytes received, errno %d",
+		    (int)recvd, errno);
+		goto error;
+	}
+
+	if (frame->tag != OBS_DRMSEND_FRAME_TAG || frame->slot < 0 ||
+	    frame->slot >= OBS_DRMSEND_FOLLOW_SLOTS ||
+	    !frame->has_fd != (*fd < 0)) {
+		ERR("Received malformed frame: tag %#x, slot %d, fd %d",
+		    frame->tag, frame->slot, *fd);
+		goto error;
+	}
+
+	return true;
+
+error:
+	if (*fd >= 0)
+		close(*fd);
+	*fd = -1;
+	return false;
+}
+
+void drmsend_client_close(drmsend_client_t *client)
+{
+	if (client->fd >= 0)
+		close(client->fd);
+	client->fd = -1;
+
+	/* Helper notices on its next vblank */
+	if (client->pid > 0)
+		waitpid(client->pid, NULL, 0);
+	client->pid = -1;
+}
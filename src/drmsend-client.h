@@ -0,0 +1,33 @@
+#pragma once
+
+#include "drmsend.h"
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+/* Connection to linux-kmsgrab-send for tools that run outside of OBS */
+typedef struct {
+	pid_t pid;
+	int fd;
+} drmsend_client_t;
+
+/**
+ * Runs helper, through pkexec if use_pkexec is set, in follow mode for
+ * crtc_id on card. crtc_id 0 picks the first active one.
+ *
+ * @return false if helper could not be started or did not connect back
+ */
+bool drmsend_client_follow(drmsend_client_t *client, const char *helper,
+			   bool use_pkexec, const char *card, uint32_t crtc_id);
+
+/**
+ * Blocks until the next frame arrives. fd is set to the received dma-buf fd
+ * if frame->has_fd, -1 otherwise.
+ *
+ * @return false if helper is gone or sent something unexpected
+ */
+bool drmsend_client_recv_frame(drmsend_client_t *client,
+			       drmsend_frame_t *frame, int *fd);
+
+/* Disconnects, which makes helper exit, and waits for it */
+void drmsend_client_close(drmsend_client_t *client);
@@ -7,11 +7,15 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <poll.h>
+#include <stddef.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <errno.h>
 
 #define LOG_PREFIX "obs-drmsend: "
@@ -19,139 +23,603 @@
 #define ERR(fmt, ...) fprintf(stderr, LOG_PREFIX fmt "\n", ##__VA_ARGS__)
 #define MSG(fmt, ...) fprintf(stdout, LOG_PREFIX fmt "\n", ##__VA_ARGS__)
 
+static const char *program_name = "linux-kmsgrab-send";
+
 void printUsage(const char *name)
 {
-	MSG("usage: %s /dev/dri/card socket_filename", name);
+	MSG("usage: %s socket_filename /dev/dri/card [/dev/dri/card ...]",
+	    name);
+	MSG("       %s %s crtc_id socket_filename /dev/dri/card", name,
+	    OBS_DRMSEND_FOLLOW_ARG);
 }
 
-int main(int argc, const char *argv[])
+typedef struct {
+	const char *card;
+	int card_index;
+	int num_framebuffers;
+	drmsend_framebuffer_t framebuffers[OBS_DRMSEND_MAX_CARD_FRAMEBUFFERS];
+	int fb_fds[OBS_DRMSEND_MAX_CARD_FRAMEBUFFERS];
+} card_enum_t;
+
+/* Kernel's names, which Wayland compositors use too. X drivers name RandR
+ * outputs their own way. */
+static const char *connectorTypeName(uint32_t type)
 {
-	if (argc < 3) {
-		printUsage(argv[0]);
-		return 1;
+	static const char *const names[] = {
+		"Unknown", "VGA",     "DVI-I", "DVI-D",     "DVI-A",
+		"Composite", "SVIDEO", "LVDS",  "Component", "DIN",
+		"DP",      "HDMI-A",  "HDMI-B", "TV",       "eDP",
+		"Virtual", "DSI",     "DPI",   "Writeback", "SPI",
+		"USB",
+	};
+	return type < sizeof(names) / sizeof(*names) ? names[type] : "Unknown";
+}
+
+/* Fills in where crtc_id is and which connector it drives. Returns id of
+ * the primary plane's framebuffer, 0 if crtc is off. */
+static uint32_t describeCrtc(int drmfd, drmModeResPtr res, uint32_t crtc_id,
+			     drmsend_framebuffer_t *fb)
+{
+	fb->crtc_id = crtc_id;
+
+	uint32_t primary_fb_id = 0;
+	drmModeCrtcPtr crtc = drmModeGetCrtc(drmfd, crtc_id);
+	if (crtc) {
+		primary_fb_id = crtc->buffer_id;
+		fb->crtc_x = crtc->x;
+		fb->crtc_y = crtc->y;
+		fb->crtc_width = crtc->mode_valid ? crtc->mode.hdisplay : 0;
+		fb->crtc_height = crtc->mode_valid ? crtc->mode.vdisplay : 0;
+		drmModeFreeCrtc(crtc);
+	}
+
+	for (int i = 0; res && !fb->connector_id && i < res->count_connectors;
+	     ++i) {
+		/* Current state only: full probe can take ages */
+		drmModeConnectorPtr conn =
+			drmModeGetConnectorCurrent(drmfd, res->connectors[i]);
+		if (!conn)
+			continue;
+
+		if (conn->encoder_id) {
+			drmModeEncoderPtr enc =
+				drmModeGetEncoder(drmfd, conn->encoder_id);
+			if (enc) {
+				if (enc->crtc_id == crtc_id) {
+					fb->connector_id = conn->connector_id;
+					snprintf(fb->connector_name,
+						 sizeof(fb->connector_name),
+						 "%s-%u",
+						 connectorTypeName(
+							 conn->connector_type),
+						 conn->connector_type_id);
+				}
+				drmModeFreeEncoder(enc);
+			}
+		}
+
+		drmModeFreeConnector(conn);
+	}
+
+	return primary_fb_id;
+}
+
+/* Fills in how plane_id shows fb. Rects are only exposed to clients that
+ * have set DRM_CLIENT_CAP_ATOMIC. */
+static void describePlane(int drmfd, uint32_t plane_id,
+			  drmsend_framebuffer_t *fb)
+{
+	drmModeObjectPropertiesPtr props = drmModeObjectGetProperties(
+		drmfd, plane_id, DRM_MODE_OBJECT_PLANE);
+	if (!props)
+		return;
+
+	fb->rotation = DRM_MODE_ROTATE_0;
+	for (uint32_t i = 0; i < props->count_props; ++i) {
+		drmModePropertyPtr prop =
+			drmModeGetProperty(drmfd, props->props[i]);
+		if (!prop)
+			continue;
+
+		/* SRC_* are 16.16 fixed point, CRTC_* are signed */
+		const uint64_t value = props->prop_values[i];
+		if (strcmp(prop->name, "rotation") == 0)
+			fb->rotation = value;
+		else if (strcmp(prop->name, "SRC_X") == 0)
+			fb->src_x = value >> 16;
+		else if (strcmp(prop->name, "SRC_Y") == 0)
+			fb->src_y = value >> 16;
+		else if (strcmp(prop->name, "SRC_W") == 0)
+			fb->src_width = value >> 16;
+		else if (strcmp(prop->name, "SRC_H") == 0)
+			fb->src_height = value >> 16;
+		else if (strcmp(prop->name, "CRTC_X") == 0)
+			fb->dst_x = (int32_t)value;
+		else if (strcmp(prop->name, "CRTC_Y") == 0)
+			fb->dst_y = (int32_t)value;
+		else if (strcmp(prop->name, "CRTC_W") == 0)
+			fb->dst_width = value;
+		else if (strcmp(prop->name, "CRTC_H") == 0)
+			fb->dst_height = value;
+
+		drmModeFreeProperty(prop);
+	}
+
+	drmModeFreeObjectProperties(props);
+}
+
+/* Fills fb with fb_id metadata and returns its dma-buf fd, -1 on error */
+static int exportFramebuffer(int drmfd, uint32_t fb_id,
+			     drmsend_framebuffer_t *fb)
+{
+	uint32_t handles[4] = {0};
+
+	memset(fb, 0, sizeof(*fb));
+	fb->fb_id = fb_id;
+
+	/* GetFB2 knows format and modifier, but needs linux 5.7+ */
+	drmModeFB2Ptr drmfb2 = drmModeGetFB2(drmfd, fb_id);
+	if (drmfb2) {
+		memcpy(handles, drmfb2->handles, sizeof(handles));
+		fb->width = drmfb2->width;
+		fb->height = drmfb2->height;
+		fb->pitch = drmfb2->pitches[0];
+		fb->offset = drmfb2->offsets[0];
+		fb->fourcc = drmfb2->pixel_format;
+		fb->modifier = (drmfb2->flags & DRM_MODE_FB_MODIFIERS)
+				       ? drmfb2->modifier
+				       : DRM_FORMAT_MOD_INVALID;
+		drmModeFreeFB2(drmfb2);
+
+		if (handles[1] && handles[1] != handles[0])
+			ERR("fb %#x has several planes, only the first one is exported",
+			    fb_id);
+	} else {
+		drmModeFBPtr drmfb = drmModeGetFB(drmfd, fb_id);
+		if (!drmfb) {
+			ERR("Cannot get drmModeFBPtr for fb %#x: %s (%d)",
+			    fb_id, strerror(errno), errno);
+			return -1;
+		}
+
+		handles[0] = drmfb->handle;
+		fb->width = drmfb->width;
+		fb->height = drmfb->height;
+		fb->pitch = drmfb->pitch;
+		fb->offset = 0;
+		fb->fourcc = DRM_FORMAT_XRGB8888; // FIXME
+		fb->modifier = DRM_FORMAT_MOD_INVALID;
+		drmModeFreeFB(drmfb);
 	}
 
-	const char *card = argv[1];
-	const char *sockname = argv[2];
+	int fb_fd = -1;
+	if (!handles[0]) {
+		ERR("\t\tFB handle for fb %#x is NULL", fb_id);
+		ERR("\t\tPossible reason: not permitted to get FB handles. Do `sudo setcap cap_sys_admin+ep %s`",
+		    program_name);
+		return -1;
+	}
+
+	const int ret = drmPrimeHandleToFD(drmfd, handles[0], 0, &fb_fd);
+	if (ret != 0 || fb_fd == -1) {
+		ERR("Cannot get fd for fb %#x handle %#x: %s (%d)", fb_id,
+		    handles[0], strerror(errno), errno);
+		fb_fd = -1;
+	}
+
+	/* Each GetFB call makes new GEM handles, which pile up when following */
+	for (int i = 0; i < 4; ++i) {
+		int seen = 0;
+		for (int j = 0; j < i; ++j)
+			seen |= handles[j] == handles[i];
+		if (handles[i] && !seen)
+			drmCloseBufferHandle(drmfd, handles[i]);
+	}
+
+	return fb_fd;
+}
+
+static void *enumerateCard(void *arg)
+{
+	card_enum_t *e = arg;
+	const char *card = e->card;
 
 	MSG("Opening card %s", card);
 	const int drmfd = open(card, O_RDONLY);
 	if (drmfd < 0) {
-		perror("Cannot open card");
-		return 1;
+		ERR("Cannot open card %s: %s (%d)", card, strerror(errno),
+		    errno);
+		return NULL;
 	}
 
 	if (0 != drmSetClientCap(drmfd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1)) {
-		perror("Cannot tell drm to expose all planes; the rest will very likely fail");
+		ERR("Cannot tell drm to expose all planes on %s; the rest will very likely fail",
+		    card);
 	}
 
-	int sockfd = -1;
+	/* For plane rects, does not need master */
+	drmSetClientCap(drmfd, DRM_CLIENT_CAP_ATOMIC, 1);
+
+	drmModeResPtr res = drmModeGetResources(drmfd);
+	if (!res)
+		ERR("Cannot get drm resources on %s: %s (%d)", card,
+		    strerror(errno), errno);
+
+	drmModePlaneResPtr planes = drmModeGetPlaneResources(drmfd);
+	if (!planes) {
+		ERR("Cannot get drm planes on %s: %s (%d)", card,
+		    strerror(errno), errno);
+		goto cleanup;
+	}
+
+	MSG("%s: DRM planes %d:", card, planes->count_planes);
+	for (uint32_t i = 0; i < planes->count_planes; ++i) {
+		drmModePlanePtr plane =
+			drmModeGetPlane(drmfd, planes->planes[i]);
+		if (!plane) {
+			ERR("Cannot get drmModePlanePtr for plane %#x: %s (%d)",
+			    planes->planes[i], strerror(errno), errno);
+			continue;
+		}
+
+		MSG("\t%d: fb_id=%#x crtc_id=%#x", i, plane->fb_id,
+		    plane->crtc_id);
+
+		if (!plane->fb_id)
+			goto plane_continue;
+
+		int j = 0;
+		for (; j < e->num_framebuffers; ++j) {
+			if (e->framebuffers[j].fb_id == plane->fb_id)
+				break;
+		}
+
+		/* One framebuffer scanned out by several planes, such as the
+		 * Xorg screen spanning all monitors, is shown by each its own
+		 * way. None of them is the framebuffer's, so it is reported
+		 * as it is in memory. */
+		if (j < e->num_framebuffers) {
+			drmsend_framebuffer_t *shared = e->framebuffers + j;
+			shared->rotation = 0;
+			shared->src_x = shared->src_y = 0;
+			shared->src_width = shared->src_height = 0;
+			shared->dst_x = shared->dst_y = 0;
+			shared->dst_width = shared->dst_height = 0;
+			goto plane_continue;
+		}
+
+		if (j == OBS_DRMSEND_MAX_CARD_FRAMEBUFFERS) {
+			ERR("%s: too many framebuffers, max %d per card", card,
+			    OBS_DRMSEND_MAX_CARD_FRAMEBUFFERS);
+			goto plane_continue;
+		}
+
+		drmsend_framebuffer_t *fb =
+			e->framebuffers + e->num_framebuffers;
+		const int fb_fd = exportFramebuffer(drmfd, plane->fb_id, fb);
+		if (fb_fd >= 0) {
+			e->fb_fds[e->num_framebuffers++] = fb_fd;
+			fb->card_index = e->card_index;
+			describePlane(drmfd, plane->plane_id, fb);
+			if (plane->crtc_id)
+				fb->primary = plane->fb_id ==
+					      describeCrtc(drmfd, res,
+							   plane->crtc_id, fb);
+		}
+
+	plane_continue:
+		drmModeFreePlane(plane);
+	}
+
+	drmModeFreePlaneResources(planes);
+
+cleanup:
+	if (res)
+		drmModeFreeResources(res);
+	close(drmfd);
+	return NULL;
+}
+
+/* Binds sockaddr to either a filesystem path or, if name starts with '@',
+ * to an abstract socket name. Returns address length or 0 on error. */
+static socklen_t makeSocketAddr(struct sockaddr_un *addr, const char *name)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+
+	const size_t len = strlen(name);
+	if (len >= sizeof(addr->sun_path)) {
+		ERR("Socket filename '%s' is too long, max %d", name,
+		    (int)sizeof(addr->sun_path));
+		return 0;
+	}
+
+	memcpy(addr->sun_path, name, len);
+	if (name[0] != OBS_DRMSEND_ABSTRACT_PREFIX)
+		return sizeof(*addr);
+
+	addr->sun_path[0] = '\0';
+	return offsetof(struct sockaddr_un, sun_path) + len;
+}
+
+static int connectSocket(const char *sockname)
+{
+	struct sockaddr_un addr;
+	const socklen_t addrlen = makeSocketAddr(&addr, sockname);
+	if (!addrlen)
+		return -1;
+
+	const int sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (-1 == connect(sockfd, (const struct sockaddr *)&addr, addrlen)) {
+		MSG("Cannot connect to unix socket: %d", errno);
+		close(sockfd);
+		return -1;
+	}
+
+	return sockfd;
+}
+
+static drmVBlankSeqType vblankPipeBits(int pipe)
+{
+	if (pipe == 0)
+		return 0;
+	if (pipe == 1)
+		return DRM_VBLANK_SECONDARY;
+	return (pipe << DRM_VBLANK_HIGH_CRTC_SHIFT) &
+	       DRM_VBLANK_HIGH_CRTC_MASK;
+}
+
+/* Sleeps until the next vblank of pipe, or for a while if there are no
+ * vblanks to wait for */
+static void waitVBlank(int drmfd, int pipe, drmsend_frame_t *frame)
+{
+	drmVBlank vbl = {0};
+	vbl.request.type = DRM_VBLANK_RELATIVE | vblankPipeBits(pipe);
+	vbl.request.sequence = 1;
+	if (0 == drmWaitVBlank(drmfd, &vbl)) {
+		frame->sequence = vbl.reply.sequence;
+		frame->timestamp_ns = vbl.reply.tval_sec * 1000000000ll +
+				      vbl.reply.tval_usec * 1000ll;
+		return;
+	}
+
+	/* CRTC is off: poll at about 60Hz */
+	usleep(16666);
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	frame->sequence++;
+	frame->timestamp_ns = ts.tv_sec * 1000000000ll + ts.tv_nsec;
+}
+
+static int sendFrame(int sockfd, const drmsend_frame_t *frame, int fb_fd)
+{
+	struct msghdr msg = {0};
+
+	struct iovec io = {
+		.iov_base = (void *)frame,
+		.iov_len = sizeof(*frame),
+	};
+	msg.msg_iov = &io;
+	msg.msg_iovlen = 1;
+
+	char cmsg_buf[CMSG_SPACE(sizeof(int))];
+	if (fb_fd >= 0) {
+		msg.msg_control = cmsg_buf;
+		msg.msg_controllen = sizeof(cmsg_buf);
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &fb_fd, sizeof(int));
+	}
+
+	return sendmsg(sockfd, &msg, MSG_NOSIGNAL) == sizeof(*frame);
+}
+
+/* Streams every new framebuffer displayed on crtc_id until the other end
+ * goes away */
+static int followCrtc(const char *sockname, const char *card, uint32_t crtc_id)
+{
 	int retval = 2;
-	drmsend_response_t response = {0};
-	int fb_fds[OBS_DRMSEND_MAX_FRAMEBUFFERS] = {-1};
+	int sockfd = -1;
+
+	MSG("Opening card %s", card);
+	const int drmfd = open(card, O_RDONLY);
+	if (drmfd < 0) {
+		ERR("Cannot open card %s: %s (%d)", card, strerror(errno),
+		    errno);
+		return retval;
+	}
 
-	{
-		drmModePlaneResPtr planes = drmModeGetPlaneResources(drmfd);
-		if (!planes) {
-			ERR("Cannot get drm planes: %s (%d)", strerror(errno),
-			    errno);
-			goto cleanup;
+	if (0 != drmSetClientCap(drmfd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1)) {
+		ERR("Cannot tell drm to expose all planes on %s; the rest will very likely fail",
+		    card);
+	}
+
+	drmModeResPtr res = drmModeGetResources(drmfd);
+	if (!res) {
+		ERR("Cannot get drm resources on %s: %s (%d)", card,
+		    strerror(errno), errno);
+		goto cleanup;
+	}
+
+	/* vblanks are waited for by crtc index */
+	int pipe = -1;
+	for (int i = 0; pipe < 0 && i < res->count_crtcs; ++i) {
+		drmModeCrtcPtr crtc = drmModeGetCrtc(drmfd, res->crtcs[i]);
+		if (!crtc)
+			continue;
+		if (crtc_id ? crtc->crtc_id == crtc_id : crtc->buffer_id != 0) {
+			pipe = i;
+			crtc_id = crtc->crtc_id;
 		}
+		drmModeFreeCrtc(crtc);
+	}
+
+	if (pipe < 0) {
+		ERR("No crtc %#x on %s", crtc_id, card);
+		goto cleanup;
+	}
+
+	drmsend_framebuffer_t output = {0};
+	describeCrtc(drmfd, res, crtc_id, &output);
+
+	drm_damage_tracker_t damage;
+	if (!drm_damage_init(&damage, drmfd, crtc_id))
+		ERR("No primary plane for crtc %#x, damage will not be known",
+		    crtc_id);
+	MSG("Following crtc %#x (pipe %d, connector %s) on %s", crtc_id, pipe,
+	    output.connector_name, card);
+
+	sockfd = connectSocket(sockname);
+	if (sockfd < 0)
+		goto cleanup;
+
+	drmsend_framebuffer_t slots[OBS_DRMSEND_FOLLOW_SLOTS] = {0};
+	int next_slot = 0;
+	uint32_t last_fb_id = 0;
+	drmsend_frame_t frame = {0};
+	frame.tag = OBS_DRMSEND_FRAME_TAG;
+
+	for (;;) {
+		/* Nothing is ever sent back, so readable means closed */
+		struct pollfd pfd = {.fd = sockfd, .events = POLLIN};
+		if (poll(&pfd, 1, 0) != 0)
+			break;
+
+		waitVBlank(drmfd, pipe, &frame);
+
+		drmModeCrtcPtr crtc = drmModeGetCrtc(drmfd, crtc_id);
+		const uint32_t fb_id = crtc ? crtc->buffer_id : 0;
+		if (crtc)
+			drmModeFreeCrtc(crtc);
 
-		MSG("DRM planes %d:", planes->count_planes);
-		for (uint32_t i = 0; i < planes->count_planes; ++i) {
-			drmModePlanePtr plane =
-				drmModeGetPlane(drmfd, planes->planes[i]);
-			if (!plane) {
-				ERR("Cannot get drmModePlanePtr for plane %#x: %s (%d)",
-				    planes->planes[i], strerror(errno), errno);
+		drm_damage_read(&damage, drmfd, &frame.damage);
+		if (!fb_id || (fb_id == last_fb_id && !frame.damage.changed))
+			continue;
+		last_fb_id = fb_id;
+
+		int slot = 0;
+		while (slot < OBS_DRMSEND_FOLLOW_SLOTS &&
+		       slots[slot].fb_id != fb_id)
+			++slot;
+
+		int fb_fd = -1;
+		if (slot == OBS_DRMSEND_FOLLOW_SLOTS) {
+			slot = next_slot;
+			fb_fd = exportFramebuffer(drmfd, fb_id, slots + slot);
+			if (fb_fd < 0) {
+				slots[slot].fb_id = 0;
 				continue;
 			}
+			slots[slot].crtc_id = crtc_id;
+			slots[slot].connector_id = output.connector_id;
+			memcpy(slots[slot].connector_name, output.connector_name,
+			       sizeof(output.connector_name));
+			slots[slot].crtc_x = output.crtc_x;
+			slots[slot].crtc_y = output.crtc_y;
+			slots[slot].crtc_width = output.crtc_width;
+			slots[slot].crtc_height = output.crtc_height;
+			slots[slot].primary = 1;
+			/* Compositors allocate new framebuffers to rotate, so
+			 * this is only read for new ones */
+			if (damage.plane_id)
+				describePlane(drmfd, damage.plane_id,
+					      slots + slot);
+			next_slot = (next_slot + 1) % OBS_DRMSEND_FOLLOW_SLOTS;
+		}
 
-			MSG("\t%d: fb_id=%#x", i, plane->fb_id);
+		frame.slot = slot;
+		frame.has_fd = fb_fd >= 0;
+		frame.fb = slots[slot];
 
-			if (!plane->fb_id)
-				goto plane_continue;
+		const int sent = sendFrame(sockfd, &frame, fb_fd);
+		if (fb_fd >= 0)
+			close(fb_fd);
+		if (!sent)
+			break;
+	}
 
-			int j = 0;
-			for (; j < response.num_framebuffers; ++j) {
-				if (response.framebuffers[j].fb_id ==
-				    plane->fb_id)
-					break;
-			}
+	MSG("Receiver is gone, exiting");
+	retval = 0;
 
-			if (j < response.num_framebuffers)
-				goto plane_continue;
+cleanup:
+	if (sockfd >= 0)
+		close(sockfd);
+	if (res)
+		drmModeFreeResources(res);
+	close(drmfd);
+	return retval;
+}
 
-			if (j == OBS_DRMSEND_MAX_FRAMEBUFFERS) {
-				ERR("Too many framebuffers, max %d",
-				    OBS_DRMSEND_MAX_FRAMEBUFFERS);
-				goto plane_continue;
-			}
+int main(int argc, const char *argv[])
+{
+	if (argc == 5 && strcmp(argv[1], OBS_DRMSEND_FOLLOW_ARG) == 0) {
+		program_name = argv[0];
+		return followCrtc(argv[3], argv[4],
+				  strtoul(argv[2], NULL, 0));
+	}
 
-			drmModeFBPtr drmfb = drmModeGetFB(drmfd, plane->fb_id);
-			if (!drmfb) {
-				ERR("Cannot get drmModeFBPtr for fb %#x: %s (%d)",
-				    plane->fb_id, strerror(errno), errno);
-			} else {
-				if (!drmfb->handle) {
-					ERR("\t\tFB handle for fb %#x is NULL",
-					    plane->fb_id);
-					ERR("\t\tPossible reason: not permitted to get FB handles. Do `sudo setcap cap_sys_admin+ep %s`",
-					    argv[0]);
-				} else {
-					int fb_fd = -1;
-					const int ret = drmPrimeHandleToFD(
-						drmfd, drmfb->handle, 0,
-						&fb_fd);
-					if (ret != 0 || fb_fd == -1) {
-						ERR("Cannot get fd for fb %#x handle %#x: %s (%d)",
-						    plane->fb_id, drmfb->handle,
-						    strerror(errno), errno);
-					} else {
-						const int fb_index =
-							response.num_framebuffers++;
-						drmsend_framebuffer_t *fb =
-							response.framebuffers +
-							fb_index;
-						fb_fds[fb_index] = fb_fd;
-						fb->fb_id = plane->fb_id;
-						fb->width = drmfb->width;
-						fb->height = drmfb->height;
-						fb->pitch = drmfb->pitch;
-						fb->offset = 0;
-						fb->fourcc =
-							DRM_FORMAT_XRGB8888; // FIXME
-					}
-				}
-				drmModeFreeFB(drmfb);
-			}
+	if (argc < 3) {
+		printUsage(argv[0]);
+		return 1;
+	}
 
-		plane_continue:
-			drmModeFreePlane(plane);
-		}
+	program_name = argv[0];
+	const char *sockname = argv[1];
+	const int num_cards = argc - 2;
 
-		drmModeFreePlaneResources(planes);
+	if (num_cards > OBS_DRMSEND_MAX_CARDS) {
+		ERR("Too many cards, max %d", OBS_DRMSEND_MAX_CARDS);
+		return 1;
 	}
 
-	sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
-	{
-		struct sockaddr_un addr;
-		addr.sun_family = AF_UNIX;
-		if (strlen(sockname) >= sizeof(addr.sun_path)) {
-			MSG("Socket filename '%s' is too long, max %d",
-			    sockname, (int)sizeof(addr.sun_path));
-			goto cleanup;
-		}
+	int sockfd = -1;
+	int retval = 2;
+	drmsend_response_t response = {0};
+	int fb_fds[OBS_DRMSEND_MAX_FRAMEBUFFERS] = {-1};
+
+	/* Enumerate all cards concurrently: each of them can spend a while
+	 * waking up the device and walking its planes */
+	card_enum_t cards[OBS_DRMSEND_MAX_CARDS] = {0};
+	pthread_t threads[OBS_DRMSEND_MAX_CARDS];
+	int started[OBS_DRMSEND_MAX_CARDS] = {0};
+	for (int i = 0; i < num_cards; ++i) {
+		cards[i].card = argv[2 + i];
+		cards[i].card_index = i;
+		started[i] = 0 == pthread_create(threads + i, NULL,
+						 enumerateCard, cards + i);
+		if (!started[i])
+			enumerateCard(cards + i);
+	}
 
-		strcpy(addr.sun_path, sockname);
-		if (-1 == connect(sockfd, (const struct sockaddr *)&addr,
-				  sizeof(addr))) {
-			MSG("Cannot connect to unix socket: %d", errno);
-			goto cleanup;
+	for (int i = 0; i < num_cards; ++i) {
+		if (started[i])
+			pthread_join(threads[i], NULL);
+
+		drmsend_card_t *card = response.cards + response.num_cards++;
+		snprintf(card->path, sizeof(card->path), "%s", cards[i].card);
+
+		for (int j = 0; j < cards[i].num_framebuffers; ++j) {
+			if (response.num_framebuffers ==
+			    OBS_DRMSEND_MAX_FRAMEBUFFERS) {
+				ERR("Too many framebuffers, max %d",
+				    OBS_DRMSEND_MAX_FRAMEBUFFERS);
+				close(cards[i].fb_fds[j]);
+				continue;
+			}
+
+			const int fb_index = response.num_framebuffers++;
+			response.framebuffers[fb_index] =
+				cards[i].framebuffers[j];
+			fb_fds[fb_index] = cards[i].fb_fds[j];
 		}
 	}
 
+	sockfd = connectSocket(sockname);
+	if (sockfd < 0)
+		goto cleanup;
+
 	response.tag = OBS_DRMSEND_TAG;
 
 	struct msghdr msg = {0};
@@ -186,6 +654,7 @@ int main(int argc, const char *argv[])
 cleanup:
 	if (sockfd >= 0)
 		close(sockfd);
-	close(drmfd);
+	for (int i = 0; i < response.num_framebuffers; ++i)
+		close(fb_fds[i]);
 	return retval;
 }
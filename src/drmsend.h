@@ -1,22 +1,78 @@
 #pragma once
 
+#include "drm-damage.h"
+
 #include <stdint.h>
 
 /* This defines an interface between obs-drmsend and obs. */
 
-#define OBS_DRMSEND_MAX_FRAMEBUFFERS 16
-#define OBS_DRMSEND_TAG 0x0b500001u
+#define OBS_DRMSEND_MAX_CARDS 4
+/* Each card has its own budget, so that one with many planes cannot crowd
+ * out the others */
+#define OBS_DRMSEND_MAX_CARD_FRAMEBUFFERS 16
+#define OBS_DRMSEND_MAX_FRAMEBUFFERS \
+	(OBS_DRMSEND_MAX_CARDS * OBS_DRMSEND_MAX_CARD_FRAMEBUFFERS)
+#define OBS_DRMSEND_TAG 0x0b500007u
+
+/* Socket names starting with this character are in the abstract namespace */
+#define OBS_DRMSEND_ABSTRACT_PREFIX '@'
 
 typedef struct {
 	uint32_t fb_id;
+	int card_index;
 	int width, height;
 	uint32_t fourcc;
 	int offset, pitch;
+	/* DRM_FORMAT_MOD_INVALID if not known */
+	uint64_t modifier;
+	/* Where it is displayed, 0 if not known */
+	uint32_t crtc_id, connector_id;
+	/* Output it is displayed on, e.g. "DP-1", and its position and mode
+	 * size; primary is set if it is the CRTC's primary plane */
+	char connector_name[32];
+	int crtc_x, crtc_y, crtc_width, crtc_height;
+	int primary;
+	/* How its plane puts it on the CRTC: DRM_MODE_ROTATE_* and
+	 * DRM_MODE_REFLECT_* bits, 0 if not known, and the part of it that is
+	 * shown and where, in whole pixels. Rects are 0 if not known. */
+	uint32_t rotation;
+	int src_x, src_y, src_width, src_height;
+	int dst_x, dst_y, dst_width, dst_height;
 	/* fds are delivered OOB using control msg */
 } drmsend_framebuffer_t;
 
+typedef struct {
+	char path[32];
+} drmsend_card_t;
+
 typedef struct {
 	unsigned tag;
+	int num_cards;
+	drmsend_card_t cards[OBS_DRMSEND_MAX_CARDS];
 	int num_framebuffers;
 	drmsend_framebuffer_t framebuffers[OBS_DRMSEND_MAX_FRAMEBUFFERS];
 } drmsend_response_t;
+
+/* Given as the first arguments, "--follow crtc_id", makes the helper stay
+ * connected and send a drmsend_frame_t every time a new framebuffer is
+ * displayed, or the displayed one is damaged, on a single card's crtc_id (0
+ * picks the first active one), until the other end closes the socket. */
+#define OBS_DRMSEND_FOLLOW_ARG "--follow"
+#define OBS_DRMSEND_FRAME_TAG 0x0b5f0003u
+
+/* Framebuffers sent in follow mode are kept in this many slots. The fd is
+ * attached only when a framebuffer is put in a slot, replacing whatever was
+ * there before; later frames refer to it by slot. */
+#define OBS_DRMSEND_FOLLOW_SLOTS 8
+
+typedef struct {
+	unsigned tag;
+	int slot;
+	int has_fd;
+	/* vblank counter and CLOCK_MONOTONIC time of the flip */
+	uint32_t sequence;
+	int64_t timestamp_ns;
+	drmsend_framebuffer_t fb;
+	/* What has changed since the previous frame, in fb coordinates */
+	drm_damage_t damage;
+} drmsend_frame_t;
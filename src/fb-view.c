@@ -0,0 +1,188 @@
+#include "fb-view.h"
+
+#include <libdrm/drm_mode.h>
+
+#include <math.h>
+
+static bool fb_view_swaps_axes(uint32_t rotation)
+{
+	return rotation & (DRM_MODE_ROTATE_90 | DRM_MODE_ROTATE_270);
+}
+
+/* Normalized view coordinates to normalized coordinates within the shown
+ * part of the framebuffer. Rotation is counter-clockwise and applied after
+ * reflection, as in KMS, so it is undone first. */
+static void fb_view_to_fb(uint32_t rotation, float vx, float vy, float *fx,
+			  float *fy)
+{
+	float x, y;
+	switch (rotation & DRM_MODE_ROTATE_MASK) {
+	case DRM_MODE_ROTATE_90:
+		x = 1.f - vy;
+		y = vx;
+		break;
+	case DRM_MODE_ROTATE_180:
+		x = 1.f - vx;
+		y = 1.f - vy;
+		break;
+	case DRM_MODE_ROTATE_270:
+		x = vy;
+		y = 1.f - vx;
+		break;
+	default:
+		x = vx;
+		y = vy;
+		break;
+	}
+
+	*fx = rotation & DRM_MODE_REFLECT_X ? 1.f - x : x;
+	*fy = rotation & DRM_MODE_REFLECT_Y ? 1.f - y : y;
+}
+
+/* Inverse of the above */
+static void fb_view_from_fb(uint32_t rotation, float fx, float fy, float *vx,
+			    float *vy)
+{
+	const float x = rotation & DRM_MODE_REFLECT_X ? 1.f - fx : fx;
+	const float y = rotation & DRM_MODE_REFLECT_Y ? 1.f - fy : fy;
+
+	switch (rotation & DRM_MODE_ROTATE_MASK) {
+	case DRM_MODE_ROTATE_90:
+		*vx = y;
+		*vy = 1.f - x;
+		break;
+	case DRM_MODE_ROTATE_180:
+		*vx = 1.f - x;
+		*vy = 1.f - y;
+		break;
+	case DRM_MODE_ROTATE_270:
+		*vx = 1.f - y;
+		*vy = x;
+		break;
+	default:
+		*vx = x;
+		*vy = y;
+		break;
+	}
+}
+
+void fb_view_init(fb_view_t *view, const drmsend_framebuffer_t *fb,
+		  bool transform)
+{
+	view->x = view->y = 0;
+	view->width = fb->width;
+	view->height = fb->height;
+	view->rotation = DRM_MODE_ROTATE_0;
+
+	/* Planes can only scan out of the framebuffer */
+	if (transform && fb->src_width > 0 && fb->src_height > 0 &&
+	    fb->src_x >= 0 && fb->src_y >= 0 &&
+	    fb->src_x + fb->src_width <= fb->width &&
+	    fb->src_y + fb->src_height <= fb->height) {
+		view->x = fb->src_x;
+		view->y = fb->src_y;
+		view->width = fb->src_width;
+		view->height = fb->src_height;
+	}
+
+	if (transform && fb->rotation)
+		view->rotation = fb->rotation;
+
+	const bool swap = fb_view_swaps_axes(view->rotation);
+	view->out_width = swap ? view->height : view->width;
+	view->out_height = swap ? view->width : view->height;
+	if (transform && fb->dst_width > 0 && fb->dst_height > 0) {
+		view->out_width = fb->dst_width;
+		view->out_height = fb->dst_height;
+	}
+}
+
+void fb_view_crop(fb_view_t *view, int x0, int y0, int x1, int y1)
+{
+	x0 = x0 > view->x ? x0 : view->x;
+	y0 = y0 > view->y ? y0 : view->y;
+	x1 = x1 < view->x + view->width ? x1 : view->x + view->width;
+	y1 = y1 < view->y + view->height ? y1 : view->y + view->height;
+	if (x1 <= x0 || y1 <= y0) {
+		view->width = view->height = 0;
+		view->out_width = view->out_height = 0;
+		return;
+	}
+
+	const bool swap = fb_view_swaps_axes(view->rotation);
+	const float scale_w = (float)view->out_width /
+			      (swap ? view->height : view->width);
+	const float scale_h = (float)view->out_height /
+			      (swap ? view->width : view->height);
+
+	view->x = x0;
+	view->y = y0;
+	view->width = x1 - x0;
+	view->height = y1 - y0;
+	view->out_width =
+		lroundf((swap ? view->height : view->width) * scale_w);
+	view->out_height =
+		lroundf((swap ? view->width : view->height) * scale_h);
+}
+
+void fb_view_uv(const fb_view_t *view, const drmsend_framebuffer_t *fb,
+		float offset[2], float u[2], float v[2])
+{
+	/* The mapping is affine, so three corners are enough */
+	float corners[3][2];
+	fb_view_to_fb(view->rotation, 0.f, 0.f, &corners[0][0],
+		      &corners[0][1]);
+	fb_view_to_fb(view->rotation, 1.f, 0.f, &corners[1][0],
+		      &corners[1][1]);
+	fb_view_to_fb(view->rotation, 0.f, 1.f, &corners[2][0],
+		      &corners[2][1]);
+
+	for (int i = 0; i < 3; ++i) {
+		corners[i][0] = (view->x + corners[i][0] * view->width) /
+				fb->width;
+		corners[i][1] = (view->y + corners[i][1] * view->height) /
+				fb->height;
+	}
+
+	for (int i = 0; i < 2; ++i) {
+		offset[i] = corners[0][i];
+		u[i] = corners[1][i] - corners[0][i];
+		v[i] = corners[2][i] - corners[0][i];
+	}
+}
+
+void fb_view_map_damage(const fb_view_t *view, drm_damage_t *damage)
+{
+	const int x0 = view->x, y0 = view->y;
+	const int x1 = x0 + view->width, y1 = y0 + view->height;
+
+	int num_rects = 0;
+	for (int i = 0; i < damage->num_rects; ++i) {
+		const drm_damage_rect_t *r = damage->rects + i;
+		const int cx1 = r->x1 > x0 ? r->x1 : x0;
+		const int cy1 = r->y1 > y0 ? r->y1 : y0;
+		const int cx2 = r->x2 < x1 ? r->x2 : x1;
+		const int cy2 = r->y2 < y1 ? r->y2 : y1;
+		if (cx1 >= cx2 || cy1 >= cy2)
+			continue;
+
+		float ax, ay, bx, by;
+		fb_view_from_fb(view->rotation, (float)(cx1 - x0) / view->width,
+				(float)(cy1 - y0) / view->height, &ax, &ay);
+		fb_view_from_fb(view->rotation, (float)(cx2 - x0) / view->width,
+				(float)(cy2 - y0) / view->height, &bx, &by);
+
+		/* Round outwards, so that scaling never loses damage */
+		drm_damage_rect_t *out = damage->rects + num_rects++;
+		out->x1 = floorf(fminf(ax, bx) * view->out_width);
+		out->y1 = floorf(fminf(ay, by) * view->out_height);
+		out->x2 = ceilf(fmaxf(ax, bx) * view->out_width);
+		out->y2 = ceilf(fmaxf(ay, by) * view->out_height);
+	}
+	damage->num_rects = num_rects;
+
+	if (!view->width || !view->height)
+		damage->changed = damage->full = false;
+	else if (!damage->full && !num_rects)
+		damage->changed = false;
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include "drmsend.h"
+
+#include <stdbool.h>
+
+/* Part of a framebuffer that a source shows, and how: rotated, reflected and
+ * scaled the way its plane puts it on the CRTC. Crop rectangles, damage and
+ * the cursor are in framebuffer pixels, which is what X screen coordinates
+ * map to. */
+typedef struct {
+	/* Shown part, in framebuffer pixels */
+	int x, y, width, height;
+	/* DRM_MODE_ROTATE_* | DRM_MODE_REFLECT_* applied to it */
+	uint32_t rotation;
+	/* Size it is shown at */
+	int out_width, out_height;
+} fb_view_t;
+
+/**
+ * Shows what the plane scans out of fb if transform is set, all of fb as it
+ * is in memory otherwise
+ */
+void fb_view_init(fb_view_t *view, const drmsend_framebuffer_t *fb,
+		  bool transform);
+
+/* Narrows view down to x0..x1, y0..y1, keeping its scale */
+void fb_view_crop(fb_view_t *view, int x0, int y0, int x1, int y1);
+
+/**
+ * Where the top left corner of the view is in fb uv, and how far fb uv moves
+ * for a unit step of view uv along u and v
+ */
+void fb_view_uv(const fb_view_t *view, const drmsend_framebuffer_t *fb,
+		float offset[2], float u[2], float v[2]);
+
+/* Moves damage from framebuffer to view pixels, dropping what is not shown */
+void fb_view_map_damage(const fb_view_t *view, drm_damage_t *damage);
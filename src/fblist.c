@@ -0,0 +1,389 @@
+#define _GNU_SOURCE /* struct ucred */
+
+#include "fblist.h"
+#include "helper-spawn.h"
+
+#include <obs-module.h>
+#include <util/platform.h>
+#include <util/threading.h>
+
+#include <sys/wait.h>
+#include <stdio.h>
+
+#include "plugin-macros.generated.h"
+
+// FIXME stringify errno
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+
+static const char send_binary_name[] = "linux-kmsgrab-send";
+static const size_t send_binary_len = sizeof(send_binary_name) - 1;
+
+/* How long to wait for the helper to exit, and the longest sleep between
+ * checks */
+#define DRMSEND_EXIT_TIMEOUT_US 5000000
+#define DRMSEND_EXIT_MAX_DELAY_US 100000
+
+/* Makes socket names unique across concurrent requests of this process */
+static volatile long socket_request_counter = 0;
+
+const char *dmabuf_fblist_card(const dmabuf_fblist_t *list,
+			       const drmsend_framebuffer_t *fb)
+{
+	if (fb->card_index < 0 || fb->card_index >= list->resp.num_cards)
+		return "";
+	return list->resp.cards[fb->card_index].path;
+}
+
+int dmabuf_fblist_find(const dmabuf_fblist_t *list, const char *card,
+		       uint32_t fb_id)
+{
+	for (int i = 0; i < list->resp.num_framebuffers; ++i) {
+		const drmsend_framebuffer_t *fb = list->resp.framebuffers + i;
+		if (fb_id == fb->fb_id &&
+		    strcmp(card, dmabuf_fblist_card(list, fb)) == 0)
+			return i;
+	}
+
+	return -1;
+}
+
+int dmabuf_fblist_list_cards(char cards[][32], int max_cards)
+{
+	int num_cards = 0;
+	for (int i = 0; num_cards < max_cards; i++) {
+		char *path = cards[num_cards];
+		snprintf(path, 32, "/dev/dri/card%d", i);
+		if (access(path, F_OK) != 0)
+			break;
+		++num_cards;
+	}
+	return num_cards;
+}
+
+static int dmabuf_fblist_receive_into(const char *const *dri_filenames, int num_cards, dmabuf_fblist_t *list)
+{
+	blog(LOG_DEBUG, "dmabuf_fblist_receive");
+
+	int retval = 0;
+	int sockfd = -1;
+
+	if (num_cards < 1 || num_cards > OBS_DRMSEND_MAX_CARDS) {
+		blog(LOG_ERROR, "Cannot enumerate %d cards, max %d", num_cards,
+		     OBS_DRMSEND_MAX_CARDS);
+		return 0;
+	}
+
+	/* Get unique abstract socket name, so that concurrent requests from
+	 * different sources don't clobber each other */
+	char socket_name[64];
+	snprintf(socket_name, sizeof(socket_name), "%cobs-kmsgrab-send-%d-%ld",
+		 OBS_DRMSEND_ABSTRACT_PREFIX, (int)getpid(),
+		 os_atomic_inc_long(&socket_request_counter));
+
+	struct sockaddr_un addr = {0};
+	addr.sun_family = AF_UNIX;
+	const size_t socket_name_len = strlen(socket_name);
+	memcpy(addr.sun_path, socket_name, socket_name_len);
+	addr.sun_path[0] = '\0';
+	const socklen_t addrlen =
+		offsetof(struct sockaddr_un, sun_path) + socket_name_len;
+
+	blog(LOG_DEBUG, "Will bind socket to %s", socket_name);
+
+	/* Find linux-kmsgrab-send */
+	char *drmsend_filename = NULL;
+	{
+		const char* plugin_path = obs_get_module_binary_path(obs_current_module());
+		const char* plugin_path_last_sep = strrchr(plugin_path, '/');
+		if (!plugin_path_last_sep)
+			plugin_path_last_sep = plugin_path;
+		else
+			plugin_path_last_sep += 1;
+
+		const ssize_t prefix_len = plugin_path_last_sep - plugin_path;
+		const ssize_t full_len = prefix_len;
+		const ssize_t drmsend_filename_len = full_len + send_binary_len + 1;
+		drmsend_filename = malloc(drmsend_filename_len);
+		memcpy(drmsend_filename, plugin_path, prefix_len);
+		memcpy(drmsend_filename + prefix_len, send_binary_name, send_binary_len + 1);
+
+		if (!os_file_exists(drmsend_filename)) {
+			blog(LOG_ERROR, "%s doesn't exist", drmsend_filename);
+			goto filename_cleanup;
+		}
+
+		blog(LOG_DEBUG, "Will execute obs-kmsgrab-send from %s",
+		     drmsend_filename);
+	}
+
+	/* 1. create and listen on unix socket */
+	sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+	if (-1 == bind(sockfd, (const struct sockaddr *)&addr, addrlen)) {
+		blog(LOG_ERROR, "Cannot bind unix socket to %s: %d",
+		     socket_name, errno);
+		goto socket_cleanup;
+	}
+
+	if (-1 == listen(sockfd, 1)) {
+		blog(LOG_ERROR, "Cannot listen on unix socket bound to %s: %d",
+		     socket_name, errno);
+		goto socket_cleanup;
+	}
+
+	/* 2. run obs-kmsgrab-send utility */
+	const char *argv[4 + OBS_DRMSEND_MAX_CARDS] = {0};
+	{
+		int argc = 0;
+#ifdef USE_PKEXEC
+		argv[argc++] = "pkexec";
+#endif
+		argv[argc++] = drmsend_filename;
+		argv[argc++] = socket_name;
+		for (int i = 0; i < num_cards; ++i)
+			argv[argc++] = dri_filenames[i];
+	}
+
+	const pid_t drmsend_pid = helper_spawn(argv);
+	if (drmsend_pid == -1) {
+		blog(LOG_ERROR, "Cannot spawn %s: %d", argv[0], errno);
+		goto socket_cleanup;
+	}
+
+	blog(LOG_DEBUG, "Spawned obs-kmsgrab-send as pid %d", drmsend_pid);
+
+	/* 3. select() on unix socket w/ timeout */
+	// FIXME updating timeout w/ time left is linux-specific, other unices might not do that
+	struct timeval timeout;
+	timeout.tv_sec = 5;
+	timeout.tv_usec = 0;
+	int connfd = -1;
+	while (connfd < 0) {
+		fd_set set;
+		FD_ZERO(&set);
+		FD_SET(sockfd, &set);
+		const int maxfd = sockfd;
+		const int nfds = select(maxfd + 1, &set, NULL, NULL, &timeout);
+
+		if (nfds < 0) {
+			if (errno == EINTR)
+				continue;
+			blog(LOG_ERROR, "Cannot select(): %d", errno);
+			goto child_cleanup;
+		}
+
+		if (nfds == 0) {
+			blog(LOG_ERROR, "Waiting for drmsend timed out");
+			goto child_cleanup;
+		}
+
+		if (!FD_ISSET(sockfd, &set))
+			continue;
+
+		blog(LOG_DEBUG, "Ready to accept");
+
+		/* 4. accept() and receive data */
+		connfd = accept4(sockfd, NULL, NULL, SOCK_CLOEXEC);
+		if (connfd < 0) {
+			blog(LOG_ERROR, "Cannot accept unix socket: %d", errno);
+			goto child_cleanup;
+		}
+
+		/* Abstract sockets can be connected to by anyone, make sure
+		 * that it is our child on the other end. pkexec replaces
+		 * itself with the helper, so the pid stays the same. */
+		struct ucred cred;
+		socklen_t cred_len = sizeof(cred);
+		if (-1 == getsockopt(connfd, SOL_SOCKET, SO_PEERCRED, &cred,
+				     &cred_len) ||
+		    cred.pid != drmsend_pid) {
+			blog(LOG_ERROR,
+			     "Rejecting connection from unexpected peer");
+			close(connfd);
+			connfd = -1;
+		}
+	}
+
+	blog(LOG_DEBUG, "Receiving message from obs-kmsgrab-send");
+
+	for (;;) {
+		struct msghdr msg = {0};
+
+		struct iovec io = {
+			.iov_base = &list->resp,
+			.iov_len = sizeof(list->resp),
+		};
+		msg.msg_iov = &io;
+		msg.msg_iovlen = 1;
+
+		char cmsg_buf[CMSG_SPACE(sizeof(int) *
+					 OBS_DRMSEND_MAX_FRAMEBUFFERS)];
+		memset(cmsg_buf, 0, sizeof(cmsg_buf));
+		msg.msg_control = cmsg_buf;
+		msg.msg_controllen = sizeof(cmsg_buf);
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len =
+			CMSG_LEN(sizeof(int) * OBS_DRMSEND_MAX_FRAMEBUFFERS);
+
+		// FIXME blocking, may hang if drmsend dies before sending anything
+		ssize_t recvd = recvmsg(connfd, &msg, MSG_CMSG_CLOEXEC);
+		blog(LOG_DEBUG, "recvmsg = %d", (int)recvd);
+		if (recvd <= 0) {
+			blog(LOG_ERROR, "cannot recvmsg: %d", errno);
+			break;
+		}
+
+		/* Stream sockets may hand the response over in parts, fds
+		 * come with the first one */
+		size_t received = recvd;
+		while (received < sizeof(list->resp)) {
+			recvd = recv(connfd, (char *)&list->resp + received,
+				     sizeof(list->resp) - received, MSG_WAITALL);
+			if (recvd < 0 && errno == EINTR)
+				continue;
+			if (recvd <= 0)
+				break;
+			received += recvd;
+		}
+
+		if (received != sizeof(list->resp)) {
+			blog(LOG_ERROR,
+			     "Received metadata size mismatch: %d received, %d expected",
+			     (int)received, (int)sizeof(list->resp));
+			break;
+		}
+
+		if (list->resp.tag != OBS_DRMSEND_TAG) {
+			blog(LOG_ERROR,
+			     "Received metadata tag mismatch: %#x received, %#x expected",
+			     list->resp.tag, OBS_DRMSEND_TAG);
+			break;
+		}
+
+		if (list->resp.num_framebuffers < 0 ||
+		    list->resp.num_framebuffers >
+			    OBS_DRMSEND_MAX_FRAMEBUFFERS ||
+		    list->resp.num_cards < 0 ||
+		    list->resp.num_cards > OBS_DRMSEND_MAX_CARDS) {
+			blog(LOG_ERROR,
+			     "Received invalid counts: %d framebuffers, %d cards",
+			     list->resp.num_framebuffers,
+			     list->resp.num_cards);
+			break;
+		}
+
+		if (cmsg->cmsg_len !=
+		    CMSG_LEN(sizeof(int) * list->resp.num_framebuffers)) {
+			blog(LOG_ERROR,
+			     "Received fd size mismatch: %d received, %d expected",
+			     (int)cmsg->cmsg_len,
+			     (int)CMSG_LEN(sizeof(int) *
+					   list->resp.num_framebuffers));
+			break;
+		}
+
+		memcpy(list->fb_fds, CMSG_DATA(cmsg),
+		       sizeof(int) * list->resp.num_framebuffers);
+		retval = 1;
+		break;
+	}
+	close(connfd);
+
+	if (retval) {
+		blog(LOG_INFO,
+		     "Received %d framebuffers:", list->resp.num_framebuffers);
+		for (int i = 0; i < list->resp.num_framebuffers; ++i) {
+			const drmsend_framebuffer_t *fb =
+				list->resp.framebuffers + i;
+			blog(LOG_INFO,
+			     "Received card=%s width=%d height=%d pitch=%u fourcc=%#x fd=%d",
+			     dmabuf_fblist_card(list, fb), fb->width,
+			     fb->height, fb->pitch, fb->fourcc,
+			     list->fb_fds[i]);
+		}
+	}
+
+	// TODO consider using separate thread for waitpid() on drmsend_pid
+	/* 5. waitpid() on obs-kmsgrab-send w/ timeout. It exits right after
+	 * sending, so poll often at first and back off from there. */
+	int exited = 0;
+child_cleanup:
+	for (useconds_t waited_us = 0, delay_us = 1000;
+	     waited_us < DRMSEND_EXIT_TIMEOUT_US; waited_us += delay_us) {
+		int wstatus = 0;
+		const pid_t p = waitpid(drmsend_pid, &wstatus, WNOHANG);
+		if (p == drmsend_pid) {
+			if (wstatus == 0 || WIFEXITED(wstatus)) {
+				exited = 1;
+				const int status = WEXITSTATUS(wstatus);
+				if (status != 0)
+					blog(LOG_ERROR, "%s returned %d",
+					     drmsend_filename, status);
+				break;
+			}
+		} else if (-1 == p) {
+			const int err = errno;
+			blog(LOG_ERROR, "Cannot waitpid() on drmsend: %d", err);
+			if (err == ECHILD) {
+				exited = 1;
+				break;
+			}
+		}
+
+		usleep(delay_us);
+		if (delay_us < DRMSEND_EXIT_MAX_DELAY_US)
+			delay_us *= 2;
+	}
+
+	if (!exited)
+		blog(LOG_ERROR, "Couldn't wait for %s to exit, expect zombies",
+		     drmsend_filename);
+
+socket_cleanup:
+	close(sockfd);
+
+filename_cleanup:
+	free(drmsend_filename);
+	return retval;
+}
+
+dmabuf_fblist_t *dmabuf_fblist_receive(const char *const *dri_filenames,
+				       int num_cards)
+{
+	dmabuf_fblist_t *list = bzalloc(sizeof(dmabuf_fblist_t));
+	list->refs = 1;
+
+	if (!dmabuf_fblist_receive_into(dri_filenames, num_cards, list)) {
+		bfree(list);
+		return NULL;
+	}
+
+	return list;
+}
+
+void dmabuf_fblist_addref(dmabuf_fblist_t *list)
+{
+	os_atomic_inc_long(&list->refs);
+}
+
+void dmabuf_fblist_release(dmabuf_fblist_t *list)
+{
+	if (!list || os_atomic_dec_long(&list->refs) > 0)
+		return;
+
+	for (int i = 0; i < list->resp.num_framebuffers; ++i) {
+		const int fd = list->fb_fds[i];
+		if (fd > 0)
+			close(fd);
+	}
+
+	bfree(list);
+}
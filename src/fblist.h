@@ -0,0 +1,44 @@
+#pragma once
+
+#include "drmsend.h"
+
+#include <stdint.h>
+
+/* Result of one enumeration by linux-kmsgrab-send: framebuffer metadata
+ * and their dma-buf fds. Snapshots are immutable once received and shared
+ * by reference, fds are closed when the last reference is released. */
+typedef struct {
+	volatile long refs;
+	drmsend_response_t resp;
+	int fb_fds[OBS_DRMSEND_MAX_FRAMEBUFFERS];
+} dmabuf_fblist_t;
+
+/**
+ * Runs linux-kmsgrab-send on given cards and receives their framebuffers
+ *
+ * @return new snapshot with one reference, NULL on error
+ */
+dmabuf_fblist_t *dmabuf_fblist_receive(const char *const *dri_filenames,
+				       int num_cards);
+
+void dmabuf_fblist_addref(dmabuf_fblist_t *list);
+void dmabuf_fblist_release(dmabuf_fblist_t *list);
+
+/**
+ * @return path of the card fb belongs to, empty string if unknown
+ */
+const char *dmabuf_fblist_card(const dmabuf_fblist_t *list,
+			       const drmsend_framebuffer_t *fb);
+
+/**
+ * @return index of framebuffer fb_id on card, -1 if there is none
+ */
+int dmabuf_fblist_find(const dmabuf_fblist_t *list, const char *card,
+		       uint32_t fb_id);
+
+/**
+ * Fills cards with /dev/dri/cardN paths that exist
+ *
+ * @return number of cards found
+ */
+int dmabuf_fblist_list_cards(char cards[][32], int max_cards);
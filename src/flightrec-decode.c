@@ -0,0 +1,358 @@
+/* Turns a flight recorder dump of the plugin into a timeline, e.g.:
+ *
+ *   linux-kmsgrab-flightrec --last 5 \
+ *       ~/.config/obs-studio/plugin_config/linux-kmsgrab/flightrec/Screen-*.kmsfr
+ *
+ * Dumps are made with the "Dump capture flight recorder" hotkey, the
+ * dump_flight_recorder proc of a source, or automatically when an import
+ * fails or the graphics thread stalls. Every event is printed with its wall
+ * clock time and the time since the previous one, followed by a summary of
+ * tick, render and import times. */
+
+#define _GNU_SOURCE
+
+#include "flightrec.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+
+#define LOG_PREFIX "kmsgrab-flightrec: "
+
+#define ERR(fmt, ...) fprintf(stderr, LOG_PREFIX fmt "\n", ##__VA_ARGS__)
+#define MSG(fmt, ...) fprintf(stderr, LOG_PREFIX fmt "\n", ##__VA_ARGS__)
+
+/* Min, max and mean of a duration */
+typedef struct {
+	uint64_t count, sum_ns, min_ns, max_ns;
+} decode_stat_t;
+
+typedef struct {
+	uint64_t events[FLIGHTREC_EVENT_COUNT];
+	decode_stat_t tick_gap, render, import, import_wait, cursor;
+	uint64_t lost;
+} decode_summary_t;
+
+static void statAdd(decode_stat_t *stat, uint64_t ns)
+{
+	if (!stat->count || ns < stat->min_ns)
+		stat->min_ns = ns;
+	if (ns > stat->max_ns)
+		stat->max_ns = ns;
+	stat->sum_ns += ns;
+	stat->count++;
+}
+
+static void printStat(const char *name, const decode_stat_t *stat)
+{
+	if (!stat->count)
+		return;
+
+	printf("  %-12s n=%-7" PRIu64 " mean=%9.3fms min=%9.3fms max=%9.3fms\n",
+	       name, stat->count, stat->sum_ns / 1e6 / stat->count,
+	       stat->min_ns / 1e6, stat->max_ns / 1e6);
+}
+
+static void formatFlags(char *buf, size_t size, uint32_t flags,
+			const char *const names[], int num_names)
+{
+	size_t len = 0;
+	buf[0] = '\0';
+	for (int i = 0; i < num_names; ++i) {
+		if (flags & (1u << i))
+			len += snprintf(buf + len, size - len, "%s%s",
+					len ? "," : "", names[i]);
+		if (len >= size)
+			break;
+	}
+	if (!len)
+		snprintf(buf, size, "-");
+}
+
+static void describe(const flightrec_record_t *r, char *buf, size_t size)
+{
+	static const char *const tick_flags[] = {"changed", "full", "moved"};
+	static const char *const render_flags[] = {"snapshot", "composite"};
+	char flags[64];
+
+	switch (r->type) {
+	case FLIGHTREC_ENUMERATE:
+		snprintf(buf, size, "%u framebuffers%s", r->a,
+			 r->c ? "" : " (shared)");
+		if (r->c)
+			snprintf(buf + strlen(buf), size - strlen(buf),
+				 ", helper took %.3fms", r->b / 1e6);
+		break;
+	case FLIGHTREC_SELECT:
+		if (r->a)
+			snprintf(buf, size, "fb=%#x crtc=%" PRIu64, r->a, r->b);
+		else
+			snprintf(buf, size, "nothing found");
+		break;
+	case FLIGHTREC_IMPORT_QUEUED:
+		snprintf(buf, size, "fb=%#x", r->a);
+		break;
+	case FLIGHTREC_IMPORT:
+	case FLIGHTREC_IMPORT_FAILED:
+		snprintf(buf, size, "fb=%#x took=%.3fms waited=%.3fms", r->a,
+			 r->b / 1e6, r->c / 1e6);
+		break;
+	case FLIGHTREC_SWITCH:
+		snprintf(buf, size, "fb=%#x (was %#" PRIx64 ")", r->a, r->b);
+		break;
+	case FLIGHTREC_DORMANT:
+		snprintf(buf, size, "%s", r->a ? "dormant" : "awake");
+		break;
+	case FLIGHTREC_DPMS:
+		snprintf(buf, size, "output %s", r->a ? "off" : "on");
+		break;
+	case FLIGHTREC_TICK:
+		formatFlags(flags, sizeof(flags), r->a, tick_flags, 3);
+		snprintf(buf, size, "%s flips=%" PRIu64 " rects=%" PRIu64,
+			 flags, r->b, r->c);
+		break;
+	case FLIGHTREC_CURSOR:
+		snprintf(buf, size, "serial=%u at %d,%d xfixes=%.3fms", r->a,
+			 (int32_t)(r->b >> 32), (int32_t)(uint32_t)r->b,
+			 r->c / 1e6);
+		break;
+	case FLIGHTREC_SNAPSHOT:
+		snprintf(buf, size, "submit=%.3fms", r->a / 1e6);
+		break;
+	case FLIGHTREC_RENDER:
+		formatFlags(flags, sizeof(flags), (uint32_t)r->b, render_flags,
+			    2);
+		snprintf(buf, size, "fb=%#x %s cpu=%.3fms", r->a, flags,
+			 r->c / 1e6);
+		break;
+	case FLIGHTREC_STALL:
+		snprintf(buf, size, "no tick for %.3fms", r->b / 1e6);
+		break;
+	case FLIGHTREC_DUMP:
+		snprintf(buf, size, "%s", flightrec_reason_name(r->a));
+		break;
+	default:
+		snprintf(buf, size, "a=%u b=%" PRIu64 " c=%" PRIu64, r->a,
+			 r->b, r->c);
+		break;
+	}
+}
+
+static int compareRecords(const void *a, const void *b)
+{
+	const flightrec_record_t *ra = a, *rb = b;
+	if (ra->time_ns != rb->time_ns)
+		return ra->time_ns < rb->time_ns ? -1 : 1;
+	return (ra->seq > rb->seq) - (ra->seq < rb->seq);
+}
+
+static bool parseTypes(const char *value, bool *shown)
+{
+	char *list = strdup(value);
+	bool ok = true;
+	for (char *save = NULL, *name = strtok_r(list, ",", &save); name;
+	     name = strtok_r(NULL, ",", &save)) {
+		int type = 1;
+		for (; type < FLIGHTREC_EVENT_COUNT; ++type)
+			if (strcmp(name, flightrec_event_name(type)) == 0)
+				break;
+		if (type == FLIGHTREC_EVENT_COUNT) {
+			ERR("Unknown event type %s", name);
+			ok = false;
+			break;
+		}
+		shown[type] = true;
+	}
+	free(list);
+	return ok;
+}
+
+static flightrec_record_t *readDump(const char *path, flightrec_header_t *header)
+{
+	FILE *f = fopen(path, "rb");
+	if (!f) {
+		ERR("Cannot open %s: %s", path, strerror(errno));
+		return NULL;
+	}
+
+	flightrec_record_t *records = NULL;
+	if (fread(header, sizeof(*header), 1, f) != 1 ||
+	    header->magic != FLIGHTREC_MAGIC ||
+	    header->record_size != sizeof(flightrec_record_t) ||
+	    header->num_records > FLIGHTREC_CAPACITY) {
+		ERR("%s is not a flight recorder dump", path);
+		goto cleanup;
+	}
+
+	records = malloc(sizeof(*records) * (header->num_records + 1));
+	if (fread(records, sizeof(*records), header->num_records, f) !=
+	    header->num_records) {
+		ERR("%s is truncated", path);
+		free(records);
+		records = NULL;
+	}
+
+cleanup:
+	fclose(f);
+	return records;
+}
+
+static void printUsage(const char *name)
+{
+	MSG("usage: %s [--last seconds] [--only type,...] [--no-ticks] dump.kmsfr",
+	    name);
+	MSG("types: enumerate select import-queued import import-failed switch dormant dpms");
+	MSG("       tick cursor snapshot render stall dump");
+}
+
+int main(int argc, char *argv[])
+{
+	const char *path = NULL;
+	double last_seconds = 0.;
+	bool shown[FLIGHTREC_EVENT_COUNT];
+	bool filtered = false, no_ticks = false;
+	memset(shown, 0, sizeof(shown));
+
+	for (int i = 1; i < argc; ++i) {
+		const char *arg = argv[i];
+		if (strcmp(arg, "--no-ticks") == 0) {
+			no_ticks = true;
+			continue;
+		}
+		if (arg[0] != '-' && !path) {
+			path = arg;
+			continue;
+		}
+
+		const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+		if (!value) {
+			printUsage(argv[0]);
+			return 1;
+		}
+		++i;
+
+		if (strcmp(arg, "--last") == 0) {
+			last_seconds = atof(value);
+		} else if (strcmp(arg, "--only") == 0) {
+			if (!parseTypes(value, shown))
+				return 1;
+			filtered = true;
+		} else {
+			printUsage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (!path) {
+		printUsage(argv[0]);
+		return 1;
+	}
+
+	if (!filtered)
+		for (int i = 0; i < FLIGHTREC_EVENT_COUNT; ++i)
+			shown[i] = true;
+	if (no_ticks)
+		shown[FLIGHTREC_TICK] = shown[FLIGHTREC_RENDER] =
+			shown[FLIGHTREC_CURSOR] = false;
+
+	flightrec_header_t header;
+	flightrec_record_t *records = readDump(path, &header);
+	if (!records)
+		return 2;
+	header.name[sizeof(header.name) - 1] = '\0';
+
+	/* Monotonic to wall clock */
+	const int64_t wall_offset_ns =
+		(int64_t)header.realtime_ns - (int64_t)header.monotonic_ns;
+	const uint64_t since_ns =
+		last_seconds > 0. && header.monotonic_ns > last_seconds * 1e9
+			? header.monotonic_ns - (uint64_t)(last_seconds * 1e9)
+			: 0;
+
+	/* Records being written at the time of the dump are left out */
+	decode_summary_t summary;
+	memset(&summary, 0, sizeof(summary));
+	if (header.num_records)
+		summary.lost = records[header.num_records - 1].seq -
+			       records[0].seq + 1 - header.num_records;
+
+	/* Threads log in the order they get to it, not by time */
+	qsort(records, header.num_records, sizeof(*records), compareRecords);
+
+	printf("source   %s\n", header.name[0] ? header.name : "(unnamed)");
+	printf("reason   %s\n", flightrec_reason_name(header.reason));
+	printf("records  %u", header.num_records);
+	if (summary.lost)
+		printf(" (%" PRIu64 " torn)", summary.lost);
+	if (header.num_records)
+		printf(", %.3fs before dump",
+		       (header.monotonic_ns - records[0].time_ns) / 1e9);
+	printf("\n\n");
+
+	uint64_t prev_ns = 0, prev_tick_ns = 0;
+
+	for (uint32_t i = 0; i < header.num_records; ++i) {
+		const flightrec_record_t *r = records + i;
+		if (r->time_ns < since_ns)
+			continue;
+
+		if (r->type < FLIGHTREC_EVENT_COUNT)
+			summary.events[r->type]++;
+		switch (r->type) {
+		case FLIGHTREC_TICK:
+			if (prev_tick_ns)
+				statAdd(&summary.tick_gap,
+					r->time_ns - prev_tick_ns);
+			prev_tick_ns = r->time_ns;
+			break;
+		case FLIGHTREC_RENDER:
+			statAdd(&summary.render, r->c);
+			break;
+		case FLIGHTREC_IMPORT:
+		case FLIGHTREC_IMPORT_FAILED:
+			statAdd(&summary.import, r->b);
+			statAdd(&summary.import_wait, r->c);
+			break;
+		case FLIGHTREC_CURSOR:
+			statAdd(&summary.cursor, r->c);
+			break;
+		}
+
+		if (r->type >= FLIGHTREC_EVENT_COUNT || !shown[r->type])
+			continue;
+
+		const int64_t wall_ns = (int64_t)r->time_ns + wall_offset_ns;
+		const time_t wall_s = wall_ns / 1000000000LL;
+		struct tm tm;
+		char stamp[16];
+		strftime(stamp, sizeof(stamp), "%H:%M:%S",
+			 localtime_r(&wall_s, &tm));
+
+		char details[160];
+		describe(r, details, sizeof(details));
+		printf("%s.%06lld %+10.3fms  %-14s %s\n", stamp,
+		       (long long)(wall_ns % 1000000000LL) / 1000,
+		       prev_ns ? (r->time_ns - prev_ns) / 1e6 : 0.,
+		       flightrec_event_name(r->type), details);
+		prev_ns = r->time_ns;
+	}
+
+	printf("\nevents\n");
+	for (int i = 1; i < FLIGHTREC_EVENT_COUNT; ++i)
+		if (summary.events[i])
+			printf("  %-14s %" PRIu64 "\n", flightrec_event_name(i),
+			       summary.events[i]);
+
+	printf("timing\n");
+	printStat("tick gap", &summary.tick_gap);
+	printStat("render", &summary.render);
+	printStat("import", &summary.import);
+	printStat("import wait", &summary.import_wait);
+	printStat("xfixes", &summary.cursor);
+
+	free(records);
+	return 0;
+}
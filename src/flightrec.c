@@ -0,0 +1,104 @@
+#include "flightrec.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+static const char *const event_names[FLIGHTREC_EVENT_COUNT] = {
+	[FLIGHTREC_ENUMERATE] = "enumerate",
+	[FLIGHTREC_SELECT] = "select",
+	[FLIGHTREC_IMPORT_QUEUED] = "import-queued",
+	[FLIGHTREC_IMPORT] = "import",
+	[FLIGHTREC_IMPORT_FAILED] = "import-failed",
+	[FLIGHTREC_SWITCH] = "switch",
+	[FLIGHTREC_DORMANT] = "dormant",
+	[FLIGHTREC_DPMS] = "dpms",
+	[FLIGHTREC_TICK] = "tick",
+	[FLIGHTREC_CURSOR] = "cursor",
+	[FLIGHTREC_SNAPSHOT] = "snapshot",
+	[FLIGHTREC_RENDER] = "render",
+	[FLIGHTREC_STALL] = "stall",
+	[FLIGHTREC_DUMP] = "dump",
+};
+
+static const char *const reason_names[FLIGHTREC_REASON_COUNT] = {
+	[FLIGHTREC_REASON_REQUESTED] = "requested",
+	[FLIGHTREC_REASON_IMPORT_FAILED] = "import failed",
+	[FLIGHTREC_REASON_IMPORT_STALLED] = "import stalled",
+	[FLIGHTREC_REASON_TICK_STALLED] = "tick stalled",
+};
+
+const char *flightrec_event_name(uint32_t type)
+{
+	return type < FLIGHTREC_EVENT_COUNT && event_names[type]
+		       ? event_names[type]
+		       : "?";
+}
+
+const char *flightrec_reason_name(uint32_t reason)
+{
+	return reason < FLIGHTREC_REASON_COUNT ? reason_names[reason] : "?";
+}
+
+/* Copies out records that are complete, oldest first */
+static uint32_t flightrec_copy(flightrec_t *rec, flightrec_record_t *out)
+{
+	const uint64_t head = __atomic_load_n(&rec->head, __ATOMIC_ACQUIRE);
+	const uint64_t first =
+		head > FLIGHTREC_CAPACITY ? head - FLIGHTREC_CAPACITY : 0;
+
+	uint32_t count = 0;
+	for (uint64_t seq = first; seq < head; ++seq) {
+		const flightrec_record_t *r =
+			rec->records + (seq & (FLIGHTREC_CAPACITY - 1));
+		if (__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) != seq + 1)
+			continue;
+
+		out[count] = *r;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&r->seq, __ATOMIC_RELAXED) != seq + 1)
+			continue;
+
+		out[count++].seq = seq + 1;
+	}
+
+	return count;
+}
+
+flightrec_snapshot_t *flightrec_snapshot(flightrec_t *rec, const char *name,
+					 flightrec_reason_t reason)
+{
+	flightrec_snapshot_t *snapshot = malloc(sizeof(flightrec_snapshot_t));
+	if (!snapshot)
+		return NULL;
+
+	flightrec_header_t *header = &snapshot->header;
+	*header = (flightrec_header_t){
+		.magic = FLIGHTREC_MAGIC,
+		.record_size = sizeof(flightrec_record_t),
+		.reason = reason,
+	};
+	snprintf(header->name, sizeof(header->name), "%s", name ? name : "");
+
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	header->realtime_ns = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	header->monotonic_ns = flightrec_now_ns();
+	header->num_records = flightrec_copy(rec, snapshot->records);
+
+	return snapshot;
+}
+
+bool flightrec_write(const flightrec_snapshot_t *snapshot, const char *path)
+{
+	const flightrec_header_t *header = &snapshot->header;
+
+	FILE *f = fopen(path, "wb");
+	if (!f)
+		return false;
+
+	const bool written =
+		fwrite(header, sizeof(*header), 1, f) == 1 &&
+		fwrite(snapshot->records, sizeof(flightrec_record_t),
+		       header->num_records, f) == header->num_records;
+	return fclose(f) == 0 && written;
+}
@@ -0,0 +1,155 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+/* Flight recorder: a fixed-size ring of binary capture events, cheap enough
+ * to be always on, dumped to a file when something goes wrong. Any thread
+ * may log without locking; older records are overwritten. Dumps are decoded
+ * by linux-kmsgrab-flightrec. */
+
+#define FLIGHTREC_CAPACITY 8192 /* power of two */
+#define FLIGHTREC_MAGIC 0x31524653u /* "SFR1" */
+
+typedef enum {
+	/* a: framebuffers found, b: ns spent, c: 1 if the helper was run */
+	FLIGHTREC_ENUMERATE = 1,
+	/* a: fb_id, b: crtc_id, nothing found if fb_id is 0 */
+	FLIGHTREC_SELECT,
+	/* a: fb_id */
+	FLIGHTREC_IMPORT_QUEUED,
+	/* a: fb_id, b: ns import took, c: ns it waited for the graphics
+	 * thread; FLIGHTREC_IMPORT_FAILED has the same fields */
+	FLIGHTREC_IMPORT,
+	FLIGHTREC_IMPORT_FAILED,
+	/* a: fb_id now rendered, 0 for none, b: previous one */
+	FLIGHTREC_SWITCH,
+	/* a: 1 if dormant */
+	FLIGHTREC_DORMANT,
+	/* a: 1 if output is off */
+	FLIGHTREC_DPMS,
+	/* a: FLIGHTREC_TICK_* flags, b: flips, c: damage rects */
+	FLIGHTREC_TICK,
+	/* a: cursor serial, b: x << 32 | y as rendered, c: ns XFixes round
+	 * trip took */
+	FLIGHTREC_CURSOR,
+	/* a: ns submitting the copy took on the CPU */
+	FLIGHTREC_SNAPSHOT,
+	/* a: fb_id, b: FLIGHTREC_RENDER_* flags, c: ns spent */
+	FLIGHTREC_RENDER,
+	/* b: ns since previous tick */
+	FLIGHTREC_STALL,
+	/* a: FLIGHTREC_REASON_* */
+	FLIGHTREC_DUMP,
+	FLIGHTREC_EVENT_COUNT,
+} flightrec_event_t;
+
+#define FLIGHTREC_TICK_CHANGED 0x1
+#define FLIGHTREC_TICK_FULL 0x2
+#define FLIGHTREC_TICK_MOVED 0x4
+
+#define FLIGHTREC_RENDER_SNAPSHOT 0x1
+#define FLIGHTREC_RENDER_COMPOSITE 0x2
+
+typedef enum {
+	FLIGHTREC_REASON_REQUESTED,
+	FLIGHTREC_REASON_IMPORT_FAILED,
+	FLIGHTREC_REASON_IMPORT_STALLED,
+	FLIGHTREC_REASON_TICK_STALLED,
+	FLIGHTREC_REASON_COUNT,
+} flightrec_reason_t;
+
+typedef struct {
+	/* Position in the stream plus one, 0 while being written */
+	uint64_t seq;
+	/* CLOCK_MONOTONIC, same as os_gettime_ns() */
+	uint64_t time_ns;
+	uint32_t type;
+	uint32_t a;
+	uint64_t b;
+	uint64_t c;
+} flightrec_record_t;
+
+typedef struct {
+	uint64_t head;
+	flightrec_record_t records[FLIGHTREC_CAPACITY];
+} flightrec_t;
+
+/* Dump file header, followed by num_records records in the order they were
+ * logged, which for events from different threads may not be the order of
+ * their times */
+typedef struct {
+	uint32_t magic;
+	uint32_t record_size;
+	uint32_t num_records;
+	uint32_t reason;
+	/* Clocks at the time of the dump, to place records in wall time */
+	uint64_t monotonic_ns;
+	uint64_t realtime_ns;
+	char name[64];
+} flightrec_header_t;
+
+static inline uint64_t flightrec_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Appends an event that happened at time_ns. Safe to call from any thread,
+ * never blocks. Costs a few ns, reading the clock costs more, so pass a time
+ * taken anyway where there is one.
+ */
+static inline void flightrec_log_at(flightrec_t *rec, uint64_t time_ns,
+				    flightrec_event_t type, uint32_t a,
+				    uint64_t b, uint64_t c)
+{
+	const uint64_t seq =
+		__atomic_fetch_add(&rec->head, 1, __ATOMIC_RELAXED);
+	flightrec_record_t *r = rec->records + (seq & (FLIGHTREC_CAPACITY - 1));
+
+	/* Readers skip records whose seq changes while they copy them */
+	__atomic_store_n(&r->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	r->time_ns = time_ns;
+	r->type = type;
+	r->a = a;
+	r->b = b;
+	r->c = c;
+	__atomic_store_n(&r->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+/* Appends an event that is happening now */
+static inline void flightrec_log(flightrec_t *rec, flightrec_event_t type,
+				 uint32_t a, uint64_t b, uint64_t c)
+{
+	flightrec_log_at(rec, flightrec_now_ns(), type, a, b, c);
+}
+
+/* Dump held in memory, to be written elsewhere than where it is taken */
+typedef struct {
+	flightrec_header_t header;
+	flightrec_record_t records[FLIGHTREC_CAPACITY];
+} flightrec_snapshot_t;
+
+/**
+ * Copies what rec holds, named after name. Records being written at the
+ * time are left out. Costs a copy of the ring and no I/O.
+ *
+ * @return snapshot to be freed with free(), NULL if out of memory
+ */
+flightrec_snapshot_t *flightrec_snapshot(flightrec_t *rec, const char *name,
+					 flightrec_reason_t reason);
+
+/**
+ * Writes snapshot to path
+ *
+ * @return false if the file cannot be written, errno is then set
+ */
+bool flightrec_write(const flightrec_snapshot_t *snapshot, const char *path);
+
+/* Short name of an event type or dump reason, "?" if it is not known */
+const char *flightrec_event_name(uint32_t type);
+const char *flightrec_reason_name(uint32_t reason);
@@ -0,0 +1,116 @@
+#define _GNU_SOURCE
+
+#include "helper-spawn.h"
+
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <pthread.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+
+extern char **environ;
+
+/* glibc implements posix_spawn() with clone(CLONE_VM | CLONE_VFORK) and
+ * reports exec failures, closefrom is there since 2.34 */
+#if defined(__GLIBC__) && \
+	(__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 34))
+#define HELPER_SPAWN_POSIX_SPAWN
+#endif
+
+#ifdef HELPER_SPAWN_POSIX_SPAWN
+
+pid_t helper_spawn(const char *const argv[])
+{
+	posix_spawn_file_actions_t actions;
+	posix_spawnattr_t attr;
+	posix_spawn_file_actions_init(&actions);
+	posix_spawnattr_init(&attr);
+
+	posix_spawn_file_actions_addclosefrom_np(&actions, STDERR_FILENO + 1);
+
+	sigset_t mask;
+	sigemptyset(&mask);
+	posix_spawnattr_setsigmask(&attr, &mask);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+
+	pid_t pid = -1;
+	const int err = posix_spawnp(&pid, argv[0], &actions, &attr,
+				     (char *const *)argv, environ);
+
+	posix_spawnattr_destroy(&attr);
+	posix_spawn_file_actions_destroy(&actions);
+
+	if (err) {
+		errno = err;
+		return -1;
+	}
+	return pid;
+}
+
+#else
+
+/* vfork() suspends the parent until the child has exec'd or exited, and
+ * unlike a raw clone() the child is set up by libc, so it can make the few
+ * calls below. It shares memory, which is how exec failures are told. */
+pid_t helper_spawn(const char *const argv[])
+{
+	volatile int exec_errno = 0;
+
+	sigset_t empty;
+	sigemptyset(&empty);
+
+	/* Keep our signal handlers from running in the child while it shares
+	 * our memory, until it has put them back to default */
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+
+	const pid_t pid = vfork();
+	if (pid == 0) {
+#ifdef SYS_close_range
+		if (syscall(SYS_close_range, STDERR_FILENO + 1, ~0u, 0) != 0)
+#endif
+		{
+			const long max_fd = sysconf(_SC_OPEN_MAX);
+			for (long fd = STDERR_FILENO + 1; fd < max_fd; ++fd)
+				close(fd);
+		}
+
+		/* Handlers are ours, exec would reset them anyway */
+		for (int sig = 1; sig < NSIG; ++sig) {
+			struct sigaction sa;
+			if (sigaction(sig, NULL, &sa) == 0 &&
+			    sa.sa_handler != SIG_IGN && sa.sa_handler != SIG_DFL) {
+				sa.sa_handler = SIG_DFL;
+				sa.sa_flags = 0;
+				sigaction(sig, &sa, NULL);
+			}
+		}
+
+		sigprocmask(SIG_SETMASK, &empty, NULL);
+		execvp(argv[0], (char *const *)argv);
+		exec_errno = errno;
+		_exit(127);
+	}
+
+	const int vfork_errno = errno;
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (pid == -1) {
+		errno = vfork_errno;
+		return -1;
+	}
+
+	if (exec_errno) {
+		waitpid(pid, NULL, 0);
+		errno = exec_errno;
+		return -1;
+	}
+
+	return pid;
+}
+
+#endif
@@ -0,0 +1,15 @@
+#pragma once
+
+#include <sys/types.h>
+
+/**
+ * Runs argv[0], looked up in PATH, without copying the caller's address
+ * space: the child shares it until exec, like vfork(). Nothing but stdin,
+ * stdout and stderr is inherited, whether or not other fds are CLOEXEC, and
+ * the child starts with no signals blocked. Helpers find their way back
+ * through named sockets, so they need no other fds.
+ *
+ * @return pid of the child, -1 with errno set if it could not be started,
+ * including when exec has failed
+ */
+pid_t helper_spawn(const char *const argv[]);
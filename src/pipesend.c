@@ -0,0 +1,610 @@
+/* Writes the framebuffers followed by linux-kmsgrab-send as raw video to
+ * stdout or a FIFO, for feeding ffmpeg and the like without OBS, e.g.:
+ *
+ *   linux-kmsgrab-pipe --fps 30 | ffmpeg -f rawvideo -pix_fmt bgr0 \
+ *       -video_size 1920x1080 -framerate 30 -i - out.mkv
+ *
+ * Frames are read straight from the mmapped dma-buf, bracketed by
+ * DMA_BUF_IOCTL_SYNC, and written to the output. With --vmsplice they are
+ * vmspliced into the pipe instead, where the kernel allows that for the
+ * buffer. With --dmabuf-socket it does not touch pixels at all
+ * and forwards the dma-buf fds, with the same protocol as the helper's
+ * follow mode, to a single consumer such as a VAAPI encoder. */
+
+#define _GNU_SOURCE
+
+#include "drmsend-client.h"
+
+#include <libdrm/drm_fourcc.h>
+#include <linux/dma-buf.h>
+
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+
+#define LOG_PREFIX "kmsgrab-pipe: "
+
+/* stdout is for frames */
+#define ERR(fmt, ...) fprintf(stderr, LOG_PREFIX fmt "\n", ##__VA_ARGS__)
+#define MSG(fmt, ...) fprintf(stderr, LOG_PREFIX fmt "\n", ##__VA_ARGS__)
+
+#ifndef KMSGRAB_SEND_PATH
+#define KMSGRAB_SEND_PATH "linux-kmsgrab-send"
+#endif
+
+/* Rows handed to a single vmsplice()/writev() for padded framebuffers */
+#define PIPESEND_IOV_ROWS 64
+
+typedef struct {
+	int fd;
+	drmsend_framebuffer_t fb;
+	void *map;
+	size_t map_size;
+	/* fd has been sent to the --dmabuf-socket consumer */
+	bool forwarded;
+} pipesend_slot_t;
+
+typedef struct {
+	drmsend_client_t client;
+	pipesend_slot_t slots[OBS_DRMSEND_FOLLOW_SLOTS];
+
+	/* Most recently received frame, written on the next tick */
+	drmsend_frame_t latest;
+	bool latest_written;
+	/* Every written frame has to have this size */
+	drmsend_framebuffer_t format;
+
+	int out_fd;
+	bool use_vmsplice;
+	int consumer_fd;
+
+	int64_t start_ns;
+	uint64_t frames_received;
+	uint64_t frames_written;
+	uint64_t frames_repeated;
+	uint64_t frames_dropped;
+	uint64_t bytes_written;
+	int64_t write_ns;
+} pipesend_t;
+
+static volatile sig_atomic_t pipesend_stop;
+
+static void pipesend_on_signal(int signal_number)
+{
+	(void)signal_number;
+	pipesend_stop = 1;
+}
+
+static int64_t pipesend_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ll + ts.tv_nsec;
+}
+
+static void pipesend_slot_clear(pipesend_slot_t *slot)
+{
+	if (slot->map)
+		munmap(slot->map, slot->map_size);
+	if (slot->fd >= 0)
+		close(slot->fd);
+	slot->map = NULL;
+	slot->fd = -1;
+	slot->forwarded = false;
+}
+
+static bool pipesend_slot_map(pipesend_slot_t *slot)
+{
+	const drmsend_framebuffer_t *fb = &slot->fb;
+	slot->map_size = (size_t)fb->offset + (size_t)fb->pitch * fb->height;
+	slot->map = mmap(NULL, slot->map_size, PROT_READ, MAP_SHARED, slot->fd,
+			 0);
+	if (slot->map == MAP_FAILED) {
+		slot->map = NULL;
+		ERR("Cannot mmap framebuffer %#x: %s (%d), try --dmabuf-socket",
+		    fb->fb_id, strerror(errno), errno);
+		return false;
+	}
+
+	return true;
+}
+
+/* Raw output has no way to describe tiling or other pixel sizes */
+static bool pipesend_check_format(const drmsend_framebuffer_t *fb)
+{
+	switch (fb->fourcc) {
+	case DRM_FORMAT_XRGB8888:
+	case DRM_FORMAT_ARGB8888:
+	case DRM_FORMAT_XBGR8888:
+	case DRM_FORMAT_ABGR8888:
+		break;
+	default:
+		ERR("Unsupported fourcc %#x, try --dmabuf-socket", fb->fourcc);
+		return false;
+	}
+
+	if (fb->modifier == DRM_FORMAT_MOD_INVALID) {
+		MSG("Framebuffer has implicit modifier, assuming it is linear");
+	} else if (fb->modifier != DRM_FORMAT_MOD_LINEAR) {
+		ERR("Framebuffer is tiled (modifier %#llx), try --dmabuf-socket",
+		    (unsigned long long)fb->modifier);
+		return false;
+	}
+
+	return true;
+}
+
+/* Writes or vmsplices all of iov, which is modified in the process */
+static bool pipesend_write_iov(pipesend_t *s, struct iovec *iov, int count)
+{
+	while (count > 0) {
+		ssize_t written =
+			s->use_vmsplice ? vmsplice(s->out_fd, iov, count, 0)
+					: writev(s->out_fd, iov, count);
+		if (written < 0 && errno == EINTR)
+			continue;
+
+		/* Mappings of device memory cannot be spliced */
+		if (written < 0 && s->use_vmsplice &&
+		    (errno == EFAULT || errno == EINVAL || errno == ENOSYS)) {
+			MSG("vmsplice() is not available for this framebuffer: %s (%d), falling back to write()",
+			    strerror(errno), errno);
+			s->use_vmsplice = false;
+			continue;
+		}
+
+		if (written < 0) {
+			if (errno != EPIPE)
+				ERR("Cannot write frame: %s (%d)",
+				    strerror(errno), errno);
+			return false;
+		}
+
+		s->bytes_written += written;
+		while (count > 0 && (size_t)written >= iov->iov_len) {
+			written -= iov->iov_len;
+			++iov;
+			--count;
+		}
+		if (count > 0) {
+			iov->iov_base = (char *)iov->iov_base + written;
+			iov->iov_len -= written;
+		}
+	}
+
+	return true;
+}
+
+static bool pipesend_sync(pipesend_slot_t *slot, uint64_t flags)
+{
+	struct dma_buf_sync sync = {.flags = flags | DMA_BUF_SYNC_READ};
+	while (-1 == ioctl(slot->fd, DMA_BUF_IOCTL_SYNC, &sync)) {
+		if (errno == EINTR || errno == EAGAIN)
+			continue;
+		/* udmabuf before 5.x and some exporters have no sync */
+		if (errno == ENOTTY)
+			return true;
+		ERR("Cannot sync framebuffer: %s (%d)", strerror(errno), errno);
+		return false;
+	}
+	return true;
+}
+
+/* write() copies the pixels before the buffer is handed back with
+ * DMA_BUF_SYNC_END. vmsplice() only takes page references, so whatever is
+ * still in the pipe by then is read from scanout memory later, and is torn
+ * if the compositor draws into the buffer again before the consumer has
+ * drained the pipe. That is why it is only used with --vmsplice. */
+static bool pipesend_write_frame(pipesend_t *s, pipesend_slot_t *slot)
+{
+	const drmsend_framebuffer_t *fb = &slot->fb;
+	const size_t row_size = (size_t)fb->width * 4;
+	const char *pixels = (const char *)slot->map + fb->offset;
+
+	if (!pipesend_sync(slot, DMA_BUF_SYNC_START))
+		return false;
+
+	bool written = true;
+	if ((size_t)fb->pitch == row_size) {
+		struct iovec iov = {
+			.iov_base = (void *)pixels,
+			.iov_len = row_size * fb->height,
+		};
+		written = pipesend_write_iov(s, &iov, 1);
+	} else {
+		struct iovec iov[PIPESEND_IOV_ROWS];
+		for (int y = 0; written && y < fb->height;
+		     y += PIPESEND_IOV_ROWS) {
+			int rows = fb->height - y;
+			if (rows > PIPESEND_IOV_ROWS)
+				rows = PIPESEND_IOV_ROWS;
+			for (int i = 0; i < rows; ++i) {
+				iov[i].iov_base = (void *)(pixels +
+							   (size_t)(y + i) *
+								   fb->pitch);
+				iov[i].iov_len = row_size;
+			}
+			written = pipesend_write_iov(s, iov, rows);
+		}
+	}
+
+	return pipesend_sync(slot, DMA_BUF_SYNC_END) && written;
+}
+
+static bool pipesend_forward_frame(pipesend_t *s, pipesend_slot_t *slot,
+				   const drmsend_frame_t *frame)
+{
+	drmsend_frame_t out = *frame;
+	out.has_fd = !slot->forwarded;
+
+	struct msghdr msg = {0};
+	struct iovec io = {
+		.iov_base = &out,
+		.iov_len = sizeof(out),
+	};
+	msg.msg_iov = &io;
+	msg.msg_iovlen = 1;
+
+	char cmsg_buf[CMSG_SPACE(sizeof(int))];
+	if (out.has_fd) {
+		memset(cmsg_buf, 0, sizeof(cmsg_buf));
+		msg.msg_control = cmsg_buf;
+		msg.msg_controllen = sizeof(cmsg_buf);
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &slot->fd, sizeof(int));
+	}
+
+	ssize_t sent;
+	do
+		sent = sendmsg(s->consumer_fd, &msg, MSG_NOSIGNAL);
+	while (sent < 0 && errno == EINTR);
+
+	if (sent != sizeof(out)) {
+		MSG("Consumer has disconnected");
+		return false;
+	}
+
+	slot->forwarded = true;
+	s->bytes_written += sizeof(out);
+	return true;
+}
+
+/* Takes in a frame from the helper, mapping its framebuffer if it is new */
+static bool pipesend_receive(pipesend_t *s)
+{
+	drmsend_frame_t frame;
+	int fd = -1;
+	if (!drmsend_client_recv_frame(&s->client, &frame, &fd)) {
+		MSG("Helper has stopped");
+		return false;
+	}
+
+	if (frame.slot < 0 || frame.slot >= OBS_DRMSEND_FOLLOW_SLOTS ||
+	    (!frame.has_fd && s->slots[frame.slot].fd < 0)) {
+		ERR("Received frame for unknown slot %d", frame.slot);
+		if (fd >= 0)
+			close(fd);
+		return false;
+	}
+
+	pipesend_slot_t *slot = s->slots + frame.slot;
+	if (frame.has_fd) {
+		pipesend_slot_clear(slot);
+		slot->fd = fd;
+		slot->fb = frame.fb;
+
+		if (s->consumer_fd < 0 && !pipesend_slot_map(slot))
+			return false;
+	}
+
+	if (frame.fb.width != s->format.width ||
+	    frame.fb.height != s->format.height ||
+	    (s->consumer_fd < 0 && (frame.fb.fourcc != s->format.fourcc ||
+				    frame.fb.modifier != s->format.modifier))) {
+		ERR("Framebuffer has changed to %dx%d fourcc %#x, which raw output cannot follow",
+		    frame.fb.width, frame.fb.height, frame.fb.fourcc);
+		return false;
+	}
+
+	if (s->frames_received > 0 && !s->latest_written)
+		s->frames_dropped++;
+	s->frames_received++;
+	s->latest = frame;
+	s->latest_written = false;
+	return true;
+}
+
+static bool pipesend_emit(pipesend_t *s)
+{
+	pipesend_slot_t *slot = s->slots + s->latest.slot;
+	if (s->latest_written)
+		s->frames_repeated++;
+
+	const int64_t start_ns = pipesend_now_ns();
+	const bool sent = s->consumer_fd >= 0
+				  ? pipesend_forward_frame(s, slot, &s->latest)
+				  : pipesend_write_frame(s, slot);
+	s->write_ns += pipesend_now_ns() - start_ns;
+	if (!sent)
+		return false;
+
+	s->frames_written++;
+	s->latest_written = true;
+	return true;
+}
+
+static void pipesend_report(const pipesend_t *s)
+{
+	const double seconds = (pipesend_now_ns() - s->start_ns) / 1e9;
+	const uint64_t written = s->frames_written ? s->frames_written : 1;
+	MSG("%.1fs: %llu frames written (%.2f fps, %llu repeated), %llu received, %llu dropped, %.1f MiB/s, %.3f ms per frame",
+	    seconds, (unsigned long long)s->frames_written,
+	    seconds > 0 ? s->frames_written / seconds : 0.,
+	    (unsigned long long)s->frames_repeated,
+	    (unsigned long long)s->frames_received,
+	    (unsigned long long)s->frames_dropped,
+	    seconds > 0 ? s->bytes_written / seconds / (1024. * 1024.) : 0.,
+	    s->write_ns / 1e6 / written);
+}
+
+/* Waits for a single consumer to connect to name, '@' makes it abstract */
+static int pipesend_accept_consumer(const char *name)
+{
+	struct sockaddr_un addr = {0};
+	addr.sun_family = AF_UNIX;
+	const size_t name_len = strlen(name);
+	if (name_len == 0 || name_len >= sizeof(addr.sun_path)) {
+		ERR("Socket name '%s' has wrong length", name);
+		return -1;
+	}
+	memcpy(addr.sun_path, name, name_len);
+	if (name[0] == '@')
+		addr.sun_path[0] = '\0';
+	const socklen_t addrlen =
+		offsetof(struct sockaddr_un, sun_path) + name_len;
+
+	int connfd = -1;
+	const int sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sockfd < 0 ||
+	    -1 == bind(sockfd, (const struct sockaddr *)&addr, addrlen) ||
+	    -1 == listen(sockfd, 1)) {
+		ERR("Cannot listen on unix socket %s: %s (%d)", name,
+		    strerror(errno), errno);
+		goto cleanup;
+	}
+
+	MSG("Waiting for a consumer on %s", name);
+	do
+		connfd = accept4(sockfd, NULL, NULL, SOCK_CLOEXEC);
+	while (connfd < 0 && errno == EINTR && !pipesend_stop);
+	if (connfd < 0 && !pipesend_stop)
+		ERR("Cannot accept unix socket: %s (%d)", strerror(errno),
+		    errno);
+
+cleanup:
+	if (sockfd >= 0)
+		close(sockfd);
+	if (name[0] != '@')
+		unlink(name);
+	return connfd;
+}
+
+static void printUsage(const char *name)
+{
+	MSG("usage: %s [--card /dev/dri/cardN] [--crtc id] [--helper path] [--no-pkexec]",
+	    name);
+	MSG("       [--output path [--vmsplice] | --dmabuf-socket name] [--fps N] [--frames N] [--report seconds]");
+}
+
+int main(int argc, char *argv[])
+{
+	const char *card = "/dev/dri/card0";
+	const char *helper = KMSGRAB_SEND_PATH;
+	const char *output = NULL;
+	const char *dmabuf_socket = NULL;
+	uint32_t crtc_id = 0;
+	int fps = 0;
+	uint64_t max_frames = 0;
+	int report_seconds = 5;
+	bool vmsplice_requested = false;
+#ifdef USE_PKEXEC
+	bool use_pkexec = true;
+#else
+	bool use_pkexec = false;
+#endif
+
+	for (int i = 1; i < argc; ++i) {
+		const char *arg = argv[i];
+		if (strcmp(arg, "--no-pkexec") == 0) {
+			use_pkexec = false;
+			continue;
+		}
+		if (strcmp(arg, "--vmsplice") == 0) {
+			vmsplice_requested = true;
+			continue;
+		}
+
+		const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+		if (!value) {
+			printUsage(argv[0]);
+			return 1;
+		}
+		++i;
+
+		if (strcmp(arg, "--card") == 0)
+			card = value;
+		else if (strcmp(arg, "--crtc") == 0)
+			crtc_id = strtoul(value, NULL, 0);
+		else if (strcmp(arg, "--helper") == 0)
+			helper = value;
+		else if (strcmp(arg, "--output") == 0)
+			output = value;
+		else if (strcmp(arg, "--dmabuf-socket") == 0)
+			dmabuf_socket = value;
+		else if (strcmp(arg, "--fps") == 0)
+			fps = atoi(value);
+		else if (strcmp(arg, "--frames") == 0)
+			max_frames = strtoull(value, NULL, 0);
+		else if (strcmp(arg, "--report") == 0)
+			report_seconds = atoi(value);
+		else {
+			printUsage(argv[0]);
+			return 1;
+		}
+	}
+
+	pipesend_t s = {0};
+	s.client.fd = -1;
+	s.client.pid = -1;
+	s.out_fd = -1;
+	s.consumer_fd = -1;
+	for (int i = 0; i < OBS_DRMSEND_FOLLOW_SLOTS; ++i)
+		s.slots[i].fd = -1;
+
+	int retval = 2;
+
+	/* No SA_RESTART, so that poll() notices */
+	struct sigaction sa = {0};
+	sa.sa_handler = pipesend_on_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	if (dmabuf_socket) {
+		s.consumer_fd = pipesend_accept_consumer(dmabuf_socket);
+		if (s.consumer_fd < 0)
+			goto cleanup;
+	} else {
+		/* Opening a FIFO waits for its reader */
+		s.out_fd = output ? open(output, O_WRONLY | O_CLOEXEC)
+				  : STDOUT_FILENO;
+		if (s.out_fd < 0) {
+			ERR("Cannot open %s: %s (%d)", output, strerror(errno),
+			    errno);
+			goto cleanup;
+		}
+		if (isatty(s.out_fd)) {
+			ERR("Refusing to write raw video to a terminal");
+			goto cleanup;
+		}
+
+		struct stat st;
+		s.use_vmsplice = vmsplice_requested &&
+				 0 == fstat(s.out_fd, &st) &&
+				 S_ISFIFO(st.st_mode);
+		if (vmsplice_requested && !s.use_vmsplice)
+			MSG("Output is not a pipe, using write() instead of vmsplice()");
+	}
+
+	if (!drmsend_client_follow(&s.client, helper, use_pkexec, card,
+				   crtc_id))
+		goto cleanup;
+
+	/* The first frame decides the output format */
+	drmsend_frame_t first;
+	int first_fd = -1;
+	if (!drmsend_client_recv_frame(&s.client, &first, &first_fd))
+		goto cleanup;
+	s.format = first.fb;
+	pipesend_slot_t *first_slot = s.slots + first.slot;
+	first_slot->fd = first_fd;
+	first_slot->fb = first.fb;
+	s.latest = first;
+	s.frames_received = 1;
+
+	if (s.consumer_fd < 0 && (!pipesend_check_format(&first.fb) ||
+				  !pipesend_slot_map(first_slot)))
+		goto cleanup;
+
+	MSG("Following %dx%d fourcc %#x modifier %#llx on crtc %#x, writing %s",
+	    first.fb.width, first.fb.height, first.fb.fourcc,
+	    (unsigned long long)first.fb.modifier, first.fb.crtc_id,
+	    s.consumer_fd >= 0 ? "dma-buf fds"
+	    : s.use_vmsplice   ? "with vmsplice()"
+			       : "with write()");
+
+	s.start_ns = pipesend_now_ns();
+	const int64_t period_ns = fps > 0 ? 1000000000ll / fps : 0;
+	int64_t next_emit_ns = s.start_ns;
+	int64_t next_report_ns = s.start_ns + report_seconds * 1000000000ll;
+
+	retval = 0;
+	while (!pipesend_stop &&
+	       (!max_frames || s.frames_written < max_frames)) {
+		/* Without --fps every frame is written as soon as it arrives */
+		if (!period_ns)
+			next_emit_ns = s.latest_written ? INT64_MAX : 0;
+
+		const int64_t now_ns = pipesend_now_ns();
+		if (now_ns >= next_emit_ns) {
+			if (!pipesend_emit(&s))
+				break;
+
+			/* Skip ticks rather than bursting after a stall */
+			if (period_ns) {
+				next_emit_ns += period_ns;
+				if (next_emit_ns < now_ns)
+					next_emit_ns = now_ns + period_ns;
+			}
+			continue;
+		}
+
+		if (report_seconds > 0 && now_ns >= next_report_ns) {
+			pipesend_report(&s);
+			next_report_ns += report_seconds * 1000000000ll;
+		}
+
+		int timeout_ms = -1;
+		if (next_emit_ns != INT64_MAX)
+			timeout_ms = (next_emit_ns - now_ns + 999999) / 1000000;
+		if (report_seconds > 0) {
+			const int report_ms =
+				(next_report_ns - now_ns + 999999) / 1000000;
+			if (timeout_ms < 0 || report_ms < timeout_ms)
+				timeout_ms = report_ms;
+		}
+
+		struct pollfd pfd = {.fd = s.client.fd, .events = POLLIN};
+		const int ready = poll(&pfd, 1, timeout_ms);
+		if (ready < 0 && errno != EINTR) {
+			ERR("Cannot poll helper: %s (%d)", strerror(errno),
+			    errno);
+			retval = 2;
+			break;
+		}
+
+		if (ready > 0 && !pipesend_receive(&s))
+			break;
+	}
+
+	pipesend_report(&s);
+
+cleanup:
+	drmsend_client_close(&s.client);
+
+	for (int i = 0; i < OBS_DRMSEND_FOLLOW_SLOTS; ++i)
+		pipesend_slot_clear(s.slots + i);
+
+	if (s.consumer_fd >= 0)
+		close(s.consumer_fd);
+	if (output && s.out_fd >= 0)
+		close(s.out_fd);
+
+	return retval;
+}
@@ -0,0 +1,698 @@
+/* Publishes framebuffers followed by linux-kmsgrab-send as a PipeWire video
+ * source, so that any number of local consumers can share one zero-copy
+ * capture. Buffers are handed out as dma-bufs, one PipeWire buffer per
+ * framebuffer the compositor flips between. With --memfd it sends animated
+ * memfd buffers instead and does not need DRM or root at all. */
+
+#define _GNU_SOURCE
+
+#include "drmsend-client.h"
+
+#include <libdrm/drm_fourcc.h>
+
+#include <pipewire/pipewire.h>
+#include <spa/param/video/format-utils.h>
+#include <spa/param/buffers.h>
+#include <spa/buffer/meta.h>
+
+#include <sys/mman.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#define LOG_PREFIX "kmsgrab-pipewire: "
+
+#define ERR(fmt, ...) fprintf(stderr, LOG_PREFIX fmt "\n", ##__VA_ARGS__)
+#define MSG(fmt, ...) fprintf(stdout, LOG_PREFIX fmt "\n", ##__VA_ARGS__)
+
+#ifndef KMSGRAB_SEND_PATH
+#define KMSGRAB_SEND_PATH "linux-kmsgrab-send"
+#endif
+
+#define MEMFD_SLOTS 3
+/* Framebuffers replaced while their buffers are still out there */
+#define MAX_RETIRED (OBS_DRMSEND_FOLLOW_SLOTS * 2)
+
+typedef struct {
+	int fd;
+	drmsend_framebuffer_t fb;
+	/* PipeWire buffer that carries fd, if any */
+	struct pw_buffer *buffer;
+	/* buffer has been dequeued and not queued since */
+	bool held;
+} pwsend_slot_t;
+
+/* fd of a replaced framebuffer, kept open until its buffer is removed, as
+ * consumers may import it until then */
+typedef struct {
+	struct pw_buffer *buffer;
+	int fd;
+} pwsend_retired_t;
+
+typedef struct {
+	struct pw_main_loop *loop;
+	struct pw_stream *stream;
+	struct spa_source *source;
+	bool streaming;
+
+	bool memfd;
+	drmsend_client_t client;
+
+	pwsend_slot_t slots[OBS_DRMSEND_FOLLOW_SLOTS];
+	pwsend_retired_t retired[MAX_RETIRED];
+	/* What EnumFormat has last been offered for */
+	drmsend_framebuffer_t format_fb;
+
+	/* Frame to be queued by the next graph cycle, which it triggers */
+	drmsend_frame_t pending;
+	bool has_pending;
+
+	/* --memfd buffers, painted on a timer */
+	void *memfd_maps[MEMFD_SLOTS];
+	drmsend_frame_t memfd_frame;
+
+	uint64_t frames_sent, frames_dropped;
+} pwsend_t;
+
+static uint32_t pwsend_video_format(uint32_t fourcc)
+{
+	switch (fourcc) {
+	case DRM_FORMAT_XRGB8888:
+		return SPA_VIDEO_FORMAT_BGRx;
+	case DRM_FORMAT_ARGB8888:
+		return SPA_VIDEO_FORMAT_BGRA;
+	case DRM_FORMAT_XBGR8888:
+		return SPA_VIDEO_FORMAT_RGBx;
+	case DRM_FORMAT_ABGR8888:
+		return SPA_VIDEO_FORMAT_RGBA;
+	}
+	return SPA_VIDEO_FORMAT_UNKNOWN;
+}
+
+static size_t pwsend_fb_size(const drmsend_framebuffer_t *fb)
+{
+	return (size_t)fb->offset + (size_t)fb->pitch * fb->height;
+}
+
+static int pwsend_num_slots(const pwsend_t *s)
+{
+	int num = 0;
+	for (int i = 0; i < OBS_DRMSEND_FOLLOW_SLOTS; ++i)
+		num += s->slots[i].fd >= 0;
+	return num;
+}
+
+static const struct spa_pod *pwsend_build_format(pwsend_t *s,
+						 struct spa_pod_builder *b)
+{
+	const drmsend_framebuffer_t *fb = &s->format_fb;
+	struct spa_pod_frame f;
+
+	spa_pod_builder_push_object(b, &f, SPA_TYPE_OBJECT_Format,
+				    SPA_PARAM_EnumFormat);
+	spa_pod_builder_add(
+		b, SPA_FORMAT_mediaType, SPA_POD_Id(SPA_MEDIA_TYPE_video),
+		SPA_FORMAT_mediaSubtype, SPA_POD_Id(SPA_MEDIA_SUBTYPE_raw),
+		SPA_FORMAT_VIDEO_format,
+		SPA_POD_Id(pwsend_video_format(fb->fourcc)),
+		SPA_FORMAT_VIDEO_size,
+		SPA_POD_Rectangle(&SPA_RECTANGLE(fb->width, fb->height)),
+		SPA_FORMAT_VIDEO_framerate,
+		SPA_POD_Fraction(&SPA_FRACTION(0, 1)), 0);
+
+	/* Implicit modifier is DRM_FORMAT_MOD_INVALID, consumers know that */
+	if (!s->memfd) {
+		spa_pod_builder_prop(b, SPA_FORMAT_VIDEO_modifier,
+				     SPA_POD_PROP_FLAG_MANDATORY);
+		spa_pod_builder_long(b, fb->modifier);
+	}
+
+	return spa_pod_builder_pop(b, &f);
+}
+
+/* Buffer set is fixed for a negotiated format, so it has to be negotiated
+ * again whenever a framebuffer is added or replaced */
+static void pwsend_update_buffers(pwsend_t *s)
+{
+	uint8_t buffer[1024];
+	struct spa_pod_builder b = SPA_POD_BUILDER_INIT(buffer, sizeof(buffer));
+	const drmsend_framebuffer_t *fb = &s->format_fb;
+	const int data_type = s->memfd ? SPA_DATA_MemFd : SPA_DATA_DmaBuf;
+
+	const struct spa_pod *params[3];
+	params[0] = spa_pod_builder_add_object(
+		&b, SPA_TYPE_OBJECT_ParamBuffers, SPA_PARAM_Buffers,
+		SPA_PARAM_BUFFERS_buffers, SPA_POD_Int(pwsend_num_slots(s)),
+		SPA_PARAM_BUFFERS_blocks, SPA_POD_Int(1),
+		SPA_PARAM_BUFFERS_size, SPA_POD_Int((int)pwsend_fb_size(fb)),
+		SPA_PARAM_BUFFERS_stride, SPA_POD_Int(fb->pitch),
+		SPA_PARAM_BUFFERS_dataType, SPA_POD_Int(1 << data_type));
+	params[1] = spa_pod_builder_add_object(
+		&b, SPA_TYPE_OBJECT_ParamMeta, SPA_PARAM_Meta,
+		SPA_PARAM_META_type, SPA_POD_Id(SPA_META_Header),
+		SPA_PARAM_META_size,
+		SPA_POD_Int(sizeof(struct spa_meta_header)));
+	/* Room for all rects and the empty one that terminates them */
+	params[2] = spa_pod_builder_add_object(
+		&b, SPA_TYPE_OBJECT_ParamMeta, SPA_PARAM_Meta,
+		SPA_PARAM_META_type, SPA_POD_Id(SPA_META_VideoDamage),
+		SPA_PARAM_META_size,
+		SPA_POD_CHOICE_RANGE_Int(
+			(int)sizeof(struct spa_meta_region) *
+				(DRM_DAMAGE_MAX_RECTS + 1),
+			(int)sizeof(struct spa_meta_region) * 2,
+			(int)sizeof(struct spa_meta_region) *
+				(DRM_DAMAGE_MAX_RECTS + 1)));
+
+	pw_stream_update_params(s->stream, params, 3);
+}
+
+static void pwsend_on_param_changed(void *data, uint32_t id,
+				    const struct spa_pod *param)
+{
+	pwsend_t *s = data;
+
+	if (!param || id != SPA_PARAM_Format)
+		return;
+
+	struct spa_video_info_raw info;
+	if (spa_format_video_raw_parse(param, &info) < 0)
+		return;
+
+	MSG("Negotiated %ux%u format %u", info.size.width, info.size.height,
+	    info.format);
+	pwsend_update_buffers(s);
+}
+
+static void pwsend_on_add_buffer(void *data, struct pw_buffer *buffer)
+{
+	pwsend_t *s = data;
+	struct spa_data *d = buffer->buffer->datas;
+
+	pwsend_slot_t *slot = NULL;
+	for (int i = 0; !slot && i < OBS_DRMSEND_FOLLOW_SLOTS; ++i) {
+		if (s->slots[i].fd >= 0 && !s->slots[i].buffer)
+			slot = s->slots + i;
+	}
+
+	buffer->user_data = slot;
+	if (!slot) {
+		ERR("More buffers requested than there are framebuffers");
+		return;
+	}
+
+	slot->buffer = buffer;
+	slot->held = false;
+
+	d->type = s->memfd ? SPA_DATA_MemFd : SPA_DATA_DmaBuf;
+	d->flags = SPA_DATA_FLAG_READABLE;
+	d->fd = slot->fd;
+	d->mapoffset = 0;
+	d->maxsize = pwsend_fb_size(&slot->fb);
+	d->data = NULL;
+}
+
+static void pwsend_on_remove_buffer(void *data, struct pw_buffer *buffer)
+{
+	pwsend_t *s = data;
+	pwsend_slot_t *slot = buffer->user_data;
+
+	if (slot && slot->buffer == buffer) {
+		slot->buffer = NULL;
+		slot->held = false;
+	}
+	buffer->user_data = NULL;
+
+	for (int i = 0; i < MAX_RETIRED; ++i) {
+		pwsend_retired_t *r = s->retired + i;
+		if (r->buffer != buffer)
+			continue;
+
+		close(r->fd);
+		r->buffer = NULL;
+		r->fd = -1;
+	}
+}
+
+/* Closes fd of slot once nothing refers to it any more */
+static void pwsend_retire_fd(pwsend_t *s, pwsend_slot_t *slot)
+{
+	if (slot->fd < 0)
+		return;
+
+	if (slot->buffer) {
+		slot->buffer->user_data = NULL;
+		for (int i = 0; i < MAX_RETIRED; ++i) {
+			pwsend_retired_t *r = s->retired + i;
+			if (r->buffer)
+				continue;
+
+			r->buffer = slot->buffer;
+			r->fd = slot->fd;
+			slot->buffer = NULL;
+			slot->fd = -1;
+			return;
+		}
+
+		ERR("Too many replaced framebuffers, closing fd of one that may still be in use");
+		slot->buffer = NULL;
+	}
+
+	close(slot->fd);
+	slot->fd = -1;
+}
+
+static void pwsend_on_state_changed(void *data, enum pw_stream_state old,
+				    enum pw_stream_state state,
+				    const char *error)
+{
+	pwsend_t *s = data;
+
+	MSG("Stream %s%s%s, node id %u", pw_stream_state_as_string(state),
+	    error ? ": " : "", error ? error : "",
+	    pw_stream_get_node_id(s->stream));
+
+	s->streaming = state == PW_STREAM_STATE_STREAMING;
+	if (state == PW_STREAM_STATE_ERROR)
+		pw_main_loop_quit(s->loop);
+}
+
+/* Takes every buffer consumers are done with. They are kept until their
+ * framebuffer is displayed again. */
+static void pwsend_collect_buffers(pwsend_t *s)
+{
+	struct pw_buffer *buffer;
+	while ((buffer = pw_stream_dequeue_buffer(s->stream))) {
+		pwsend_slot_t *slot = buffer->user_data;
+		if (slot)
+			slot->held = true;
+	}
+}
+
+/* Damage of frame as regions terminated by an empty one, or a single region
+ * covering all of it if that's all that fits or is known */
+static void pwsend_fill_damage(struct spa_meta *meta,
+			       const drmsend_frame_t *frame)
+{
+	const drm_damage_t *damage = &frame->damage;
+	const drm_damage_rect_t all = {0, 0, frame->fb.width,
+				       frame->fb.height};
+	const int capacity = meta->size / sizeof(struct spa_meta_region);
+	const bool full = damage->full || damage->num_rects >= capacity;
+	const drm_damage_rect_t *rects = full ? &all : damage->rects;
+	const int num_rects = full ? 1 : damage->num_rects;
+
+	struct spa_meta_region *regions = meta->data;
+	for (int i = 0; i < num_rects && i < capacity; ++i) {
+		regions[i].region.position.x = rects[i].x1;
+		regions[i].region.position.y = rects[i].y1;
+		regions[i].region.size.width = rects[i].x2 - rects[i].x1;
+		regions[i].region.size.height = rects[i].y2 - rects[i].y1;
+	}
+	if (num_rects < capacity)
+		memset(regions + num_rects, 0, sizeof(*regions));
+}
+
+static void pwsend_queue(pwsend_t *s, pwsend_slot_t *slot,
+			 const drmsend_frame_t *frame)
+{
+	if (!s->streaming || !slot->buffer) {
+		s->frames_dropped++;
+		return;
+	}
+
+	pwsend_collect_buffers(s);
+
+	/* Some consumer still has it */
+	if (!slot->held) {
+		s->frames_dropped++;
+		return;
+	}
+
+	struct spa_buffer *buf = slot->buffer->buffer;
+	struct spa_chunk *chunk = buf->datas[0].chunk;
+	chunk->offset = slot->fb.offset;
+	chunk->size = slot->fb.pitch * slot->fb.height;
+	chunk->stride = slot->fb.pitch;
+	chunk->flags = 0;
+
+	struct spa_meta_header *h = spa_buffer_find_meta_data(
+		buf, SPA_META_Header, sizeof(*h));
+	if (h) {
+		h->flags = 0;
+		h->offset = 0;
+		h->pts = frame->timestamp_ns;
+		h->dts_offset = 0;
+		h->seq = frame->sequence;
+	}
+
+	struct spa_meta *damage =
+		spa_buffer_find_meta(buf, SPA_META_VideoDamage);
+	if (damage)
+		pwsend_fill_damage(damage, frame);
+
+	slot->held = false;
+	pw_stream_queue_buffer(s->stream, slot->buffer);
+	s->frames_sent++;
+}
+
+static bool pwsend_same_format(const drmsend_framebuffer_t *a,
+			       const drmsend_framebuffer_t *b)
+{
+	return a->width == b->width && a->height == b->height &&
+	       a->fourcc == b->fourcc && a->modifier == b->modifier &&
+	       a->pitch == b->pitch;
+}
+
+/* Takes ownership of fd */
+static void pwsend_on_frame(pwsend_t *s, const drmsend_frame_t *frame, int fd)
+{
+	pwsend_slot_t *slot = s->slots + frame->slot;
+
+	bool renegotiate = false;
+	if (frame->has_fd) {
+		pwsend_retire_fd(s, slot);
+
+		slot->fd = fd;
+		slot->fb = frame->fb;
+		slot->held = false;
+		renegotiate = true;
+	}
+
+	if (pwsend_video_format(slot->fb.fourcc) == SPA_VIDEO_FORMAT_UNKNOWN) {
+		ERR("Framebuffer %#x has unsupported format %#x",
+		    slot->fb.fb_id, slot->fb.fourcc);
+		s->frames_dropped++;
+		return;
+	}
+
+	if (!pwsend_same_format(&s->format_fb, &slot->fb)) {
+		MSG("Offering %dx%d fourcc %#x modifier %#llx",
+		    slot->fb.width, slot->fb.height, slot->fb.fourcc,
+		    (unsigned long long)slot->fb.modifier);
+
+		s->format_fb = slot->fb;
+
+		uint8_t buffer[1024];
+		struct spa_pod_builder b =
+			SPA_POD_BUILDER_INIT(buffer, sizeof(buffer));
+		const struct spa_pod *params[1] = {pwsend_build_format(s, &b)};
+		pw_stream_update_params(s->stream, params, 1);
+		s->frames_dropped++;
+		return;
+	}
+
+	if (renegotiate) {
+		pwsend_update_buffers(s);
+		s->frames_dropped++;
+		return;
+	}
+
+	/* The stream drives the graph, each frame starts a cycle */
+	if (s->has_pending)
+		s->frames_dropped++;
+	s->pending = *frame;
+	s->has_pending = true;
+	pw_stream_trigger_process(s->stream);
+}
+
+static void pwsend_on_process(void *data)
+{
+	pwsend_t *s = data;
+	if (!s->has_pending)
+		return;
+
+	s->has_pending = false;
+	pwsend_queue(s, s->slots + s->pending.slot, &s->pending);
+}
+
+static const struct pw_stream_events pwsend_stream_events = {
+	PW_VERSION_STREAM_EVENTS,
+	.state_changed = pwsend_on_state_changed,
+	.param_changed = pwsend_on_param_changed,
+	.add_buffer = pwsend_on_add_buffer,
+	.remove_buffer = pwsend_on_remove_buffer,
+	.process = pwsend_on_process,
+};
+
+static void pwsend_on_helper_io(void *data, int fd, uint32_t mask)
+{
+	pwsend_t *s = data;
+
+	drmsend_frame_t frame;
+	int fb_fd = -1;
+	if ((mask & (SPA_IO_ERR | SPA_IO_HUP)) ||
+	    !drmsend_client_recv_frame(&s->client, &frame, &fb_fd)) {
+		ERR("Helper is gone");
+		pw_main_loop_quit(s->loop);
+		return;
+	}
+
+	pwsend_on_frame(s, &frame, fb_fd);
+}
+
+static void pwsend_on_memfd_timer(void *data, uint64_t expirations)
+{
+	pwsend_t *s = data;
+	drmsend_frame_t *frame = &s->memfd_frame;
+
+	const int index = frame->sequence % MEMFD_SLOTS;
+	pwsend_slot_t *slot = s->slots + index;
+
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	frame->timestamp_ns = ts.tv_sec * 1000000000ll + ts.tv_nsec;
+	frame->slot = index;
+	frame->sequence++;
+
+	if (s->streaming)
+		pwsend_collect_buffers(s);
+
+	/* Don't draw over what consumers are still reading */
+	const drmsend_framebuffer_t *fb = &slot->fb;
+	if (!slot->buffer || slot->held) {
+		uint32_t *pixels = s->memfd_maps[index];
+		const int bar = (frame->sequence * 8) % fb->width;
+		for (int y = 0; y < fb->height; ++y) {
+			uint32_t *row = pixels + (size_t)y * (fb->pitch / 4);
+			for (int x = 0; x < fb->width; ++x)
+				row[x] = (x >= bar && x < bar + 32)
+						 ? 0xffffffffu
+						 : 0xff000000u |
+							   (index * 0x40 << 8);
+		}
+	}
+
+	pwsend_on_frame(s, frame, -1);
+}
+
+/* Fills MEMFD_SLOTS slots upfront, frames never bring new ones */
+static bool pwsend_memfd_init(pwsend_t *s, int width, int height)
+{
+	s->memfd_frame.tag = OBS_DRMSEND_FRAME_TAG;
+	/* Bar moves all over */
+	s->memfd_frame.damage.changed = true;
+	s->memfd_frame.damage.full = true;
+
+	for (int i = 0; i < MEMFD_SLOTS; ++i) {
+		pwsend_slot_t *slot = s->slots + i;
+		drmsend_framebuffer_t *fb = &slot->fb;
+		fb->fb_id = 0x100 + i;
+		fb->width = width;
+		fb->height = height;
+		fb->pitch = width * 4;
+		fb->fourcc = DRM_FORMAT_XRGB8888;
+		fb->modifier = DRM_FORMAT_MOD_LINEAR;
+
+		const size_t size = pwsend_fb_size(fb);
+		slot->fd = memfd_create("kmsgrab-pipewire", MFD_CLOEXEC);
+		if (slot->fd < 0 || 0 != ftruncate(slot->fd, size)) {
+			ERR("Cannot create %zu bytes memfd: %s (%d)", size,
+			    strerror(errno), errno);
+			return false;
+		}
+
+		s->memfd_maps[i] = mmap(NULL, size, PROT_READ | PROT_WRITE,
+					MAP_SHARED, slot->fd, 0);
+		if (s->memfd_maps[i] == MAP_FAILED) {
+			ERR("Cannot mmap memfd: %s (%d)", strerror(errno),
+			    errno);
+			s->memfd_maps[i] = NULL;
+			return false;
+		}
+	}
+
+	s->format_fb = s->slots[0].fb;
+	return true;
+}
+
+/* Waits for the first frame, so that the stream starts with the right format */
+static bool pwsend_follow_init(pwsend_t *s, const char *helper,
+			       const char *card, uint32_t crtc_id)
+{
+#ifdef USE_PKEXEC
+	const bool use_pkexec = true;
+#else
+	const bool use_pkexec = false;
+#endif
+	if (!drmsend_client_follow(&s->client, helper, use_pkexec, card,
+				   crtc_id))
+		return false;
+
+	drmsend_frame_t frame;
+	int fd = -1;
+	if (!drmsend_client_recv_frame(&s->client, &frame, &fd))
+		return false;
+
+	pwsend_slot_t *slot = s->slots + frame.slot;
+	slot->fd = fd;
+	slot->fb = frame.fb;
+	s->format_fb = frame.fb;
+
+	MSG("Following %dx%d fourcc %#x modifier %#llx on crtc %#x",
+	    frame.fb.width, frame.fb.height, frame.fb.fourcc,
+	    (unsigned long long)frame.fb.modifier, frame.fb.crtc_id);
+	return true;
+}
+
+static void pwsend_on_signal(void *data, int signal_number)
+{
+	pwsend_t *s = data;
+	pw_main_loop_quit(s->loop);
+}
+
+static void printUsage(const char *name)
+{
+	MSG("usage: %s [--card /dev/dri/cardN] [--crtc id] [--helper path] [--name node_name]",
+	    name);
+	MSG("       %s --memfd WIDTHxHEIGHT [--fps N] [--name node_name]",
+	    name);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *card = "/dev/dri/card0";
+	const char *helper = KMSGRAB_SEND_PATH;
+	const char *node_name = "kmsgrab";
+	uint32_t crtc_id = 0;
+	int memfd_width = 0, memfd_height = 0, fps = 60;
+
+	for (int i = 1; i < argc; ++i) {
+		const char *arg = argv[i];
+		const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+		if (!value) {
+			printUsage(argv[0]);
+			return 1;
+		}
+		++i;
+
+		if (strcmp(arg, "--card") == 0)
+			card = value;
+		else if (strcmp(arg, "--crtc") == 0)
+			crtc_id = strtoul(value, NULL, 0);
+		else if (strcmp(arg, "--helper") == 0)
+			helper = value;
+		else if (strcmp(arg, "--name") == 0)
+			node_name = value;
+		else if (strcmp(arg, "--fps") == 0)
+			fps = atoi(value);
+		else if (strcmp(arg, "--memfd") == 0 &&
+			 2 == sscanf(value, "%dx%d", &memfd_width,
+				     &memfd_height))
+			continue;
+		else {
+			printUsage(argv[0]);
+			return 1;
+		}
+	}
+
+	pwsend_t s = {0};
+	s.client.fd = -1;
+	s.client.pid = -1;
+	s.memfd = memfd_width > 0 && memfd_height > 0;
+	for (int i = 0; i < OBS_DRMSEND_FOLLOW_SLOTS; ++i)
+		s.slots[i].fd = -1;
+	for (int i = 0; i < MAX_RETIRED; ++i)
+		s.retired[i].fd = -1;
+
+	int retval = 2;
+
+	/* Before PipeWire has started any threads */
+	if (s.memfd ? !pwsend_memfd_init(&s, memfd_width, memfd_height)
+		    : !pwsend_follow_init(&s, helper, card, crtc_id))
+		goto cleanup;
+
+	pw_init(&argc, &argv);
+
+	s.loop = pw_main_loop_new(NULL);
+	struct pw_loop *loop = pw_main_loop_get_loop(s.loop);
+	pw_loop_add_signal(loop, SIGINT, pwsend_on_signal, &s);
+	pw_loop_add_signal(loop, SIGTERM, pwsend_on_signal, &s);
+
+	s.stream = pw_stream_new_simple(
+		loop, node_name,
+		pw_properties_new(PW_KEY_MEDIA_CLASS, "Video/Source",
+				  PW_KEY_MEDIA_TYPE, "Video",
+				  PW_KEY_MEDIA_CATEGORY, "Capture",
+				  PW_KEY_MEDIA_ROLE, "Screen",
+				  PW_KEY_NODE_NAME, node_name, NULL),
+		&pwsend_stream_events, &s);
+
+	uint8_t buffer[1024];
+	struct spa_pod_builder b = SPA_POD_BUILDER_INIT(buffer, sizeof(buffer));
+	const struct spa_pod *params[1] = {pwsend_build_format(&s, &b)};
+	if (pw_stream_connect(s.stream, PW_DIRECTION_OUTPUT, PW_ID_ANY,
+			      PW_STREAM_FLAG_DRIVER |
+				      PW_STREAM_FLAG_ALLOC_BUFFERS,
+			      params, 1) < 0) {
+		ERR("Cannot connect PipeWire stream");
+		goto cleanup;
+	}
+
+	if (s.memfd) {
+		s.source = pw_loop_add_timer(loop, pwsend_on_memfd_timer, &s);
+		struct timespec interval = {
+			.tv_sec = 0,
+			.tv_nsec = 1000000000l / (fps > 0 ? fps : 60),
+		};
+		pw_loop_update_timer(loop, s.source, &interval, &interval,
+				     false);
+	} else {
+		s.source = pw_loop_add_io(loop, s.client.fd, SPA_IO_IN, false,
+					  pwsend_on_helper_io, &s);
+	}
+
+	pw_main_loop_run(s.loop);
+
+	MSG("Sent %llu frames, dropped %llu",
+	    (unsigned long long)s.frames_sent,
+	    (unsigned long long)s.frames_dropped);
+	retval = 0;
+
+cleanup:
+	if (s.stream)
+		pw_stream_destroy(s.stream);
+	if (s.loop)
+		pw_main_loop_destroy(s.loop);
+
+	drmsend_client_close(&s.client);
+
+	for (int i = 0; i < OBS_DRMSEND_FOLLOW_SLOTS; ++i) {
+		if (s.slots[i].fd >= 0)
+			close(s.slots[i].fd);
+	}
+	for (int i = 0; i < MAX_RETIRED; ++i) {
+		if (s.retired[i].fd >= 0)
+			close(s.retired[i].fd);
+	}
+
+	for (int i = 0; i < MEMFD_SLOTS; ++i) {
+		if (s.memfd_maps[i])
+			munmap(s.memfd_maps[i], pwsend_fb_size(&s.slots[i].fb));
+	}
+
+	return retval;
+}
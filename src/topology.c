@@ -0,0 +1,363 @@
+#include "topology.h"
+
+#include <util/platform.h>
+#include <util/threading.h>
+
+#include <stdio.h>
+#include <string.h>
+
+#include "plugin-macros.generated.h"
+
+#define TOPOLOGY_FILE "topology.json"
+
+typedef struct topology_watcher {
+	obs_weak_source_t *source;
+	dmabuf_topology_refreshed_t refreshed;
+	/* Has been handed the refreshed snapshot */
+	bool notified;
+	struct topology_watcher *next;
+} topology_watcher_t;
+
+/* Everything below is protected by topology_mutex */
+static pthread_mutex_t topology_mutex = PTHREAD_MUTEX_INITIALIZER;
+static drmsend_response_t topology_known;
+static topology_watcher_t *topology_watchers;
+static pthread_t topology_thread;
+static bool topology_thread_started;
+static bool topology_refreshing;
+
+int dmabuf_topology_find(const drmsend_response_t *resp, const char *card,
+			 const char *connector, uint32_t fb_id)
+{
+	/* fb ids don't survive compositor restarts, connectors do. Ids are
+	 * reused for whatever is allocated next, so the id of a framebuffer
+	 * that was on a connector says nothing about other connectors. */
+	const bool by_connector = connector && *connector;
+	for (int i = 0; i < resp->num_framebuffers; ++i) {
+		const drmsend_framebuffer_t *fb = resp->framebuffers + i;
+		if (fb->card_index < 0 || fb->card_index >= resp->num_cards ||
+		    strcmp(card, resp->cards[fb->card_index].path) != 0)
+			continue;
+
+		if (by_connector) {
+			if (fb->primary &&
+			    strcmp(connector, fb->connector_name) == 0)
+				return i;
+		} else if (fb->fb_id == fb_id) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+bool dmabuf_topology_lookup(const char *card, const char *connector,
+			    uint32_t fb_id, drmsend_framebuffer_t *fb)
+{
+	pthread_mutex_lock(&topology_mutex);
+	const int index =
+		dmabuf_topology_find(&topology_known, card, connector, fb_id);
+	if (index >= 0)
+		*fb = topology_known.framebuffers[index];
+	pthread_mutex_unlock(&topology_mutex);
+
+	return index >= 0;
+}
+
+static void topology_load(void)
+{
+	char *path = obs_module_config_path(TOPOLOGY_FILE);
+	obs_data_t *data =
+		path ? obs_data_create_from_json_file_safe(path, "bak") : NULL;
+	bfree(path);
+	if (!data)
+		return;
+
+	drmsend_response_t *resp = &topology_known;
+	memset(resp, 0, sizeof(*resp));
+
+	obs_data_array_t *cards = obs_data_get_array(data, "cards");
+	const size_t num_cards = obs_data_array_count(cards);
+	for (size_t i = 0; i < num_cards && i < OBS_DRMSEND_MAX_CARDS; ++i) {
+		obs_data_t *item = obs_data_array_item(cards, i);
+		snprintf(resp->cards[i].path, sizeof(resp->cards[i].path),
+			 "%s", obs_data_get_string(item, "path"));
+		resp->num_cards++;
+		obs_data_release(item);
+	}
+	obs_data_array_release(cards);
+
+	obs_data_array_t *fbs = obs_data_get_array(data, "framebuffers");
+	const size_t num_fbs = obs_data_array_count(fbs);
+	for (size_t i = 0; i < num_fbs && i < OBS_DRMSEND_MAX_FRAMEBUFFERS;
+	     ++i) {
+		obs_data_t *item = obs_data_array_item(fbs, i);
+		drmsend_framebuffer_t *fb =
+			resp->framebuffers + resp->num_framebuffers;
+		fb->card_index = obs_data_get_int(item, "card_index");
+		fb->fb_id = obs_data_get_int(item, "fb_id");
+		fb->width = obs_data_get_int(item, "width");
+		fb->height = obs_data_get_int(item, "height");
+		fb->fourcc = obs_data_get_int(item, "fourcc");
+		fb->modifier = obs_data_get_int(item, "modifier");
+		fb->offset = obs_data_get_int(item, "offset");
+		fb->pitch = obs_data_get_int(item, "pitch");
+		fb->crtc_id = obs_data_get_int(item, "crtc_id");
+		fb->connector_id = obs_data_get_int(item, "connector_id");
+		snprintf(fb->connector_name, sizeof(fb->connector_name), "%s",
+			 obs_data_get_string(item, "connector"));
+		fb->crtc_x = obs_data_get_int(item, "crtc_x");
+		fb->crtc_y = obs_data_get_int(item, "crtc_y");
+		fb->crtc_width = obs_data_get_int(item, "crtc_width");
+		fb->crtc_height = obs_data_get_int(item, "crtc_height");
+		fb->primary = obs_data_get_bool(item, "primary");
+		fb->rotation = obs_data_get_int(item, "rotation");
+		fb->src_x = obs_data_get_int(item, "src_x");
+		fb->src_y = obs_data_get_int(item, "src_y");
+		fb->src_width = obs_data_get_int(item, "src_width");
+		fb->src_height = obs_data_get_int(item, "src_height");
+		fb->dst_x = obs_data_get_int(item, "dst_x");
+		fb->dst_y = obs_data_get_int(item, "dst_y");
+		fb->dst_width = obs_data_get_int(item, "dst_width");
+		fb->dst_height = obs_data_get_int(item, "dst_height");
+		if (fb->card_index >= 0 && fb->card_index < resp->num_cards)
+			resp->num_framebuffers++;
+		obs_data_release(item);
+	}
+	obs_data_array_release(fbs);
+
+	obs_data_release(data);
+
+	blog(LOG_INFO, "Loaded %d cached framebuffers on %d cards",
+	     resp->num_framebuffers, resp->num_cards);
+}
+
+static void topology_save(const drmsend_response_t *resp)
+{
+	char *dir = obs_module_config_path("");
+	char *path = obs_module_config_path(TOPOLOGY_FILE);
+	if (!dir || !path)
+		goto cleanup;
+
+	os_mkdirs(dir);
+
+	obs_data_t *data = obs_data_create();
+
+	obs_data_array_t *cards = obs_data_array_create();
+	for (int i = 0; i < resp->num_cards; ++i) {
+		obs_data_t *item = obs_data_create();
+		obs_data_set_string(item, "path", resp->cards[i].path);
+		obs_data_array_push_back(cards, item);
+		obs_data_release(item);
+	}
+	obs_data_set_array(data, "cards", cards);
+	obs_data_array_release(cards);
+
+	obs_data_array_t *fbs = obs_data_array_create();
+	for (int i = 0; i < resp->num_framebuffers; ++i) {
+		const drmsend_framebuffer_t *fb = resp->framebuffers + i;
+		obs_data_t *item = obs_data_create();
+		obs_data_set_int(item, "card_index", fb->card_index);
+		obs_data_set_int(item, "fb_id", fb->fb_id);
+		obs_data_set_int(item, "width", fb->width);
+		obs_data_set_int(item, "height", fb->height);
+		obs_data_set_int(item, "fourcc", fb->fourcc);
+		obs_data_set_int(item, "modifier", (long long)fb->modifier);
+		obs_data_set_int(item, "offset", fb->offset);
+		obs_data_set_int(item, "pitch", fb->pitch);
+		obs_data_set_int(item, "crtc_id", fb->crtc_id);
+		obs_data_set_int(item, "connector_id", fb->connector_id);
+		obs_data_set_string(item, "connector", fb->connector_name);
+		obs_data_set_int(item, "crtc_x", fb->crtc_x);
+		obs_data_set_int(item, "crtc_y", fb->crtc_y);
+		obs_data_set_int(item, "crtc_width", fb->crtc_width);
+		obs_data_set_int(item, "crtc_height", fb->crtc_height);
+		obs_data_set_bool(item, "primary", fb->primary);
+		obs_data_set_int(item, "rotation", fb->rotation);
+		obs_data_set_int(item, "src_x", fb->src_x);
+		obs_data_set_int(item, "src_y", fb->src_y);
+		obs_data_set_int(item, "src_width", fb->src_width);
+		obs_data_set_int(item, "src_height", fb->src_height);
+		obs_data_set_int(item, "dst_x", fb->dst_x);
+		obs_data_set_int(item, "dst_y", fb->dst_y);
+		obs_data_set_int(item, "dst_width", fb->dst_width);
+		obs_data_set_int(item, "dst_height", fb->dst_height);
+		obs_data_array_push_back(fbs, item);
+		obs_data_release(item);
+	}
+	obs_data_set_array(data, "framebuffers", fbs);
+	obs_data_array_release(fbs);
+
+	if (!obs_data_save_json_safe(data, path, "tmp", "bak"))
+		blog(LOG_WARNING, "Cannot save topology to %s", path);
+
+	obs_data_release(data);
+
+cleanup:
+	bfree(dir);
+	bfree(path);
+}
+
+typedef struct topology_target {
+	obs_source_t *source;
+	dmabuf_topology_refreshed_t refreshed;
+	struct topology_target *next;
+} topology_target_t;
+
+/* Sources that are still alive and have not been notified yet, referenced
+ * so that they stay so. Once there are none, the refresh is over. Must be
+ * called with topology_mutex held. */
+static topology_target_t *topology_take_targets(void)
+{
+	topology_target_t *targets = NULL;
+	for (topology_watcher_t *w = topology_watchers; w; w = w->next) {
+		if (w->notified)
+			continue;
+
+		w->notified = true;
+		obs_source_t *source = obs_weak_source_get_source(w->source);
+		if (!source)
+			continue;
+
+		topology_target_t *t = bzalloc(sizeof(*t));
+		t->source = source;
+		t->refreshed = w->refreshed;
+		t->next = targets;
+		targets = t;
+	}
+
+	if (!targets)
+		topology_refreshing = false;
+
+	return targets;
+}
+
+/* Hands the snapshot to every live watcher. Runs on the refresh thread
+ * rather than as a UI task, which libobs drops when there is no UI to run
+ * it. The refresh is reported as ongoing until all of them have been
+ * handed it, so that their updates meanwhile don't each start a helper
+ * run, and sources that start watching meanwhile are handed it too. */
+static void topology_notify(dmabuf_fblist_t *list)
+{
+
+	for (;;) {
+		pthread_mutex_lock(&topology_mutex);
+		topology_target_t *targets = topology_take_targets();
+		pthread_mutex_unlock(&topology_mutex);
+
+		if (!targets)
+			break;
+
+		while (targets) {
+			topology_target_t *t = targets;
+			targets = t->next;
+
+			t->refreshed(obs_obj_get_data(t->source), list);
+			obs_source_release(t->source);
+			bfree(t);
+		}
+	}
+
+	/* Sources have picked theirs, don't keep every other scanout buffer
+	 * pinned */
+	dmabuf_fblist_release(list);
+}
+
+static void *topology_refresh_thread(void *param)
+{
+	UNUSED_PARAMETER(param);
+	os_set_thread_name("kmsgrab-topology");
+
+	char cards[OBS_DRMSEND_MAX_CARDS][32];
+	const char *card_ptrs[OBS_DRMSEND_MAX_CARDS];
+	const int num_cards =
+		dmabuf_fblist_list_cards(cards, OBS_DRMSEND_MAX_CARDS);
+	for (int i = 0; i < num_cards; ++i)
+		card_ptrs[i] = cards[i];
+
+	dmabuf_fblist_t *list =
+		num_cards ? dmabuf_fblist_receive(card_ptrs, num_cards) : NULL;
+
+	pthread_mutex_lock(&topology_mutex);
+	if (list)
+		topology_known = list->resp;
+	pthread_mutex_unlock(&topology_mutex);
+
+	if (list)
+		topology_save(&list->resp);
+
+	topology_notify(list);
+	return NULL;
+}
+
+void dmabuf_topology_watch(obs_source_t *source,
+			   dmabuf_topology_refreshed_t refreshed)
+{
+	topology_watcher_t *w = bzalloc(sizeof(*w));
+	w->source = obs_source_get_weak_source(source);
+	w->refreshed = refreshed;
+
+	pthread_mutex_lock(&topology_mutex);
+	w->next = topology_watchers;
+	topology_watchers = w;
+
+	if (!topology_thread_started) {
+		topology_refreshing = true;
+		topology_thread_started =
+			0 == pthread_create(&topology_thread, NULL,
+					    topology_refresh_thread, NULL);
+		if (!topology_thread_started) {
+			blog(LOG_ERROR, "Cannot start topology refresh thread");
+			topology_refreshing = false;
+		}
+	}
+	pthread_mutex_unlock(&topology_mutex);
+}
+
+void dmabuf_topology_unwatch(obs_source_t *source)
+{
+	pthread_mutex_lock(&topology_mutex);
+	for (topology_watcher_t **it = &topology_watchers; *it;
+	     it = &(*it)->next) {
+		topology_watcher_t *w = *it;
+		if (!obs_weak_source_references_source(w->source, source))
+			continue;
+
+		*it = w->next;
+		obs_weak_source_release(w->source);
+		bfree(w);
+		break;
+	}
+	pthread_mutex_unlock(&topology_mutex);
+}
+
+bool dmabuf_topology_refreshing(void)
+{
+	pthread_mutex_lock(&topology_mutex);
+	const bool refreshing = topology_refreshing;
+	pthread_mutex_unlock(&topology_mutex);
+	return refreshing;
+}
+
+void dmabuf_topology_init(void)
+{
+	pthread_mutex_lock(&topology_mutex);
+	topology_load();
+	pthread_mutex_unlock(&topology_mutex);
+}
+
+void dmabuf_topology_free(void)
+{
+	if (topology_thread_started)
+		pthread_join(topology_thread, NULL);
+	topology_thread_started = false;
+
+	pthread_mutex_lock(&topology_mutex);
+	while (topology_watchers) {
+		topology_watcher_t *w = topology_watchers;
+		topology_watchers = w->next;
+		obs_weak_source_release(w->source);
+		bfree(w);
+	}
+	pthread_mutex_unlock(&topology_mutex);
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include "fblist.h"
+
+#include <obs-module.h>
+
+/* Last known DRM/KMS topology, shared by all sources. It is loaded from the
+ * module config directory at startup, so that sources know their size and
+ * output before anything is enumerated, and refreshed by a single
+ * background helper run for all of them. */
+
+void dmabuf_topology_init(void);
+void dmabuf_topology_free(void);
+
+/* Called on the refresh thread with the refreshed snapshot, list is NULL if
+ * enumeration failed */
+typedef void (*dmabuf_topology_refreshed_t)(void *data,
+					    dmabuf_fblist_t *list);
+
+/**
+ * Makes refreshed get called for source once a background refresh
+ * completes. The first watch of a session starts the refresh.
+ */
+void dmabuf_topology_watch(obs_source_t *source,
+			   dmabuf_topology_refreshed_t refreshed);
+void dmabuf_topology_unwatch(obs_source_t *source);
+
+/**
+ * @return true while the background refresh has not completed yet
+ */
+bool dmabuf_topology_refreshing(void);
+
+/**
+ * Finds framebuffer that is selected by connector or fb_id on card:
+ * primary plane of connector if one is given, fb_id only if not
+ *
+ * @return index in resp->framebuffers, -1 if there is none
+ */
+int dmabuf_topology_find(const drmsend_response_t *resp, const char *card,
+			 const char *connector, uint32_t fb_id);
+
+/**
+ * Looks selection up in the last known topology
+ *
+ * @return false if it is not known
+ */
+bool dmabuf_topology_lookup(const char *card, const char *connector,
+			    uint32_t fb_id, drmsend_framebuffer_t *fb);
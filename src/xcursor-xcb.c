@@ -21,6 +21,9 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <util/bmem.h>
 #include "xcursor-xcb.h"
 
+/* Don't guess further ahead than about a frame */
+#define MAX_EXTRAPOLATION_NS 20000000ULL
+
 /*
  * Create the cursor texture, either by updating if the new cursor has the same
  * size or by creating a new texture if the size is different
@@ -74,7 +77,8 @@ void xcb_xcursor_destroy(xcb_xcursor_t *data)
 }
 
 void xcb_xcursor_update(xcb_xcursor_t *data,
-			xcb_xfixes_get_cursor_image_reply_t *xc)
+			xcb_xfixes_get_cursor_image_reply_t *xc,
+			uint64_t timestamp_ns)
 {
 	if (!data || !xc)
 		return;
@@ -84,8 +88,74 @@ void xcb_xcursor_update(xcb_xcursor_t *data,
 
 	data->x = xc->x - data->x_org;
 	data->y = xc->y - data->y_org;
+	data->xhot = xc->xhot;
+	data->yhot = xc->yhot;
 	data->x_render = data->x - xc->xhot;
 	data->y_render = data->y - xc->yhot;
+
+	xcb_xcursor_sample_t *sample = data->samples + data->next_sample;
+	sample->timestamp_ns = timestamp_ns;
+	sample->x = data->x;
+	sample->y = data->y;
+	data->next_sample = (data->next_sample + 1) % XCB_XCURSOR_SAMPLES;
+	if (data->num_samples < XCB_XCURSOR_SAMPLES)
+		data->num_samples++;
+}
+
+static const xcb_xcursor_sample_t *xcb_xcursor_sample(xcb_xcursor_t *data,
+						      unsigned int age)
+{
+	return data->samples +
+	       (data->next_sample + XCB_XCURSOR_SAMPLES - 1 - age) %
+		       XCB_XCURSOR_SAMPLES;
+}
+
+void xcb_xcursor_sample_at(xcb_xcursor_t *data, uint64_t timestamp_ns)
+{
+	if (!data->num_samples)
+		return;
+
+	/* Closest samples before and after timestamp_ns */
+	const xcb_xcursor_sample_t *before = NULL, *after = NULL;
+	unsigned int age = 0;
+	for (; age < data->num_samples; ++age) {
+		const xcb_xcursor_sample_t *s = xcb_xcursor_sample(data, age);
+		if (s->timestamp_ns <= timestamp_ns) {
+			before = s;
+			break;
+		}
+		after = s;
+	}
+
+	float x, y;
+	if (!before) {
+		/* Older than anything we have */
+		x = after->x;
+		y = after->y;
+	} else if (after || age + 1 >= data->num_samples) {
+		const xcb_xcursor_sample_t *to = after ? after : before;
+		const uint64_t span = to->timestamp_ns - before->timestamp_ns;
+		const float t = span ? (float)(timestamp_ns -
+					      before->timestamp_ns) /
+					       span
+				     : 0.f;
+		x = before->x + (to->x - before->x) * t;
+		y = before->y + (to->y - before->y) * t;
+	} else {
+		/* Newer than the latest sample, continue its motion */
+		const xcb_xcursor_sample_t *prev =
+			xcb_xcursor_sample(data, age + 1);
+		const uint64_t span = before->timestamp_ns - prev->timestamp_ns;
+		uint64_t ahead = timestamp_ns - before->timestamp_ns;
+		if (ahead > MAX_EXTRAPOLATION_NS)
+			ahead = MAX_EXTRAPOLATION_NS;
+		const float t = span ? (float)ahead / span : 0.f;
+		x = before->x + (before->x - prev->x) * t;
+		y = before->y + (before->y - prev->y) * t;
+	}
+
+	data->x_render = x - data->xhot;
+	data->y_render = y - data->yhot;
 }
 
 void xcb_xcursor_render(xcb_xcursor_t *data)
@@ -24,6 +24,14 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 extern "C" {
 #endif
 
+#define XCB_XCURSOR_SAMPLES 8
+
+typedef struct {
+	uint64_t timestamp_ns;
+	int x;
+	int y;
+} xcb_xcursor_sample_t;
+
 typedef struct {
 	unsigned int last_serial;
 	unsigned int last_width;
@@ -34,8 +42,15 @@ typedef struct {
 	int y;
 	int x_org;
 	int y_org;
+	int xhot;
+	int yhot;
 	float x_render;
 	float y_render;
+
+	/* Recent positions, ring buffer ordered by time */
+	xcb_xcursor_sample_t samples[XCB_XCURSOR_SAMPLES];
+	unsigned int num_samples;
+	unsigned int next_sample;
 } xcb_xcursor_t;
 
 /**
@@ -55,12 +70,21 @@ void xcb_xcursor_destroy(xcb_xcursor_t *data);
  * Update the cursor data
  * @param data xcursor object
  * @param xc xcb cursor image reply
+ * @param timestamp_ns when the position was sampled, os_gettime_ns() clock
  *
  * @note This needs to be executed within a valid render context
  *
  */
 void xcb_xcursor_update(xcb_xcursor_t *data,
-			xcb_xfixes_get_cursor_image_reply_t *xc);
+			xcb_xfixes_get_cursor_image_reply_t *xc,
+			uint64_t timestamp_ns);
+
+/**
+ * Render the cursor where it was at timestamp_ns instead of the latest
+ * position, interpolating between samples or extrapolating a little past
+ * the latest one
+ */
+void xcb_xcursor_sample_at(xcb_xcursor_t *data, uint64_t timestamp_ns);
 
 /**
  * Draw the cursor
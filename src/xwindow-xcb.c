@@ -0,0 +1,660 @@
+#include "xwindow-xcb.h"
+
+#include <xcb/randr.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_CLIENT_WINDOWS 256
+/* Top-level windows stacked above the followed one that are checked for
+ * overlap */
+#define MAX_STACKED_ABOVE 256
+
+static xcb_window_t xcb_xwindow_root(xcb_connection_t *xcb)
+{
+	return xcb_setup_roots_iterator(xcb_get_setup(xcb)).data->root;
+}
+
+static xcb_atom_t xcb_xwindow_atom(xcb_connection_t *xcb, const char *name)
+{
+	xcb_intern_atom_reply_t *reply = xcb_intern_atom_reply(
+		xcb, xcb_intern_atom(xcb, 0, strlen(name), name), NULL);
+	const xcb_atom_t atom = reply ? reply->atom : XCB_ATOM_NONE;
+	free(reply);
+	return atom;
+}
+
+/* Copies property value as a string, which it isn't necessarily terminated
+ * as */
+static void xcb_xwindow_copy_string(char *buf, size_t size,
+				    xcb_get_property_reply_t *reply,
+				    size_t skip)
+{
+	buf[0] = '\0';
+	if (!reply)
+		return;
+
+	const char *value = xcb_get_property_value(reply);
+	const size_t len = xcb_get_property_value_length(reply);
+	if (skip >= len)
+		return;
+
+	snprintf(buf, size, "%.*s", (int)(len - skip), value + skip);
+}
+
+/* WM_CLASS is "instance\0class\0", copies the class */
+static void xcb_xwindow_copy_class(char *buf, size_t size,
+				   xcb_get_property_reply_t *reply)
+{
+	const size_t instance_len =
+		reply ? strnlen(xcb_get_property_value(reply),
+				xcb_get_property_value_length(reply)) +
+				1
+		      : 0;
+	xcb_xwindow_copy_string(buf, size, reply, instance_len);
+}
+
+static xcb_get_property_cookie_t xcb_xwindow_get_class(xcb_connection_t *xcb,
+							xcb_window_t window)
+{
+	return xcb_get_property(xcb, 0, window, XCB_ATOM_WM_CLASS,
+				XCB_ATOM_STRING, 0, 32);
+}
+
+/* _NET_CLIENT_LIST of root, NULL if there is none */
+static xcb_get_property_reply_t *
+xcb_xwindow_client_list(xcb_connection_t *xcb, xcb_window_t root,
+			xcb_atom_t client_list)
+{
+	return xcb_get_property_reply(
+		xcb,
+		xcb_get_property(xcb, 0, root, client_list, XCB_ATOM_WINDOW, 0,
+				 MAX_CLIENT_WINDOWS),
+		NULL);
+}
+
+int xcb_xwindow_list(xcb_connection_t *xcb, xcb_xwindow_info_t *windows,
+		     int max)
+{
+	if (!xcb || xcb_connection_has_error(xcb))
+		return 0;
+
+	const xcb_window_t root = xcb_xwindow_root(xcb);
+	const xcb_atom_t client_list = xcb_xwindow_atom(xcb, "_NET_CLIENT_LIST");
+	const xcb_atom_t net_wm_name = xcb_xwindow_atom(xcb, "_NET_WM_NAME");
+	const xcb_atom_t utf8_string = xcb_xwindow_atom(xcb, "UTF8_STRING");
+
+	xcb_get_property_reply_t *list =
+		xcb_xwindow_client_list(xcb, root, client_list);
+	if (!list)
+		return 0;
+
+	const xcb_window_t *ids = xcb_get_property_value(list);
+	int count = xcb_get_property_value_length(list) / sizeof(*ids);
+	if (count > max)
+		count = max;
+
+	/* Ask for everything at once, then collect */
+	xcb_get_property_cookie_t names[MAX_CLIENT_WINDOWS];
+	xcb_get_property_cookie_t classes[MAX_CLIENT_WINDOWS];
+	for (int i = 0; i < count; ++i) {
+		names[i] = xcb_get_property(xcb, 0, ids[i], net_wm_name,
+					    utf8_string, 0, 64);
+		classes[i] = xcb_xwindow_get_class(xcb, ids[i]);
+	}
+
+	for (int i = 0; i < count; ++i) {
+		xcb_xwindow_info_t *info = windows + i;
+		info->id = ids[i];
+
+		xcb_get_property_reply_t *name =
+			xcb_get_property_reply(xcb, names[i], NULL);
+		xcb_xwindow_copy_string(info->name, sizeof(info->name), name, 0);
+		free(name);
+
+		xcb_get_property_reply_t *wm_class =
+			xcb_get_property_reply(xcb, classes[i], NULL);
+		xcb_xwindow_copy_class(info->wm_class, sizeof(info->wm_class),
+				       wm_class);
+		free(wm_class);
+
+		if (!info->name[0]) {
+			xcb_get_property_reply_t *wm_name = xcb_get_property_reply(
+				xcb,
+				xcb_get_property(xcb, 0, ids[i],
+						 XCB_ATOM_WM_NAME,
+						 XCB_ATOM_STRING, 0, 64),
+				NULL);
+			xcb_xwindow_copy_string(info->name, sizeof(info->name),
+						wm_name, 0);
+			free(wm_name);
+		}
+	}
+
+	free(list);
+	return count;
+}
+
+static xcb_window_t xcb_xwindow_find_in(xcb_connection_t *xcb,
+					xcb_window_t root,
+					xcb_atom_t client_list,
+					xcb_window_t id, const char *wm_class)
+{
+	if (!id && (!wm_class || !*wm_class))
+		return 0;
+
+	xcb_get_property_reply_t *list =
+		xcb_xwindow_client_list(xcb, root, client_list);
+	if (!list)
+		return 0;
+
+	const xcb_window_t *ids = xcb_get_property_value(list);
+	int count = xcb_get_property_value_length(list) / sizeof(*ids);
+	if (count > MAX_CLIENT_WINDOWS)
+		count = MAX_CLIENT_WINDOWS;
+
+	/* Only classes are needed, names are left alone */
+	xcb_get_property_cookie_t *classes =
+		malloc(sizeof(*classes) * (count ? count : 1));
+	if (!classes) {
+		free(list);
+		return 0;
+	}
+	for (int i = 0; i < count; ++i)
+		classes[i] = xcb_xwindow_get_class(xcb, ids[i]);
+
+	xcb_window_t found = 0, same_class = 0;
+	for (int i = 0; i < count; ++i) {
+		xcb_get_property_reply_t *reply =
+			xcb_get_property_reply(xcb, classes[i], NULL);
+		if (found) {
+			free(reply);
+			continue;
+		}
+
+		char window_class[sizeof(((xcb_xwindow_info_t *)0)->wm_class)];
+		xcb_xwindow_copy_class(window_class, sizeof(window_class),
+				       reply);
+		free(reply);
+
+		const bool class_matches =
+			!wm_class || !*wm_class ||
+			strcmp(wm_class, window_class) == 0;
+		if (ids[i] == id && class_matches)
+			found = id;
+		else if (!same_class && wm_class && *wm_class && class_matches)
+			same_class = ids[i];
+	}
+
+	free(classes);
+	free(list);
+	return found ? found : same_class;
+}
+
+xcb_window_t xcb_xwindow_find(xcb_connection_t *xcb, xcb_window_t id,
+			      const char *wm_class)
+{
+	if (!xcb || xcb_connection_has_error(xcb))
+		return 0;
+
+	return xcb_xwindow_find_in(xcb, xcb_xwindow_root(xcb),
+				   xcb_xwindow_atom(xcb, "_NET_CLIENT_LIST"),
+				   id, wm_class);
+}
+
+/* Top-level ancestor of window, i.e. the child of root it is in */
+static xcb_window_t xcb_xwindow_frame(xcb_connection_t *xcb,
+				      xcb_window_t root, xcb_window_t window)
+{
+	while (window) {
+		xcb_query_tree_reply_t *tree = xcb_query_tree_reply(
+			xcb, xcb_query_tree(xcb, window), NULL);
+		if (!tree)
+			return 0;
+
+		const xcb_window_t parent = tree->parent;
+		free(tree);
+
+		if (parent == root || !parent)
+			return window;
+		window = parent;
+	}
+
+	return 0;
+}
+
+static void xcb_xwindow_select(xcb_xwindow_t *xw, bool enable)
+{
+	const uint32_t structure =
+		enable ? XCB_EVENT_MASK_STRUCTURE_NOTIFY : 0;
+
+	xcb_change_window_attributes(xw->xcb, xw->window, XCB_CW_EVENT_MASK,
+				     &structure);
+	if (xw->frame && xw->frame != xw->window)
+		xcb_change_window_attributes(xw->xcb, xw->frame,
+					     XCB_CW_EVENT_MASK, &structure);
+	xcb_flush(xw->xcb);
+}
+
+/* Stacking order of top-level windows while following one, and new ones
+ * while waiting for one of wm_class to show up */
+static void xcb_xwindow_select_root(xcb_xwindow_t *xw, bool enable)
+{
+	uint32_t mask = 0;
+	if (enable)
+		mask = xw->window ? XCB_EVENT_MASK_SUBSTRUCTURE_NOTIFY
+				  : XCB_EVENT_MASK_SUBSTRUCTURE_NOTIFY |
+					    XCB_EVENT_MASK_PROPERTY_CHANGE;
+
+	xcb_change_window_attributes(xw->xcb, xw->root, XCB_CW_EVENT_MASK,
+				     &mask);
+	xcb_flush(xw->xcb);
+}
+
+static bool xcb_xwindow_attach(xcb_xwindow_t *xw, xcb_window_t window)
+{
+	xw->frame = window ? xcb_xwindow_frame(xw->xcb, xw->root, window) : 0;
+	if (!xw->frame)
+		return false;
+
+	xw->window = window;
+	xw->dirty = true;
+	xcb_xwindow_select(xw, true);
+	return true;
+}
+
+bool xcb_xwindow_follow(xcb_xwindow_t *xw, xcb_connection_t *xcb,
+			xcb_window_t window, const char *wm_class)
+{
+	memset(xw, 0, sizeof(*xw));
+	if (!xcb || xcb_connection_has_error(xcb) ||
+	    (!window && (!wm_class || !*wm_class)))
+		return false;
+
+	xw->xcb = xcb;
+	xw->root = xcb_xwindow_root(xcb);
+	if (wm_class)
+		snprintf(xw->wm_class, sizeof(xw->wm_class), "%s", wm_class);
+
+	const bool found = xcb_xwindow_attach(xw, window);
+	if (!found && !xw->wm_class[0]) {
+		memset(xw, 0, sizeof(*xw));
+		return false;
+	}
+
+	if (xw->wm_class[0])
+		xw->client_list = xcb_xwindow_atom(xcb, "_NET_CLIENT_LIST");
+	xcb_xwindow_select_root(xw, true);
+	return found;
+}
+
+void xcb_xwindow_unfollow(xcb_xwindow_t *xw)
+{
+	if (xw->window)
+		xcb_xwindow_select(xw, false);
+	if (xw->root)
+		xcb_xwindow_select_root(xw, false);
+	memset(xw, 0, sizeof(*xw));
+}
+
+/* Whether any viewable top-level window above frame overlaps the followed
+ * window */
+static bool xcb_xwindow_is_obscured(xcb_xwindow_t *xw)
+{
+	xcb_query_tree_reply_t *tree = xcb_query_tree_reply(
+		xw->xcb, xcb_query_tree(xw->xcb, xw->root), NULL);
+	if (!tree)
+		return false;
+
+	/* Children are listed bottom to top */
+	const xcb_window_t *children = xcb_query_tree_children(tree);
+	const int num_children = xcb_query_tree_children_length(tree);
+	int above = 0;
+	while (above < num_children && children[above] != xw->frame)
+		++above;
+	++above;
+
+	int count = num_children - above;
+	if (count > MAX_STACKED_ABOVE)
+		count = MAX_STACKED_ABOVE;
+
+	xcb_get_window_attributes_cookie_t attrs[MAX_STACKED_ABOVE];
+	xcb_get_geometry_cookie_t geoms[MAX_STACKED_ABOVE];
+	for (int i = 0; i < count; ++i) {
+		attrs[i] = xcb_get_window_attributes(xw->xcb,
+						     children[above + i]);
+		geoms[i] = xcb_get_geometry(xw->xcb, children[above + i]);
+	}
+
+	bool obscured = false;
+	for (int i = 0; i < count; ++i) {
+		xcb_get_window_attributes_reply_t *attr =
+			xcb_get_window_attributes_reply(xw->xcb, attrs[i],
+							NULL);
+		xcb_get_geometry_reply_t *geom =
+			xcb_get_geometry_reply(xw->xcb, geoms[i], NULL);
+
+		if (attr && geom &&
+		    attr->map_state == XCB_MAP_STATE_VIEWABLE) {
+			const int border = geom->border_width * 2;
+			obscured |= geom->x < xw->x + xw->width &&
+				    geom->x + geom->width + border > xw->x &&
+				    geom->y < xw->y + xw->height &&
+				    geom->y + geom->height + border > xw->y;
+		}
+
+		free(attr);
+		free(geom);
+	}
+
+	free(tree);
+	return obscured;
+}
+
+static void xcb_xwindow_refresh(xcb_xwindow_t *xw)
+{
+	xcb_translate_coordinates_cookie_t pos_c = xcb_translate_coordinates(
+		xw->xcb, xw->window, xw->root, 0, 0);
+	xcb_get_geometry_cookie_t geom_c = xcb_get_geometry(xw->xcb, xw->window);
+	xcb_get_window_attributes_cookie_t attr_c =
+		xcb_get_window_attributes(xw->xcb, xw->window);
+
+	xcb_translate_coordinates_reply_t *pos =
+		xcb_translate_coordinates_reply(xw->xcb, pos_c, NULL);
+	xcb_get_geometry_reply_t *geom =
+		xcb_get_geometry_reply(xw->xcb, geom_c, NULL);
+	xcb_get_window_attributes_reply_t *attr =
+		xcb_get_window_attributes_reply(xw->xcb, attr_c, NULL);
+
+	if (pos && geom && attr) {
+		xw->x = pos->dst_x;
+		xw->y = pos->dst_y;
+		xw->width = geom->width;
+		xw->height = geom->height;
+		xw->mapped = attr->map_state == XCB_MAP_STATE_VIEWABLE;
+		xw->obscured = xw->mapped && xcb_xwindow_is_obscured(xw);
+	} else {
+		xw->mapped = false;
+	}
+
+	free(pos);
+	free(geom);
+	free(attr);
+}
+
+static bool xcb_xwindow_is_followed(const xcb_xwindow_t *xw,
+				    xcb_window_t window)
+{
+	return window && (window == xw->window || window == xw->frame);
+}
+
+/* Whether another top-level window that has been configured to be at
+ * x, y, width, height may have started or stopped obscuring the followed
+ * one */
+static bool xcb_xwindow_may_obscure(const xcb_xwindow_t *xw,
+				    const xcb_configure_notify_event_t *ev)
+{
+	const int border = ev->border_width * 2;
+	return xw->obscured ||
+	       (ev->x < xw->x + xw->width &&
+		ev->x + ev->width + border > xw->x &&
+		ev->y < xw->y + xw->height &&
+		ev->y + ev->height + border > xw->y);
+}
+
+bool xcb_xwindow_poll(xcb_xwindow_t *xw)
+{
+	if (!xw->root)
+		return false;
+
+	bool destroyed = false;
+	/* A window of wm_class may have shown up */
+	bool appeared = false;
+	xcb_generic_event_t *ev;
+	while ((ev = xcb_poll_for_event(xw->xcb))) {
+		switch (ev->response_type & ~0x80) {
+		case XCB_DESTROY_NOTIFY:
+			destroyed |= xw->window &&
+				     ((xcb_destroy_notify_event_t *)ev)
+						     ->window == xw->window;
+			break;
+		case XCB_REPARENT_NOTIFY:
+			/* Window manager has (re)framed it */
+			if (xw->window &&
+			    ((xcb_reparent_notify_event_t *)ev)->window ==
+				    xw->window) {
+				xcb_xwindow_select(xw, false);
+				xw->frame = xcb_xwindow_frame(
+					xw->xcb, xw->root, xw->window);
+				xcb_xwindow_select(xw, true);
+				xw->dirty = true;
+			} else {
+				xw->restacked = true;
+			}
+			break;
+		case XCB_CONFIGURE_NOTIFY: {
+			/* Root reports every top-level window, only the
+			 * followed one needs its geometry queried again */
+			const xcb_configure_notify_event_t *configure =
+				(xcb_configure_notify_event_t *)ev;
+			if (xcb_xwindow_is_followed(xw, configure->window))
+				xw->dirty = true;
+			else if (xw->window &&
+				 xcb_xwindow_may_obscure(xw, configure))
+				xw->restacked = true;
+			break;
+		}
+		case XCB_GRAVITY_NOTIFY:
+			if (xcb_xwindow_is_followed(
+				    xw, ((xcb_gravity_notify_event_t *)ev)
+						->window))
+				xw->dirty = true;
+			break;
+		case XCB_MAP_NOTIFY:
+			if (xcb_xwindow_is_followed(
+				    xw,
+				    ((xcb_map_notify_event_t *)ev)->window))
+				xw->dirty = true;
+			else
+				xw->restacked = true;
+			appeared = true;
+			break;
+		case XCB_UNMAP_NOTIFY:
+			if (xcb_xwindow_is_followed(
+				    xw,
+				    ((xcb_unmap_notify_event_t *)ev)->window))
+				xw->dirty = true;
+			else
+				xw->restacked = true;
+			break;
+		case XCB_CIRCULATE_NOTIFY:
+			xw->restacked = true;
+			break;
+		case XCB_CREATE_NOTIFY:
+			appeared = true;
+			break;
+		case XCB_PROPERTY_NOTIFY:
+			appeared |= ((xcb_property_notify_event_t *)ev)->atom ==
+				    xw->client_list;
+			break;
+		}
+		free(ev);
+	}
+
+	const xcb_window_t followed = xw->window;
+	if (destroyed) {
+		xw->window = xw->frame = 0;
+		xw->width = xw->height = 0;
+		xw->mapped = xw->obscured = xw->dirty = xw->restacked = false;
+		if (!xw->wm_class[0]) {
+			xcb_xwindow_select_root(xw, false);
+			xw->root = 0;
+			return true;
+		}
+
+		/* Wait for it to be reopened */
+		xcb_xwindow_select_root(xw, true);
+		appeared = true;
+	}
+
+	if (!xw->window) {
+		if (!appeared)
+			return destroyed;
+
+		const xcb_window_t window = xcb_xwindow_find_in(
+			xw->xcb, xw->root, xw->client_list, 0, xw->wm_class);
+		if (!xcb_xwindow_attach(xw, window))
+			return destroyed;
+
+		xcb_xwindow_select_root(xw, true);
+	}
+
+	if (xw->dirty) {
+		const xcb_xwindow_t before = *xw;
+		xw->dirty = xw->restacked = false;
+		xcb_xwindow_refresh(xw);
+		return followed != xw->window || before.x != xw->x || before.y != xw->y ||
+		       before.width != xw->width ||
+		       before.height != xw->height ||
+		       before.mapped != xw->mapped ||
+		       before.obscured != xw->obscured;
+	}
+
+	if (xw->restacked) {
+		xw->restacked = false;
+		const bool obscured = xw->obscured;
+		xw->obscured = xw->mapped && xcb_xwindow_is_obscured(xw);
+		return obscured != xw->obscured;
+	}
+
+	return false;
+}
+
+/* Kernel connector id that KMS based drivers (modesetting, amdgpu, ...)
+ * attach to RandR outputs, 0 if output has none */
+static uint32_t xcb_xwindow_connector_id(xcb_connection_t *xcb,
+					 xcb_randr_output_t output,
+					 xcb_atom_t atom)
+{
+	if (atom == XCB_ATOM_NONE)
+		return 0;
+
+	xcb_randr_get_output_property_reply_t *prop =
+		xcb_randr_get_output_property_reply(
+			xcb,
+			xcb_randr_get_output_property(xcb, output, atom,
+						      XCB_ATOM_INTEGER, 0, 1,
+						      0, 0),
+			NULL);
+	uint32_t id = 0;
+	if (prop && prop->format == 32 && prop->num_items == 1)
+		memcpy(&id, xcb_randr_get_output_property_data(prop),
+		       sizeof(id));
+	free(prop);
+	return id;
+}
+
+bool xcb_xwindow_crtc_origin(xcb_connection_t *xcb, uint32_t connector_id,
+			     int width, int height, int *x, int *y)
+{
+	if (!xcb || xcb_connection_has_error(xcb))
+		return false;
+
+	/* GetScreenResourcesCurrent needs RandR 1.3 */
+	xcb_randr_query_version_reply_t *version =
+		xcb_randr_query_version_reply(
+			xcb, xcb_randr_query_version(xcb, 1, 3), NULL);
+	const bool has_current =
+		version && (version->major_version > 1 ||
+			    version->minor_version >= 3);
+	free(version);
+	if (!has_current)
+		return false;
+
+	xcb_randr_get_screen_resources_current_reply_t *res =
+		xcb_randr_get_screen_resources_current_reply(
+			xcb,
+			xcb_randr_get_screen_resources_current(
+				xcb, xcb_xwindow_root(xcb)),
+			NULL);
+	if (!res)
+		return false;
+
+	/* Only there if the driver has made it, don't create it */
+	static const char connector_id_name[] = "CONNECTOR_ID";
+	xcb_intern_atom_reply_t *atom = xcb_intern_atom_reply(
+		xcb,
+		xcb_intern_atom(xcb, 1, sizeof(connector_id_name) - 1,
+				connector_id_name),
+		NULL);
+	const xcb_atom_t connector_atom = atom ? atom->atom : XCB_ATOM_NONE;
+	free(atom);
+
+	/* Output names are up to the driver ("HDMI-1", "HDMI-A-0", "HDMI1"
+	 * for kernel's HDMI-A-1), so outputs are told apart by connector id
+	 * where the driver reports it and by CRTC mode size otherwise */
+	const xcb_randr_output_t *outputs =
+		xcb_randr_get_screen_resources_current_outputs(res);
+	const int num_outputs =
+		xcb_randr_get_screen_resources_current_outputs_length(res);
+	xcb_randr_crtc_t matched_crtc = XCB_NONE;
+	int matches = 0, found_x = 0, found_y = 0;
+	bool exact = false;
+	for (int i = 0; !exact && i < num_outputs; ++i) {
+		xcb_randr_get_output_info_reply_t *output =
+			xcb_randr_get_output_info_reply(
+				xcb,
+				xcb_randr_get_output_info(
+					xcb, outputs[i], res->config_timestamp),
+				NULL);
+		const xcb_randr_crtc_t crtc_id = output ? output->crtc
+							 : XCB_NONE;
+		free(output);
+		if (crtc_id == XCB_NONE)
+			continue;
+
+		xcb_randr_get_crtc_info_reply_t *crtc =
+			xcb_randr_get_crtc_info_reply(
+				xcb,
+				xcb_randr_get_crtc_info(xcb, crtc_id,
+							res->config_timestamp),
+				NULL);
+		if (!crtc)
+			continue;
+
+		/* RandR reports rotated size, KMS mode is not rotated */
+		const bool sideways =
+			crtc->rotation & (XCB_RANDR_ROTATION_ROTATE_90 |
+					  XCB_RANDR_ROTATION_ROTATE_270);
+		const int crtc_width = sideways ? crtc->height : crtc->width;
+		const int crtc_height = sideways ? crtc->width : crtc->height;
+
+		const uint32_t output_connector_id = xcb_xwindow_connector_id(
+			xcb, outputs[i], connector_atom);
+		if (output_connector_id) {
+			exact = output_connector_id == connector_id;
+		} else if (crtc_width == width && crtc_height == height &&
+			   crtc_id != matched_crtc) {
+			/* Cloned outputs share their CRTC */
+			matched_crtc = crtc_id;
+			matches++;
+		}
+
+		if (exact || matched_crtc == crtc_id) {
+			found_x = crtc->x;
+			found_y = crtc->y;
+		}
+		free(crtc);
+	}
+
+	free(res);
+
+	/* Outputs of the same size can't be told apart */
+	if (!exact && matches != 1)
+		return false;
+
+	*x = found_x;
+	*y = found_y;
+	return true;
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <xcb/xcb.h>
+
+#include <stdbool.h>
+
+/* X11 window whose part of the screen is captured. Its absolute geometry,
+ * and whether anything is stacked on top of it, are kept up to date from
+ * ConfigureNotify and related events. Once it is gone, the first client
+ * window of the same class that shows up is followed instead. */
+typedef struct {
+	xcb_connection_t *xcb;
+	xcb_window_t root;
+	/* 0 while waiting for a window of wm_class to show up */
+	xcb_window_t window;
+	/* Top-level ancestor of window, usually the window manager frame */
+	xcb_window_t frame;
+	/* Class part of WM_CLASS, empty if window is not to be looked for
+	 * again */
+	char wm_class[64];
+	xcb_atom_t client_list;
+
+	/* In root window coordinates */
+	int x, y;
+	int width, height;
+	bool mapped;
+	bool obscured;
+
+	/* Geometry needs to be queried again */
+	bool dirty;
+	/* Only windows around it have changed, check whether it is obscured */
+	bool restacked;
+} xcb_xwindow_t;
+
+typedef struct {
+	xcb_window_t id;
+	char name[128];
+	/* Class part of WM_CLASS, which outlives window ids */
+	char wm_class[64];
+} xcb_xwindow_info_t;
+
+/**
+ * Lists client windows managed by the window manager
+ *
+ * @return number of windows written to windows, at most max
+ */
+int xcb_xwindow_list(xcb_connection_t *xcb, xcb_xwindow_info_t *windows,
+		     int max);
+
+/**
+ * Finds window id, or, if it is gone or has another class by now, the first
+ * client window of wm_class
+ *
+ * @return 0 if there is none
+ */
+xcb_window_t xcb_xwindow_find(xcb_connection_t *xcb, xcb_window_t id,
+			      const char *wm_class);
+
+/**
+ * Starts following window, or, if it is gone and wm_class is given, the
+ * first client window of wm_class once there is one. Geometry is filled in
+ * by the next xcb_xwindow_poll().
+ *
+ * @return false if there is no window to follow yet
+ */
+bool xcb_xwindow_follow(xcb_xwindow_t *xw, xcb_connection_t *xcb,
+			xcb_window_t window, const char *wm_class);
+
+void xcb_xwindow_unfollow(xcb_xwindow_t *xw);
+
+/**
+ * Processes pending events of a followed window without blocking
+ *
+ * @return true if its geometry or state has changed, or if another window
+ * of its class is followed now; window is 0 if it has been destroyed and
+ * there is no other window to follow yet
+ */
+bool xcb_xwindow_poll(xcb_xwindow_t *xw);
+
+/**
+ * Finds where the KMS CRTC driving connector_id with a width x height mode
+ * is in root window coordinates
+ *
+ * @return false if there is no such RandR CRTC, or it can't be told apart
+ * from others of the same size
+ */
+bool xcb_xwindow_crtc_origin(xcb_connection_t *xcb, uint32_t connector_id,
+			     int width, int height, int *x, int *y);